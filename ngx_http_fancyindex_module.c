@@ -23,6 +23,35 @@
 #include <ngx_core.h>
 #include <ngx_http.h>
 #include <ngx_log.h>
+#include <ngx_md5.h>
+
+#if (NGX_LINUX)
+#include <sys/xattr.h>
+#include <sys/inotify.h>
+#endif /* NGX_LINUX */
+
+/* Detected at configure time, see the "config" file. */
+#if (NGX_HTTP_FANCYINDEX_IO_URING)
+#include <liburing.h>
+#endif /* NGX_HTTP_FANCYINDEX_IO_URING */
+
+/*
+ * USDT probes for tracing with bpftrace, perf, SystemTap, etc. They are
+ * only built in if requested at configure time, see HACKING.md.
+ */
+#if (NGX_HTTP_FANCYINDEX_USDT)
+#include <sys/sdt.h>
+#define ngx_http_fancyindex_probe1(name, a1) \
+    DTRACE_PROBE1(fancyindex, name, a1)
+#define ngx_http_fancyindex_probe2(name, a1, a2) \
+    DTRACE_PROBE2(fancyindex, name, a1, a2)
+#define ngx_http_fancyindex_probe3(name, a1, a2, a3) \
+    DTRACE_PROBE3(fancyindex, name, a1, a2, a3)
+#else /* !NGX_HTTP_FANCYINDEX_USDT */
+#define ngx_http_fancyindex_probe1(name, a1)
+#define ngx_http_fancyindex_probe2(name, a1, a2)
+#define ngx_http_fancyindex_probe3(name, a1, a2, a3)
+#endif /* NGX_HTTP_FANCYINDEX_USDT */
 
 #include "template.h"
 
@@ -140,11 +169,46 @@ ngx_fancyindex_timefmt (u_char *buffer, const ngx_str_t *fmt, const ngx_tm_t *tm
 #undef DATETIME_CASE
 }
 
+/**
+ * Contents of a local header or footer file read after startup. Buffers
+ * being sent keep a reference, so they are freed once no longer in use.
+ */
+typedef struct {
+    ngx_uint_t count;
+    size_t     len;
+    u_char    *data;  /**< Allocated along with the structure. */
+} ngx_fancyindex_local_data_t;
+
+/**
+ * State of a local header or footer file, which is read again when
+ * open_file_cache notices that it changed.
+ */
+typedef struct {
+    ngx_file_uniq_t uniq;
+    time_t          mtime;
+    off_t           size;
+    ngx_fancyindex_local_data_t *data; /**< Or NULL if not read again. */
+} ngx_fancyindex_local_file_t;
+
 typedef struct {
     ngx_str_t path;
     ngx_str_t local;
+    ngx_fancyindex_local_file_t *file; /**< For "local" only. */
 } ngx_fancyindex_headerfooter_conf_t;
 
+/**
+ * Per-worker cache of scanned directories, see fancyindex_scan_cache.
+ */
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    ngx_queue_t        expire_queue;
+    ngx_uint_t         current;
+    ngx_uint_t         max;
+    time_t             inactive;
+    time_t             valid;
+} ngx_http_fancyindex_scan_cache_t;
+
 /**
  * Configuration structure for the fancyindex module. The configuration
  * commands defined in the module do fill in the members of this structure.
@@ -160,12 +224,53 @@ typedef struct {
     ngx_flag_t show_path;      /**< Whether to display or not the path + '</h1>' after the header */
     ngx_flag_t hide_parent;    /**< Hide parent directory. */
     ngx_flag_t show_dot_files; /**< Show files that start with a dot.*/
+    ngx_flag_t compact;        /**< Render rows with less markup. */
 
     ngx_str_t  css_href;       /**< Link to a CSS stylesheet, or empty if none. */
+    ngx_str_t  css_link;       /**< The <link> element for css_href. */
     ngx_str_t  time_format;    /**< Format used for file timestamps. */
 
     ngx_array_t *ignore;       /**< List of files to ignore in listings. */
 
+    ngx_uint_t max_depth;      /**< Maximum depth of recursive listings. */
+    ngx_msec_t scan_timeout;   /**< Time limit of scans, or zero. */
+    ngx_uint_t max_entries;    /**< Entry limit of scans, or zero. */
+    ngx_uint_t parallel_sort;  /**< Entries to sort in the thread pool, or zero. */
+    ngx_uint_t summary_threshold; /**< Entries above which to summarize, or zero. */
+    ngx_flag_t archive;        /**< Allow downloading tar archives. */
+    ngx_flag_t events;         /**< Allow following changes with "?W=1". */
+#if (NGX_THREADS)
+    ngx_thread_pool_t *thread_pool; /**< Pool used to scan trees, or NULL. */
+#endif
+    ngx_flag_t io_uring;       /**< Get file information with io_uring. */
+    ngx_http_fancyindex_scan_cache_t *scan_cache; /**< Or NULL if disabled. */
+    ngx_str_t  index_path;     /**< Directory for index files, or empty. */
+    uint32_t   index_filter;   /**< Checksum of the settings which filter entries. */
+
+    ngx_shm_zone_t *checksum_zone; /**< Digests of files, or NULL if disabled. */
+    ngx_flag_t checksum_xattr; /**< Keep digests in extended attributes too. */
+
+    ngx_shm_zone_t *cache_zone; /**< Rendered listings, or NULL if disabled. */
+    uint32_t   cache_settings; /**< Checksum of the settings which affect them. */
+    time_t     cache_valid;    /**< Maximum age of cached listings. */
+    ngx_flag_t cache_lock;     /**< Wait for listings being rendered. */
+    ngx_msec_t cache_lock_timeout;
+    ngx_flag_t cache_use_stale; /**< Serve stale listings while updating. */
+    time_t     cache_max_stale; /**< Maximum age of stale listings. */
+    ngx_flag_t cache_patch;    /**< Reuse rows of replaced listings. */
+
+    ngx_shm_zone_t *scan_limit_zone; /**< Scans per device, or NULL if disabled. */
+    ngx_uint_t scan_limit;     /**< Concurrent scans per device. */
+    ngx_uint_t scan_limit_queue; /**< Scans which may wait for a slot. */
+    ngx_msec_t scan_limit_timeout;
+
+    time_t     cache_control;  /**< max-age sent in Cache-Control, or -1. */
+    time_t     cache_control_swr; /**< stale-while-revalidate, or -1. */
+    ngx_flag_t surrogate_key;  /**< Send Surrogate-Key for the directory. */
+
+    ngx_shm_zone_t *purge_zone; /**< Listings purged here, or NULL. */
+    ngx_http_complex_value_t *purge_prefix; /**< URI prefix to purge. */
+
     ngx_fancyindex_headerfooter_conf_t header;
     ngx_fancyindex_headerfooter_conf_t footer;
 } ngx_http_fancyindex_loc_conf_t;
@@ -176,6 +281,7 @@ typedef struct {
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC  3
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC  4
 #define NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC  5
+#define NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE       6
 
 static ngx_conf_enum_t ngx_http_fancyindex_sort_criteria[] = {
     { ngx_string("name"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME },
@@ -184,9 +290,21 @@ static ngx_conf_enum_t ngx_http_fancyindex_sort_criteria[] = {
     { ngx_string("name_desc"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC },
     { ngx_string("size_desc"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC },
     { ngx_string("date_desc"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC },
+    { ngx_string("none"), NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE },
     { ngx_null_string, 0 }
 };
 
+/* Indexed by NGX_HTTP_FANCYINDEX_SORT_CRITERION_* */
+static const char *ngx_http_fancyindex_sort_url_args[] = {
+    "?C=N&amp;O=A",
+    "?C=S&amp;O=A",
+    "?C=M&amp;O=A",
+    "?C=N&amp;O=D",
+    "?C=S&amp;O=D",
+    "?C=M&amp;O=D",
+    "?C=U&amp;O=A",
+};
+
 enum {
     NGX_HTTP_FANCYINDEX_HEADERFOOTER_SUBREQUEST,
     NGX_HTTP_FANCYINDEX_HEADERFOOTER_LOCAL,
@@ -283,6 +401,18 @@ ngx_fancyindex_conf_set_headerfooter(ngx_conf_t *cf, ngx_command_t *cmd, void *c
             n -= r;
         }
         item->local.data[item->local.len] = '\0';
+
+        item->file = ngx_pcalloc(cf->pool, sizeof(ngx_fancyindex_local_file_t));
+        if (item->file == NULL) {
+            ngx_close_file(file.fd);
+            return NGX_CONF_ERROR;
+        }
+
+        item->file->uniq = ngx_file_uniq(&fi);
+        item->file->mtime = ngx_file_mtime(&fi);
+        item->file->size = ngx_file_size(&fi);
+
+        ngx_close_file(file.fd);
     }
 
     return NGX_CONF_OK;
@@ -290,6 +420,433 @@ ngx_fancyindex_conf_set_headerfooter(ngx_conf_t *cf, ngx_command_t *cmd, void *c
 
 #define NGX_HTTP_FANCYINDEX_PREALLOCATE  50
 
+/*
+ * Hard limits for recursive listings: no matter which depth is requested,
+ * or what fancyindex_max_entries and fancyindex_scan_timeout are set to,
+ * the traversal stops after collecting this many entries, or after this
+ * many milliseconds have elapsed since it started.
+ */
+#define NGX_HTTP_FANCYINDEX_RECURSIVE_MAX_ENTRIES  100000
+#define NGX_HTTP_FANCYINDEX_RECURSIVE_TIMEOUT      10000
+
+/*
+ * Maximum number of thread pool tasks among which the directories of each
+ * level of a recursive listing are distributed.
+ */
+#define NGX_HTTP_FANCYINDEX_SCAN_TASKS  8
+
+/*
+ * Index files start with a header, followed by the path of the directory
+ * (padded to 8 bytes), the array of entries, and their names, which are
+ * NUL-terminated so they can be used in place once the file is mapped.
+ * All the numbers are in host byte order.
+ */
+#define NGX_HTTP_FANCYINDEX_INDEX_MAGIC    0x58444946 /* "FIDX" */
+#define NGX_HTTP_FANCYINDEX_INDEX_VERSION  2
+
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  filter;       /**< ngx_http_fancyindex_loc_conf_t.index_filter */
+    uint32_t  flags;        /**< NGX_HTTP_FANCYINDEX_SCAN_* */
+    uint64_t  uniq;         /**< Of the directory. */
+    int64_t   mtime;        /**< Of the directory. */
+    uint64_t  nentries;
+    uint64_t  path_len;
+    uint64_t  names_len;
+} ngx_http_fancyindex_index_header_t;
+
+typedef struct {
+    int64_t   mtime;
+    int64_t   size;
+    uint64_t  uniq;
+    uint64_t  name;         /**< Offset of the name from the first one. */
+    uint32_t  name_len;
+    uint32_t  utf_len;
+    uint32_t  escape;
+    uint32_t  escape_html;
+    uint8_t   dir;
+    uint8_t   link;
+    uint8_t   padding[6];
+} ngx_http_fancyindex_index_entry_t;
+
+/*
+ * Digests of files are computed in a thread pool, and kept in a shared
+ * memory zone (and optionally in an extended attribute of the file) keyed
+ * by inode, size and mtime. Each listing requests the digests of up to
+ * NGX_HTTP_FANCYINDEX_CHECKSUM_TASKS files which are not known yet;
+ * requests which did not complete after NGX_HTTP_FANCYINDEX_CHECKSUM_TIMEOUT
+ * seconds (e.g. because the worker process which made them exited) are
+ * made again.
+ */
+#define NGX_HTTP_FANCYINDEX_SHA256_LEN          32
+#define NGX_HTTP_FANCYINDEX_CHECKSUM_TASKS      32
+#define NGX_HTTP_FANCYINDEX_CHECKSUM_TIMEOUT    60
+#define NGX_HTTP_FANCYINDEX_CHECKSUM_BUFSIZE    65536
+#define NGX_HTTP_FANCYINDEX_CHECKSUM_XATTR      "user.fancyindex.sha256"
+
+typedef struct {
+    uint64_t  uniq;
+    int64_t   size;
+    int64_t   mtime;
+} ngx_http_fancyindex_checksum_key_t;
+
+typedef struct {
+    ngx_rbtree_node_t                   node;  /**< Key is a CRC32 of "key" */
+    ngx_queue_t                         queue;
+    ngx_http_fancyindex_checksum_key_t  key;
+    time_t                              queued;
+    u_char                              done;
+    u_char                              digest[NGX_HTTP_FANCYINDEX_SHA256_LEN];
+} ngx_http_fancyindex_checksum_node_t;
+
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    ngx_queue_t        queue;      /**< Least recently used last. */
+} ngx_http_fancyindex_checksum_sh_t;
+
+typedef struct {
+    ngx_http_fancyindex_checksum_sh_t *sh;
+    ngx_slab_pool_t                   *shpool;
+} ngx_http_fancyindex_checksum_ctx_t;
+
+/* Contents of the extended attribute. */
+typedef struct {
+    int64_t   size;
+    int64_t   mtime;
+    u_char    digest[NGX_HTTP_FANCYINDEX_SHA256_LEN];
+} ngx_http_fancyindex_checksum_xattr_t;
+
+/*
+ * Rendered listings are kept in a shared memory zone, keyed by a MD5 hash
+ * of everything which affects the output. A node being rendered is marked
+ * as "updating", and with fancyindex_cache_lock other requests for the same
+ * listing check periodically for the result instead of scanning the
+ * directory too, the same as proxy_cache_lock does.
+ */
+#define NGX_HTTP_FANCYINDEX_CACHE_LOCK_POLL     50
+
+/*
+ * With "path=" the zone only keeps the index, and listings are written to
+ * files named after the key, like proxy_cache_path does, which are sent
+ * with sendfile. The cache manager process removes the least recently
+ * used ones above "max_size", and temporary files older than
+ * NGX_HTTP_FANCYINDEX_CACHE_TEMP_AGE seconds. Files left over by a previous
+ * run are added back to the zone if a location which uses it still renders
+ * listings with the same settings, and removed otherwise.
+ */
+#define NGX_HTTP_FANCYINDEX_CACHE_MANAGER_SLEEP 10000
+#define NGX_HTTP_FANCYINDEX_CACHE_MANAGER_BATCH 100
+#define NGX_HTTP_FANCYINDEX_CACHE_TEMP_AGE      60
+
+/*
+ * Files of cached listings start with a header, followed by the URI of the
+ * listing (padded to 8 bytes) and the listing itself. All the numbers are
+ * in host byte order.
+ */
+#define NGX_HTTP_FANCYINDEX_CACHE_MAGIC    0x43494946 /* "FIIC" */
+#define NGX_HTTP_FANCYINDEX_CACHE_VERSION  1
+
+typedef struct {
+    uint32_t  magic;
+    uint32_t  version;
+    uint32_t  settings;     /**< ngx_http_fancyindex_loc_conf_t.cache_settings */
+    uint32_t  uri_len;
+    uint64_t  uniq;         /**< Of the directory. */
+    int64_t   mtime;        /**< Of the directory. */
+    int64_t   created;
+    uint64_t  len;          /**< Of the listing. */
+} ngx_http_fancyindex_cache_header_t;
+
+#define ngx_http_fancyindex_cache_body(uri_len)                               \
+    (sizeof(ngx_http_fancyindex_cache_header_t) + ngx_align(uri_len, 8))
+
+/**
+ * Row of a cached listing, kept with fancyindex_cache_patch so the markup
+ * of entries which did not change can be copied when the listing is
+ * rendered again. Rows are sorted by "hash", which covers the name.
+ */
+typedef struct {
+    uint64_t           hash;
+    off_t              size;       /**< Or -1 for directories. */
+    time_t             mtime;
+    uint32_t           offset;     /**< In the body. */
+    uint32_t           len;
+} ngx_http_fancyindex_cache_row_t;
+
+/**
+ * Rows of the listing being replaced, copied out of the zone, and those of
+ * the new one, see ngx_http_fancyindex_render_patch().
+ */
+typedef struct {
+    ngx_http_fancyindex_cache_row_t *base;
+    ngx_uint_t                       nbase;
+    u_char                          *body;    /**< Of the old listing. */
+    ngx_int_t                        gmtoff;  /**< Used to render dates. */
+    ngx_http_fancyindex_cache_row_t *rows;
+    ngx_uint_t                       nrows;
+    ngx_uint_t                       reused;
+} ngx_http_fancyindex_patch_t;
+
+typedef struct {
+    ngx_rbtree_node_t  node;       /**< Key is the start of "key". */
+    ngx_queue_t        queue;
+    u_char             key[16];
+    uint64_t           uniq;       /**< Of the directory. */
+    time_t             mtime;      /**< Of the directory. */
+    time_t             created;
+    time_t             lock;       /**< Updating until, if "updating". */
+    uint32_t           settings;   /**< Rendered with, see cache_settings. */
+    ngx_uint_t         generation; /**< Of the zone when saved as "watched". */
+    size_t             len;
+    u_char            *body;       /**< Or NULL if in a file. */
+    ngx_http_fancyindex_cache_row_t *rows; /**< Or NULL if not kept. */
+    ngx_uint_t         nrows;
+    ngx_int_t          gmtoff;     /**< Used to render dates. */
+    unsigned           updating:1;
+    unsigned           watched:1;  /**< Kept up to date by fancyindex_watch. */
+    unsigned           stored:1;   /**< Rendered, in "body" or in a file. */
+    size_t             uri_len;
+    u_char             uri[1];     /**< Of the listing, see fancyindex_purge. */
+} ngx_http_fancyindex_cache_node_t;
+
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+    ngx_queue_t        queue;      /**< Least recently used last. */
+    ngx_uint_t         generation; /**< Incremented on reloads. */
+    off_t              size;       /**< Of the files. */
+} ngx_http_fancyindex_cache_sh_t;
+
+typedef struct {
+    ngx_http_fancyindex_cache_sh_t *sh;
+    ngx_slab_pool_t                *shpool;
+    ngx_uint_t                      generation;
+    ngx_array_t                     settings; /**< Of the locations using it. */
+    ngx_path_t                     *path;     /**< Or NULL if kept in the zone. */
+    off_t                           max_size; /**< Of the files, or zero. */
+    ngx_flag_t                      cleaned;  /**< Left over files removed. */
+} ngx_http_fancyindex_cache_ctx_t;
+
+/*
+ * Directory scans admitted by fancyindex_scan_limit are counted per device
+ * in a zone shared by all locations, which is created implicitly. Scans in
+ * excess wait for a slot checking periodically, like fancyindex_cache_lock
+ * does, and new ones do not take a slot while others are waiting for one.
+ */
+#define NGX_HTTP_FANCYINDEX_SCAN_LIMIT_ZONE     "fancyindex_scan_limit"
+#define NGX_HTTP_FANCYINDEX_SCAN_LIMIT_SIZE     (64 * 1024)
+#define NGX_HTTP_FANCYINDEX_SCAN_LIMIT_POLL     50
+
+typedef struct {
+    ngx_rbtree_node_t  node;       /**< Key is the device number. */
+    ngx_uint_t         active;     /**< Scans in progress. */
+    ngx_uint_t         queued;     /**< Scans waiting for a slot. */
+} ngx_http_fancyindex_scan_limit_node_t;
+
+typedef struct {
+    ngx_rbtree_t       rbtree;
+    ngx_rbtree_node_t  sentinel;
+} ngx_http_fancyindex_scan_limit_sh_t;
+
+typedef struct {
+    ngx_http_fancyindex_scan_limit_sh_t *sh;
+    ngx_slab_pool_t                     *shpool;
+} ngx_http_fancyindex_scan_limit_ctx_t;
+
+/**
+ * Directory tree whose listings are rendered in advance into the cache of
+ * a location, see fancyindex_watch and fancyindex_preload. Only listings
+ * with the default sorting are rendered.
+ */
+typedef struct {
+    ngx_str_t                       uri;
+    ngx_str_t                       path;  /**< Of the directory at uri. */
+    ngx_uint_t                      depth;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    const char                     *directive;
+    u_char                         *file;  /**< Where it was configured. */
+    ngx_uint_t                      line;
+} ngx_http_fancyindex_tree_t;
+
+typedef struct {
+    ngx_rbtree_node_t  node;       /**< Key is the watch descriptor. */
+    ngx_queue_t        queue;      /**< Of directories to render. */
+    ngx_http_fancyindex_tree_t *tree;
+    ngx_str_t          path;       /**< NUL-terminated. */
+    size_t             allocated;  /**< Bytes available at path.data */
+    ngx_str_t          uri;
+    ngx_uint_t         depth;      /**< Levels of subdirectories left. */
+    unsigned           dirty:1;    /**< Changed, in the queue. */
+} ngx_http_fancyindex_tree_dir_t;
+
+/*
+ * Trees configured with fancyindex_watch are watched with inotify from the
+ * cache manager process, which Nginx starts when some path has a "manager"
+ * callback. Changes are collected for a short while, and then the listings
+ * of the changed directories are rendered into the cache.
+ */
+#define NGX_HTTP_FANCYINDEX_WATCH_PATH    "fancyindex_watch"
+#define NGX_HTTP_FANCYINDEX_WATCH_DELAY   500
+#define NGX_HTTP_FANCYINDEX_WATCH_RETRY   60000
+
+#define NGX_HTTP_FANCYINDEX_WATCH_EVENTS                                      \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE                       \
+     | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct {
+    ngx_http_fancyindex_tree_t      tree;
+
+    /* Used in the cache manager process. */
+    ngx_connection_t               *connection; /**< Or NULL if not started. */
+    ngx_rbtree_t                    rbtree;     /**< Watched directories. */
+    ngx_rbtree_node_t               sentinel;
+    ngx_queue_t                     dirty;
+    ngx_event_t                     event;      /**< Renders changed ones. */
+} ngx_http_fancyindex_watch_t;
+
+/*
+ * Requests with "?W=1" in locations with fancyindex_events follow the
+ * changes of a directory. Each worker process watches the directories
+ * being followed with its own inotify descriptor, with a single watch
+ * per directory for all of its followers. Events are written into the
+ * "pending" buffer of each follower, and sent from it when the previous
+ * ones are out; followers which fall further behind are disconnected.
+ */
+#define NGX_HTTP_FANCYINDEX_EVENTS_BUFFER  4096
+
+#define NGX_HTTP_FANCYINDEX_EVENTS_MASK                                       \
+    (IN_ATTRIB | IN_CLOSE_WRITE | IN_CREATE | IN_DELETE | IN_DELETE_SELF     \
+     | IN_MOVE_SELF | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR)
+
+typedef struct {
+    ngx_rbtree_node_t  node;        /**< Key is the watch descriptor. */
+    ngx_queue_t        queue;       /**< Of watched directories. */
+    ngx_queue_t        subscribers;
+    ngx_str_t          path;        /**< NUL-terminated. */
+    unsigned           removed:1;   /**< Waiting for IN_IGNORED. */
+} ngx_http_fancyindex_events_dir_t;
+
+/*
+ * Trees configured with fancyindex_preload are rendered by the first
+ * worker process after it starts, one directory at a time.
+ */
+#define NGX_HTTP_FANCYINDEX_PRELOAD_DELAY  1000
+#define NGX_HTTP_FANCYINDEX_PRELOAD_PACE   20
+
+/*
+ * Rendered listings of at least 2^NGX_HTTP_FANCYINDEX_BUFFER_SHIFT bytes
+ * use buffers rounded up to a power of two, which each process keeps for
+ * reuse once the pool they were taken for is destroyed, as long as the
+ * total is below fancyindex_buffer_pool. Smaller and larger listings are
+ * allocated from pools as usual.
+ */
+#define NGX_HTTP_FANCYINDEX_BUFFER_SHIFT    16  /* 64 KiB */
+#define NGX_HTTP_FANCYINDEX_BUFFER_CLASSES  12  /* Up to 128 MiB */
+
+typedef struct {
+    ngx_array_t  watches;          /**< Of ngx_http_fancyindex_watch_t */
+    ngx_array_t  preloads;         /**< Of ngx_http_fancyindex_tree_t */
+    ngx_queue_t  preload_queue;    /**< Directories left to render. */
+    ngx_event_t  preload_event;
+
+    size_t       buffer_pool;      /**< Bytes kept for reuse, or zero. */
+    size_t       buffer_retained;  /**< Bytes in the buffers lists. */
+    ngx_queue_t  buffers[NGX_HTTP_FANCYINDEX_BUFFER_CLASSES];
+#if (NGX_THREADS)
+    ngx_thread_mutex_t  buffer_mutex; /**< Listings are rendered in threads too. */
+#endif
+
+    ngx_uint_t   events_watches;     /**< Maximum per process. */
+    ngx_uint_t   events_subscribers; /**< Maximum per process. */
+#if (NGX_LINUX)
+    ngx_connection_t *events_connection; /**< Or NULL if not started. */
+    ngx_rbtree_t      events_rbtree;     /**< Watched directories. */
+    ngx_rbtree_node_t events_sentinel;
+    ngx_queue_t       events_dirs;
+    ngx_uint_t        events_nwatches;
+    ngx_uint_t        events_nsubscribers;
+#endif
+} ngx_http_fancyindex_main_conf_t;
+
+#if (NGX_LINUX)
+typedef struct {
+    ngx_queue_t                       queue;
+    ngx_http_request_t               *request;
+    ngx_http_fancyindex_main_conf_t  *amcf;
+    ngx_http_fancyindex_events_dir_t *dir;     /**< Or NULL once detached. */
+    ngx_buf_t                        *out;     /**< Being sent. */
+    ngx_buf_t                        *pending; /**< Events to send next. */
+    ngx_chain_t                       chain;
+    unsigned                          busy:1;  /**< "out" is not sent yet. */
+} ngx_http_fancyindex_events_sub_t;
+#endif /* NGX_LINUX */
+
+/** Header of a render buffer, followed by its contents. */
+typedef struct {
+    ngx_queue_t                      queue;
+    ngx_uint_t                       class; /**< Size is 2^(SHIFT + class) */
+    ngx_http_fancyindex_main_conf_t *amcf;
+} ngx_http_fancyindex_buffer_t;
+
+#if (NGX_THREADS)
+#define ngx_http_fancyindex_buffer_lock(amcf) \
+    (void) ngx_thread_mutex_lock(&(amcf)->buffer_mutex, ngx_cycle->log)
+#define ngx_http_fancyindex_buffer_unlock(amcf) \
+    (void) ngx_thread_mutex_unlock(&(amcf)->buffer_mutex, ngx_cycle->log)
+#else
+#define ngx_http_fancyindex_buffer_lock(amcf)
+#define ngx_http_fancyindex_buffer_unlock(amcf)
+#endif /* NGX_THREADS */
+
+/**
+ * Limits of a scan, checked by ngx_http_fancyindex_read_dir() before each
+ * entry is added. Deadlines are checked with the actual time, as the time
+ * cached by Nginx is not updated during a scan.
+ */
+typedef struct {
+    ngx_uint_t     max;       /**< Maximum number of entries, or zero. */
+    ngx_uint_t     read;      /**< Entries read by previous batches. */
+    ngx_msec_t     deadline;  /**< Per ngx_http_fancyindex_msec(), or zero. */
+    ngx_uint_t     truncated; /**< Set when a limit is reached. */
+    ngx_str_t      prefix;    /**< Only entries starting with it, or empty. */
+} ngx_http_fancyindex_limit_t;
+
+/*
+ * Listings of directories with more than fancyindex_summary_threshold
+ * entries are replaced by counts of entries grouped by type (extension),
+ * by age, and by the first character after the prefix being viewed, which
+ * are added up as the directory is read.
+ */
+#define NGX_HTTP_FANCYINDEX_SUMMARY_TYPES     24
+#define NGX_HTTP_FANCYINDEX_SUMMARY_TYPE_LEN  8
+#define NGX_HTTP_FANCYINDEX_SUMMARY_AGES      6
+
+typedef struct {
+    u_char         name[NGX_HTTP_FANCYINDEX_SUMMARY_TYPE_LEN]; /**< Lowercase. */
+    size_t         len;
+    ngx_uint_t     count;
+    off_t          size;
+} ngx_http_fancyindex_summary_group_t;
+
+typedef struct {
+    ngx_uint_t     ntypes;
+    ngx_http_fancyindex_summary_group_t types[NGX_HTTP_FANCYINDEX_SUMMARY_TYPES];
+    ngx_http_fancyindex_summary_group_t dirs;
+    ngx_http_fancyindex_summary_group_t untyped;  /**< Without extension. */
+    ngx_http_fancyindex_summary_group_t other;    /**< When types is full. */
+    ngx_http_fancyindex_summary_group_t total;
+    ngx_http_fancyindex_summary_group_t ages[NGX_HTTP_FANCYINDEX_SUMMARY_AGES];
+    ngx_uint_t     next[256]; /**< By the byte after the prefix, lowercase. */
+} ngx_http_fancyindex_summary_t;
+
+/* Flags for ngx_http_fancyindex_read_dir() */
+#define NGX_HTTP_FANCYINDEX_SCAN_UTF8    0x01 /**< Response charset is UTF-8 */
+#define NGX_HTTP_FANCYINDEX_SCAN_IGNORE  0x02 /**< Apply fancyindex_ignore */
+#define NGX_HTTP_FANCYINDEX_SCAN_THREAD  0x04 /**< Run by a thread pool task */
+
 
 /**
  * Calculates the length of a NULL-terminated string. It is ugly having to
@@ -330,11 +887,186 @@ typedef struct {
     ngx_uint_t     escape;
     ngx_uint_t     escape_html;
     ngx_uint_t     dir;
+    ngx_uint_t     link;
     time_t         mtime;
     off_t          size;
+    ngx_file_uniq_t uniq;
+    u_char        *checksum;  /**< SHA-256 digest, or NULL if not known. */
 } ngx_http_fancyindex_entry_t;
 
 
+/**
+ * Entries of a directory kept in the scan cache. They are sorted newest
+ * first, so the ones modified since a given time are always at the start.
+ */
+typedef struct {
+    ngx_str_node_t   sn;        /**< Keyed by the path of the directory. */
+    ngx_queue_t      queue;
+    ngx_pool_t      *pool;      /**< Holds the node itself and its entries. */
+    ngx_http_fancyindex_entry_t *entries;
+    ngx_uint_t       nentries;
+    ngx_http_fancyindex_loc_conf_t *alcf; /**< Used to filter entries. */
+    ngx_uint_t       flags;     /**< NGX_HTTP_FANCYINDEX_SCAN_* */
+    ngx_file_uniq_t  uniq;      /**< Of the directory. */
+    time_t           mtime;     /**< Of the directory. */
+    time_t           created;
+    time_t           accessed;
+    ngx_uint_t       count;     /**< Requests using the entries. */
+    unsigned         removed:1;
+} ngx_http_fancyindex_scan_node_t;
+
+
+/**
+ * A directory pending to be scanned in a recursive listing.
+ */
+typedef struct {
+    ngx_str_t      path;      /**< Full path, NUL-terminated. */
+    size_t         allocated; /**< Bytes available at path.data */
+    ngx_str_t      prefix;    /**< Prepended to the names of its entries. */
+    ngx_uint_t     depth;     /**< Zero for the directory being listed. */
+    ngx_uint_t     nentries;  /**< Set once scanned. */
+} ngx_http_fancyindex_subdir_t;
+
+
+/**
+ * Work item used to scan a slice of the directories of one level of a
+ * recursive listing, either in a thread pool or synchronously.
+ */
+typedef struct {
+    ngx_http_request_t             *request;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_pool_t                     *pool;     /**< Owned by the task. */
+    ngx_http_fancyindex_subdir_t   *dirs;
+    ngx_uint_t                      ndirs;
+    ngx_uint_t                      flags;
+    ngx_http_fancyindex_limit_t     limit;
+    ngx_array_t                     entries;  /**< Allocated from pool */
+} ngx_http_fancyindex_scan_t;
+
+
+/**
+ * Files of a tar archive are sent in batches of this many, which is the
+ * most file descriptors kept open by a request at any time.
+ */
+#define NGX_HTTP_FANCYINDEX_TAR_BATCH  16
+#define NGX_HTTP_FANCYINDEX_TAR_BLOCK  512
+
+/**
+ * Buffers used to send one entry of a tar archive, reused by each batch.
+ */
+typedef struct {
+    u_char         header[NGX_HTTP_FANCYINDEX_TAR_BLOCK];
+    ngx_buf_t      bufs[3];   /**< Header, contents and padding. */
+    ngx_chain_t    chain[3];
+    ngx_file_t     file;
+} ngx_http_fancyindex_tar_slot_t;
+
+/**
+ * State of a tar archive being streamed, see ngx_http_fancyindex_tar_send().
+ */
+typedef struct {
+    ngx_http_fancyindex_entry_t    *entries;
+    ngx_uint_t                      nentries;
+    ngx_uint_t                      next;    /**< First entry not sent yet. */
+    ngx_uint_t                      nslots;  /**< Used by the current batch. */
+    ngx_http_fancyindex_tar_slot_t  slots[NGX_HTTP_FANCYINDEX_TAR_BATCH];
+    ngx_buf_t                       trailer;
+    ngx_chain_t                     trailer_chain;
+    unsigned                        busy:1;  /**< A batch is being sent. */
+    unsigned                        done:1;  /**< The trailer was sent. */
+} ngx_http_fancyindex_tar_t;
+
+
+/**
+ * Unsorted listings are rendered and sent this many entries at a time.
+ */
+#define NGX_HTTP_FANCYINDEX_STREAM_BATCH  256
+
+/**
+ * State of an unsorted listing being streamed while the directory is read,
+ * see ngx_http_fancyindex_stream_open().
+ */
+typedef struct {
+    ngx_dir_t      dir;
+    ngx_pool_t    *pool;     /**< Entries and rows of the current batch. */
+    ngx_array_t    entries;
+    ngx_uint_t     count;    /**< Entries read so far. */
+    const char    *sort_url_args;
+    ngx_chain_t    out;
+    unsigned       open:1;   /**< The directory is still open. */
+    unsigned       busy:1;   /**< A batch is being sent. */
+} ngx_http_fancyindex_stream_t;
+
+
+/**
+ * Listings with at least fancyindex_parallel_sort entries are sorted in
+ * the thread pool: the entries are split into runs sorted by separate
+ * tasks, which are then merged in pairs, one round at a time, until one
+ * run is left. Merges are split into pieces, so each round uses up to
+ * this many tasks too.
+ */
+#define NGX_HTTP_FANCYINDEX_SORT_TASKS  8
+
+/**
+ * State of a listing being sorted in the thread pool, see
+ * ngx_http_fancyindex_sort_start().
+ */
+typedef struct {
+    ngx_array_t   *entries;
+    ngx_http_fancyindex_entry_t *src;  /**< Runs of the current round. */
+    ngx_http_fancyindex_entry_t *dst;  /**< Where runs are merged into. */
+    ngx_uint_t     runs[NGX_HTTP_FANCYINDEX_SORT_TASKS + 2]; /**< Starts, and the end. */
+    ngx_uint_t     nruns;
+    int (ngx_libc_cdecl *cmp)(const void *one, const void *two);
+    ngx_uint_t     criterion;
+    const char    *sort_url_args;
+    unsigned       dirs_first:1;
+    unsigned       sorted:1;   /**< Runs have been sorted. */
+} ngx_http_fancyindex_sort_t;
+
+
+/**
+ * Per-request state, needed when the listing is not generated in one go.
+ */
+typedef struct {
+    ngx_str_t      path;      /**< Directory being listed, NUL-terminated. */
+    size_t         allocated; /**< Bytes available at path.data */
+    ngx_array_t    entries;
+    ngx_uint_t     flags;     /**< NGX_HTTP_FANCYINDEX_SCAN_* */
+    ngx_uint_t     depth;     /**< Requested recursion depth. */
+    ngx_array_t    frontier;  /**< Directories to scan in the next level. */
+    ngx_uint_t     pending;   /**< Outstanding thread pool tasks. */
+    ngx_http_fancyindex_limit_t limit;
+    ngx_http_fancyindex_scan_t *scans; /**< Tasks of the current level. */
+    ngx_uint_t     nscans;
+    time_t         since;     /**< List entries modified since, or -1. */
+    ngx_str_t      prefix;    /**< List entries starting with it (?P=). */
+    ngx_http_fancyindex_summary_t *summary; /**< Or NULL for a listing. */
+    time_t         mtime;     /**< Of the directory, or -1 if unknown. */
+    ngx_file_uniq_t uniq;     /**< Of the directory, if mtime is known. */
+    u_char         cache_key[16];
+    ngx_msec_t     cache_start; /**< When waiting for the listing started. */
+    ngx_event_t    cache_wait;
+    unsigned       cache_store:1;  /**< Save the listing once rendered. */
+    unsigned       cache_locked:1; /**< Marked the node as updating. */
+    ngx_http_fancyindex_patch_t *cache_patch; /**< Or NULL. */
+    unsigned       archive:1; /**< Send a tar archive, not a listing. */
+    ngx_rbtree_key_t scan_dev; /**< Device of the directory. */
+    ngx_msec_t     scan_start; /**< When waiting for a scan slot started. */
+    ngx_event_t    scan_wait;
+    unsigned       scan_admit:1;  /**< Counted by fancyindex_scan_limit. */
+    unsigned       scan_slot:1;   /**< Holds a scan slot. */
+    unsigned       scan_queued:1; /**< Waits for a scan slot. */
+    unsigned       scan_stream:1; /**< The scan is for a streamed listing. */
+    ngx_http_fancyindex_tar_t *tar;
+    ngx_http_fancyindex_stream_t *stream;
+    ngx_http_fancyindex_sort_t *sort;
+#if (NGX_LINUX)
+    ngx_http_fancyindex_events_sub_t *events;
+#endif
+} ngx_http_fancyindex_ctx_t;
+
+
 
 static int ngx_libc_cdecl
     ngx_http_fancyindex_cmp_entries_name_cs_desc(const void *one, const void *two);
@@ -353,10 +1085,27 @@ static int ngx_libc_cdecl
 static int ngx_libc_cdecl
     ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two);
 
-static ngx_int_t ngx_http_fancyindex_error(ngx_http_request_t *r,
+typedef int (ngx_libc_cdecl *ngx_http_fancyindex_cmp_pt)
+    (const void *one, const void *two);
+
+static ngx_int_t ngx_http_fancyindex_error(ngx_log_t *log,
     ngx_dir_t *dir, ngx_str_t *name);
 
+#if (NGX_THREADS)
+static void ngx_http_fancyindex_scan_resume(ngx_http_request_t *r);
+static void ngx_http_fancyindex_sort_resume(ngx_http_request_t *r);
+#endif /* NGX_THREADS */
+static void ngx_http_fancyindex_cache_wait_handler(ngx_event_t *ev);
+static void ngx_http_fancyindex_scan_wait_handler(ngx_event_t *ev);
+static void ngx_http_fancyindex_stream_write(ngx_http_request_t *r);
+static ngx_int_t ngx_http_fancyindex_cache_refresh(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx, ngx_http_fancyindex_loc_conf_t *alcf);
+
 static ngx_int_t ngx_http_fancyindex_init(ngx_conf_t *cf);
+static ngx_int_t ngx_http_fancyindex_init_process(ngx_cycle_t *cycle);
+
+static void *ngx_http_fancyindex_create_main_conf(ngx_conf_t *cf);
+static char *ngx_http_fancyindex_init_main_conf(ngx_conf_t *cf, void *conf);
 
 static void *ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf);
 
@@ -367,6 +1116,74 @@ static char *ngx_http_fancyindex_ignore(ngx_conf_t    *cf,
                                         ngx_command_t *cmd,
                                         void          *conf);
 
+static char *ngx_http_fancyindex_thread_pool(ngx_conf_t    *cf,
+                                             ngx_command_t *cmd,
+                                             void          *conf);
+
+static char *ngx_http_fancyindex_parallel_sort(ngx_conf_t    *cf,
+                                               ngx_command_t *cmd,
+                                               void          *conf);
+
+static char *ngx_http_fancyindex_io_uring(ngx_conf_t    *cf,
+                                          ngx_command_t *cmd,
+                                          void          *conf);
+
+static char *ngx_http_fancyindex_scan_cache(ngx_conf_t    *cf,
+                                            ngx_command_t *cmd,
+                                            void          *conf);
+
+static char *ngx_http_fancyindex_index_path(ngx_conf_t    *cf,
+                                            ngx_command_t *cmd,
+                                            void          *conf);
+
+static char *ngx_http_fancyindex_checksum_zone(ngx_conf_t    *cf,
+                                               ngx_command_t *cmd,
+                                               void          *conf);
+
+static char *ngx_http_fancyindex_checksum(ngx_conf_t    *cf,
+                                          ngx_command_t *cmd,
+                                          void          *conf);
+
+static char *ngx_http_fancyindex_cache_zone(ngx_conf_t    *cf,
+                                            ngx_command_t *cmd,
+                                            void          *conf);
+
+static char *ngx_http_fancyindex_cache(ngx_conf_t    *cf,
+                                       ngx_command_t *cmd,
+                                       void          *conf);
+
+static char *ngx_http_fancyindex_cache_use_stale(ngx_conf_t    *cf,
+                                                 ngx_command_t *cmd,
+                                                 void          *conf);
+
+static char *ngx_http_fancyindex_cache_control(ngx_conf_t    *cf,
+                                               ngx_command_t *cmd,
+                                               void          *conf);
+
+static char *ngx_http_fancyindex_purge(ngx_conf_t    *cf,
+                                       ngx_command_t *cmd,
+                                       void          *conf);
+
+static char *ngx_http_fancyindex_scan_limit(ngx_conf_t    *cf,
+                                            ngx_command_t *cmd,
+                                            void          *conf);
+
+static char *ngx_http_fancyindex_watch(ngx_conf_t    *cf,
+                                       ngx_command_t *cmd,
+                                       void          *conf);
+
+static char *ngx_http_fancyindex_preload(ngx_conf_t    *cf,
+                                         ngx_command_t *cmd,
+                                         void          *conf);
+
+static char *ngx_http_fancyindex_events(ngx_conf_t    *cf,
+                                        ngx_command_t *cmd,
+                                        void          *conf);
+
+static char *ngx_http_fancyindex_events_limit(ngx_conf_t    *cf,
+                                              ngx_command_t *cmd,
+                                              void          *conf);
+
 static uintptr_t
     ngx_fancyindex_escape_filename(u_char *dst, u_char*src, size_t size);
 
@@ -375,8 +1192,10 @@ static uintptr_t
  * inline them always, if possible (see how ngx_force_inline is defined
  * above).
  */
-static ngx_inline ngx_buf_t*
-    make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
+static ngx_inline ngx_chain_t*
+    make_header_chain(ngx_http_request_t *r,
+                      ngx_http_fancyindex_loc_conf_t *alcf,
+                      ngx_chain_t *next)
     ngx_force_inline;
 
 
@@ -487,39 +1306,242 @@ static ngx_command_t  ngx_http_fancyindex_commands[] = {
       offsetof(ngx_http_fancyindex_loc_conf_t, time_format),
       NULL },
 
-    ngx_null_command
-};
+    { ngx_string("fancyindex_max_depth"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, max_depth),
+      NULL },
 
+    { ngx_string("fancyindex_scan_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, scan_timeout),
+      NULL },
 
-static ngx_http_module_t  ngx_http_fancyindex_module_ctx = {
-    NULL,                                  /* preconfiguration */
-    ngx_http_fancyindex_init,              /* postconfiguration */
+    { ngx_string("fancyindex_max_entries"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, max_entries),
+      NULL },
 
-    NULL,                                  /* create main configuration */
-    NULL,                                  /* init main configuration */
+    { ngx_string("fancyindex_summary_threshold"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_num_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, summary_threshold),
+      NULL },
 
-    NULL,                                  /* create server configuration */
-    NULL,                                  /* merge server configuration */
+    { ngx_string("fancyindex_parallel_sort"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_parallel_sort,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
 
-    ngx_http_fancyindex_create_loc_conf,   /* create location configuration */
-    ngx_http_fancyindex_merge_loc_conf     /* merge location configuration */
-};
+    { ngx_string("fancyindex_compact"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, compact),
+      NULL },
 
+    { ngx_string("fancyindex_archive"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, archive),
+      NULL },
 
-ngx_module_t  ngx_http_fancyindex_module = {
-    NGX_MODULE_V1,
-    &ngx_http_fancyindex_module_ctx,       /* module context */
-    ngx_http_fancyindex_commands,          /* module directives */
-    NGX_HTTP_MODULE,                       /* module type */
-    NULL,                                  /* init master */
-    NULL,                                  /* init module */
-    NULL,                                  /* init process */
-    NULL,                                  /* init thread */
-    NULL,                                  /* exit thread */
-    NULL,                                  /* exit process */
-    NULL,                                  /* exit master */
-    NGX_MODULE_V1_PADDING
-};
+    { ngx_string("fancyindex_thread_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_thread_pool,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_io_uring"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_http_fancyindex_io_uring,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, io_uring),
+      NULL },
+
+    { ngx_string("fancyindex_scan_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_fancyindex_scan_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_index_path"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_index_path,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, index_path),
+      NULL },
+
+    { ngx_string("fancyindex_checksum_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_checksum_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_checksum"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_checksum,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache_zone"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_1MORE,
+      ngx_http_fancyindex_cache_zone,
+      0,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_http_fancyindex_cache,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache_valid"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_sec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_valid),
+      NULL },
+
+    { ngx_string("fancyindex_cache_lock"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_lock),
+      NULL },
+
+    { ngx_string("fancyindex_cache_use_stale"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_cache_use_stale,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_cache_lock_timeout"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_msec_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_lock_timeout),
+      NULL },
+
+    { ngx_string("fancyindex_cache_patch"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, cache_patch),
+      NULL },
+
+    { ngx_string("fancyindex_cache_control"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_cache_control,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_surrogate_key"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_conf_set_flag_slot,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, surrogate_key),
+      NULL },
+
+    { ngx_string("fancyindex_purge"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE2,
+      ngx_http_fancyindex_purge,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_scan_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_TAKE123,
+      ngx_http_fancyindex_scan_limit,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_watch"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_watch,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_preload"),
+      NGX_HTTP_LOC_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_preload,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      0,
+      NULL },
+
+    { ngx_string("fancyindex_buffer_pool"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE1,
+      ngx_conf_set_size_slot,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_main_conf_t, buffer_pool),
+      NULL },
+
+    { ngx_string("fancyindex_events"),
+      NGX_HTTP_MAIN_CONF|NGX_HTTP_SRV_CONF|NGX_HTTP_LOC_CONF|NGX_CONF_FLAG,
+      ngx_http_fancyindex_events,
+      NGX_HTTP_LOC_CONF_OFFSET,
+      offsetof(ngx_http_fancyindex_loc_conf_t, events),
+      NULL },
+
+    { ngx_string("fancyindex_events_limit"),
+      NGX_HTTP_MAIN_CONF|NGX_CONF_TAKE12,
+      ngx_http_fancyindex_events_limit,
+      NGX_HTTP_MAIN_CONF_OFFSET,
+      0,
+      NULL },
+
+    ngx_null_command
+};
+
+
+static ngx_http_module_t  ngx_http_fancyindex_module_ctx = {
+    NULL,                                  /* preconfiguration */
+    ngx_http_fancyindex_init,              /* postconfiguration */
+
+    ngx_http_fancyindex_create_main_conf,  /* create main configuration */
+    ngx_http_fancyindex_init_main_conf,    /* init main configuration */
+
+    NULL,                                  /* create server configuration */
+    NULL,                                  /* merge server configuration */
+
+    ngx_http_fancyindex_create_loc_conf,   /* create location configuration */
+    ngx_http_fancyindex_merge_loc_conf     /* merge location configuration */
+};
+
+
+ngx_module_t  ngx_http_fancyindex_module = {
+    NGX_MODULE_V1,
+    &ngx_http_fancyindex_module_ctx,       /* module context */
+    ngx_http_fancyindex_commands,          /* module directives */
+    NGX_HTTP_MODULE,                       /* module type */
+    NULL,                                  /* init master */
+    NULL,                                  /* init module */
+    ngx_http_fancyindex_init_process,      /* init process */
+    NULL,                                  /* init thread */
+    NULL,                                  /* exit thread */
+    NULL,                                  /* exit process */
+    NULL,                                  /* exit master */
+    NGX_MODULE_V1_PADDING
+};
 
 
 
@@ -624,88 +1646,176 @@ ngx_fancyindex_escape_filename(u_char *dst, u_char *src, size_t size)
 #endif /* NGX_ESCAPE_URI_COMPONENT */
 
 
-static ngx_inline ngx_buf_t*
-make_header_buf(ngx_http_request_t *r, const ngx_str_t css_href)
+/*
+ * The builtin header is sent from buffers which point to the templates,
+ * the <link> element built in merge_loc_conf, and the URI, so it is not
+ * copied, and followed by "next".
+ */
+static ngx_inline ngx_chain_t*
+make_header_chain(ngx_http_request_t *r,
+                  ngx_http_fancyindex_loc_conf_t *alcf,
+                  ngx_chain_t *next)
 {
-    ngx_buf_t *b;
-    size_t blen = r->uri.len
-        + ngx_sizeof_ssz(t01_head1)
-        + ngx_sizeof_ssz(t02_head2)
-        + ngx_sizeof_ssz(t03_head3)
-        + ngx_sizeof_ssz(t04_body1)
-        ;
+    ngx_str_t    part[6];
+    ngx_chain_t *cl;
+    ngx_buf_t   *b;
+    ngx_uint_t   n = 0;
 
-    if (css_href.len) {
-        blen += css_href_pre.len \
-              + css_href.len \
-              + css_href_post.len
-              ;
-    }
+    part[n].data = (u_char *) t01_head1;
+    part[n++].len = ngx_sizeof_ssz(t01_head1);
+
+    if (alcf->css_link.len)
+        part[n++] = alcf->css_link;
+
+    part[n].data = (u_char *) t02_head2;
+    part[n++].len = ngx_sizeof_ssz(t02_head2);
+    part[n++] = r->uri;
+    part[n].data = (u_char *) t03_head3;
+    part[n++].len = ngx_sizeof_ssz(t03_head3);
+    part[n].data = (u_char *) t04_body1;
+    part[n++].len = ngx_sizeof_ssz(t04_body1);
+
+    if ((b = ngx_pcalloc(r->pool, n * sizeof(ngx_buf_t))) == NULL)
+        return NULL;
 
-    if ((b = ngx_create_temp_buf(r->pool, blen)) == NULL)
+    if ((cl = ngx_palloc(r->pool, n * sizeof(ngx_chain_t))) == NULL)
         return NULL;
 
-    b->last = ngx_cpymem_ssz(b->last, t01_head1);
+    while (n--) {
+        b[n].memory = 1;
+        b[n].pos = part[n].data;
+        b[n].last = part[n].data + part[n].len;
 
-    if (css_href.len) {
-        b->last = ngx_cpymem_str(b->last, css_href_pre);
-        b->last = ngx_cpymem_str(b->last, css_href);
-        b->last = ngx_cpymem_str(b->last, css_href_post);
+        cl[n].buf = &b[n];
+        cl[n].next = next;
+        next = &cl[n];
     }
 
-    b->last = ngx_cpymem_ssz(b->last, t02_head2);
-    b->last = ngx_cpymem_str(b->last, r->uri);
-    b->last = ngx_cpymem_ssz(b->last, t03_head3);
-    b->last = ngx_cpymem_ssz(b->last, t04_body1);
+    return next;
+}
 
-    return b;
+
+/*
+ * Escapes the relative path of an entry from a recursive listing one
+ * component at a time, so the slashes which separate them are kept. Same
+ * semantics as ngx_fancyindex_escape_filename().
+ */
+static uintptr_t
+ngx_fancyindex_escape_path(u_char *dst, u_char *src, size_t size)
+{
+    uintptr_t  n, escapes = 0;
+    u_char    *slash;
+    size_t     len;
+
+    for (;;) {
+        slash = ngx_strlchr(src, src + size, '/');
+        len = slash ? (size_t) (slash - src) : size;
+
+        n = ngx_fancyindex_escape_filename(dst, src, len);
+        escapes += n;
+
+        if (slash == NULL)
+            return escapes;
+
+        if (dst) {
+            dst += len + 2 * n;
+            *dst++ = '/';
+        }
+        src = slash + 1;
+        size -= len + 1;
+    }
 }
 
 
-static ngx_inline ngx_int_t
-make_content_buf(
-        ngx_http_request_t *r, ngx_buf_t **pb,
-        ngx_http_fancyindex_loc_conf_t *alcf)
+static ngx_uint_t
+ngx_http_fancyindex_ignored(ngx_http_fancyindex_loc_conf_t *alcf,
+                            u_char *name, size_t len, ngx_log_t *log)
 {
-    ngx_http_fancyindex_entry_t *entry;
+#if NGX_PCRE
+    ngx_str_t str;
 
-    int (*sort_cmp_func)(const void *, const void *);
-    const char  *sort_url_args = "";
+    str.len = len;
+    str.data = name;
 
-    off_t        length;
-    size_t       len, root, allocated, escape_html;
-    int64_t      multiplier;
-    u_char      *filename, *last;
-    ngx_tm_t     tm;
-    ngx_array_t  entries;
-    ngx_time_t  *tp;
-    ngx_uint_t   i, j;
-    ngx_str_t    path;
-    ngx_dir_t    dir;
-    ngx_buf_t   *b;
+    return alcf->ignore
+        && ngx_regex_exec_array(alcf->ignore, &str, log) != NGX_DECLINED;
+#else /* !NGX_PCRE */
+    ngx_uint_t i;
+    ngx_str_t *s;
 
-    static const char    *sizes[]  = { "EiB", "PiB", "TiB", "GiB", "MiB", "KiB", "B" };
-    static const int64_t  exbibyte = 1024LL * 1024LL * 1024LL *
-                                     1024LL * 1024LL * 1024LL;
+    (void) len; /* unused */
+    (void) log; /* unused */
 
-    /*
-     * NGX_DIR_MASK_LEN is lesser than NGX_HTTP_FANCYINDEX_PREALLOCATE
-     */
-    if ((last = ngx_http_map_uri_to_path(r, &path, &root,
-                    NGX_HTTP_FANCYINDEX_PREALLOCATE)) == NULL)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (alcf->ignore) {
+        s = alcf->ignore->elts;
 
-    allocated = path.len;
-    path.len = last - path.data;
-    if (path.len > 1) {
-        path.len--;
+        for (i = 0; i < alcf->ignore->nelts; i++, s++) {
+            if (ngx_strcmp(name, s->data) == 0) {
+                return 1;
+            }
+        }
     }
-    path.data[path.len] = '\0';
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                   "http fancyindex: \"%s\"", path.data);
+    return 0;
+#endif /* NGX_PCRE */
+}
+
+
+static ngx_msec_t
+ngx_http_fancyindex_msec(void)
+{
+    struct timeval tv;
+
+    ngx_gettimeofday(&tv);
+
+    return (ngx_msec_t) tv.tv_sec * 1000 + tv.tv_usec / 1000;
+}
+
+
+static void
+ngx_http_fancyindex_limit_init(ngx_http_fancyindex_limit_t *limit,
+                               ngx_http_fancyindex_loc_conf_t *alcf,
+                               ngx_flag_t recursive)
+{
+    ngx_msec_t timeout = alcf->scan_timeout;
+
+    limit->max = alcf->max_entries;
+    limit->read = 0;
+    limit->truncated = 0;
+    ngx_str_null(&limit->prefix);
+
+    if (recursive) {
+        if (limit->max == 0 || limit->max > NGX_HTTP_FANCYINDEX_RECURSIVE_MAX_ENTRIES)
+            limit->max = NGX_HTTP_FANCYINDEX_RECURSIVE_MAX_ENTRIES;
+        if (timeout == 0 || timeout > NGX_HTTP_FANCYINDEX_RECURSIVE_TIMEOUT)
+            timeout = NGX_HTTP_FANCYINDEX_RECURSIVE_TIMEOUT;
+    }
+
+    limit->deadline = timeout ? ngx_http_fancyindex_msec() + timeout : 0;
+}
+
 
-    if (ngx_open_dir(&path, &dir) == NGX_ERROR) {
+static ngx_inline ngx_uint_t
+ngx_http_fancyindex_limited(ngx_http_fancyindex_limit_t *limit,
+                            ngx_uint_t nentries)
+{
+    if ((limit->max && limit->read + nentries >= limit->max)
+        || (limit->deadline && ngx_http_fancyindex_msec() >= limit->deadline))
+    {
+        limit->truncated = 1;
+    }
+
+    return limit->truncated;
+}
+
+
+/*
+ * Opens a directory, returning the HTTP status for the error on failure.
+ */
+static ngx_int_t
+ngx_http_fancyindex_open_dir(ngx_log_t *log, ngx_str_t *path, ngx_dir_t *dir)
+{
+    if (ngx_open_dir(path, dir) == NGX_ERROR) {
         ngx_int_t rc, err = ngx_errno;
         ngx_uint_t level;
 
@@ -720,893 +1830,9384 @@ make_content_buf(
             rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
         }
 
-        ngx_log_error(level, r->connection->log, err,
-                ngx_open_dir_n " \"%s\" failed", path.data);
+        ngx_log_error(level, log, err,
+                ngx_open_dir_n " \"%s\" failed", path->data);
 
         return rc;
     }
 
-#if (NGX_SUPPRESS_WARN)
-    /* MSVC thinks 'entries' may be used without having been initialized */
-    ngx_memzero(&entries, sizeof(ngx_array_t));
-#endif /* NGX_SUPPRESS_WARN */
+    return NGX_OK;
+}
 
 
-    if (ngx_array_init(&entries, r->pool, 40,
-                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
-        return ngx_http_fancyindex_error(r, &dir, &path);
+/*
+ * With fancyindex_io_uring, information about the entries of a directory
+ * is requested with IORING_OP_STATX in batches, which the kernel handles
+ * concurrently, instead of calling stat() for one entry after another.
+ * Waiting for a batch blocks, so this is only done by thread pool tasks,
+ * and the worker process checks entries one at a time when it reads
+ * directories itself. Each thread which reads directories gets its own
+ * ring the first time; if that fails, or the kernel lacks IORING_OP_STATX,
+ * stat() is used.
+ */
+typedef struct ngx_http_fancyindex_statx_s  ngx_http_fancyindex_statx_t;
+
+#if (NGX_HTTP_FANCYINDEX_IO_URING)
+
+#define NGX_HTTP_FANCYINDEX_STATX_BATCH  32
+#define NGX_HTTP_FANCYINDEX_STATX_PENDING  1 /**< Not completed (yet). */
+#define NGX_HTTP_FANCYINDEX_STATX_MASK \
+    (STATX_TYPE | STATX_MODE | STATX_SIZE | STATX_MTIME | STATX_INO)
+
+struct ngx_http_fancyindex_statx_s {
+    struct io_uring *ring;
+    int              fd;     /**< Of the directory being read. */
+    ngx_uint_t       n;      /**< Entries waiting for their information. */
+    ngx_uint_t       index[NGX_HTTP_FANCYINDEX_STATX_BATCH];
+    int              res[NGX_HTTP_FANCYINDEX_STATX_BATCH];
+    struct statx     stx[NGX_HTTP_FANCYINDEX_STATX_BATCH];
+};
 
-    filename = path.data;
-    filename[path.len] = '/';
+/*
+ * The batch is not kept on the stack because, if the ring cannot be
+ * drained after an error, the kernel may still write to it later on.
+ */
+static __thread struct io_uring              ngx_http_fancyindex_ring;
+static __thread ngx_int_t                    ngx_http_fancyindex_ring_state; /* -1: no */
+static __thread ngx_http_fancyindex_statx_t  ngx_http_fancyindex_statx_batch;
 
-    /* Read directory entries and their associated information. */
-    for (;;) {
-        ngx_set_errno(0);
 
-        if (ngx_read_dir(&dir) == NGX_ERROR) {
-            ngx_int_t err = ngx_errno;
+static struct io_uring *
+ngx_http_fancyindex_statx_ring(ngx_log_t *log)
+{
+    struct io_uring_probe *probe;
+    int                    rc;
 
-            if (err != NGX_ENOMOREFILES) {
-                ngx_log_error(NGX_LOG_CRIT, r->connection->log, err,
-                        ngx_read_dir_n " \"%V\" failed", &path);
-                return ngx_http_fancyindex_error(r, &dir, &path);
-            }
-            break;
-        }
+    if (ngx_http_fancyindex_ring_state)
+        return ngx_http_fancyindex_ring_state > 0 ? &ngx_http_fancyindex_ring
+                                                  : NULL;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                       "http fancyindex file: \"%s\"", ngx_de_name(&dir));
+    ngx_http_fancyindex_ring_state = -1;
 
-        len = ngx_de_namelen(&dir);
+    rc = io_uring_queue_init(NGX_HTTP_FANCYINDEX_STATX_BATCH,
+                             &ngx_http_fancyindex_ring, 0);
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_NOTICE, log, -rc,
+                      "io_uring_queue_init() failed, using stat()");
+        return NULL;
+    }
 
-        if (!alcf->show_dot_files && ngx_de_name(&dir)[0] == '.')
-            continue;
+    probe = io_uring_get_probe_ring(&ngx_http_fancyindex_ring);
+    if (probe == NULL || !io_uring_opcode_supported(probe, IORING_OP_STATX)) {
+        ngx_log_error(NGX_LOG_NOTICE, log, 0,
+                      "io_uring does not support statx, using stat()");
+        if (probe)
+            io_uring_free_probe(probe);
+        io_uring_queue_exit(&ngx_http_fancyindex_ring);
+        return NULL;
+    }
 
-        if (alcf->hide_symlinks && ngx_de_is_link (&dir))
-            continue;
+    io_uring_free_probe(probe);
+    ngx_http_fancyindex_ring_state = 1;
 
-#if NGX_PCRE
-        {
-            ngx_str_t str;
-            str.len = len;
-            str.data = ngx_de_name(&dir);
+    return &ngx_http_fancyindex_ring;
+}
 
-            if (alcf->ignore && ngx_regex_exec_array(alcf->ignore, &str,
-                                                     r->connection->log)
-                != NGX_DECLINED)
-            {
-                continue;
-            }
-        }
-#else /* !NGX_PCRE */
-        if (alcf->ignore) {
-            u_int match_found = 0;
-            ngx_str_t *s = alcf->ignore->elts;
 
-            for (i = 0; i < alcf->ignore->nelts; i++, s++) {
-                if (ngx_strcmp(ngx_de_name(&dir), s->data) == 0) {
-                    match_found = 1;
-                    break;
-                }
-            }
+/*
+ * Gives up on the ring of the thread after an error: waits for the
+ * requests which the kernel took, recording their results, so that it
+ * does not write to the batch anymore, and releases the ring. Requests
+ * left in the submission queue are dropped with it. When waiting fails
+ * too, the ring is kept as is: it is not used again anyway.
+ */
+static void
+ngx_http_fancyindex_statx_abandon(ngx_http_fancyindex_statx_t *sx,
+                                  ngx_log_t *log)
+{
+    struct io_uring_cqe *cqe;
+    ngx_uint_t           i, pending;
+    int                  rc;
 
-            if (match_found) {
-                continue;
-            }
-        }
-#endif /* NGX_PCRE */
+    ngx_http_fancyindex_ring_state = -1;
 
-        if (!dir.valid_info) {
-            /* 1 byte for '/' and 1 byte for terminating '\0' */
-            if (path.len + 1 + len + 1 > allocated) {
-                allocated = path.len + 1 + len + 1
-                          + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+    for (i = 0, pending = 0; i < sx->n; i++) {
+        if (sx->res[i] == NGX_HTTP_FANCYINDEX_STATX_PENDING)
+            pending++;
+    }
 
-                if ((filename = ngx_palloc(r->pool, allocated)) == NULL)
-                    return ngx_http_fancyindex_error(r, &dir, &path);
+    pending -= ngx_min(pending, io_uring_sq_ready(sx->ring));
 
-                last = ngx_cpystrn(filename, path.data, path.len + 1);
-                *last++ = '/';
-            }
+    while (pending) {
+        rc = io_uring_wait_cqe(sx->ring, &cqe);
+        if (rc == -EINTR)
+            continue;
 
-            ngx_cpystrn(last, ngx_de_name(&dir), len + 1);
+        if (rc < 0) {
+            ngx_log_error(NGX_LOG_ALERT, log, -rc,
+                          "io_uring_wait_cqe() failed, "
+                          "%ui requests left in flight", pending);
+            return;
+        }
 
-            if (ngx_de_info(filename, &dir) == NGX_FILE_ERROR) {
-                ngx_int_t err = ngx_errno;
+        i = (uintptr_t) io_uring_cqe_get_data(cqe);
+        if (i < sx->n)
+            sx->res[i] = cqe->res;
+        io_uring_cqe_seen(sx->ring, cqe);
+        pending--;
+    }
 
-                if (err != NGX_ENOENT) {
-                    ngx_log_error(NGX_LOG_ERR, r->connection->log, err,
-                            ngx_de_info_n " \"%s\" failed", filename);
-                    continue;
-                }
+    io_uring_queue_exit(sx->ring);
+}
 
-                if (ngx_de_link_info(filename, &dir) == NGX_FILE_ERROR) {
-                    ngx_log_error(NGX_LOG_CRIT, r->connection->log, ngx_errno,
-                            ngx_de_link_info_n " \"%s\" failed", filename);
-                    return ngx_http_fancyindex_error(r, &dir, &path);
+
+/*
+ * Submits the pending entries, waits for all of them, and fills in their
+ * information. Entries which cannot be checked are removed, like those
+ * for which stat() fails in ngx_http_fancyindex_read_entries(). When the
+ * ring fails, stat() is used for the entries it did not complete.
+ */
+static void
+ngx_http_fancyindex_statx_flush(ngx_http_fancyindex_statx_t *sx,
+                                ngx_log_t *log, ngx_str_t *path,
+                                size_t prefix_len, ngx_array_t *entries)
+{
+    ngx_http_fancyindex_entry_t *entry = entries->elts, *e;
+    struct io_uring_sqe         *sqe;
+    struct io_uring_cqe         *cqe;
+    struct stat                  st;
+    ngx_uint_t                   i, j, got;
+    char                        *name;
+    int                          rc;
+
+    for (i = 0; i < sx->n; i++) {
+        name = (char *) entry[sx->index[i]].name.data + prefix_len;
+
+        ngx_http_fancyindex_probe1(stat__start, name);
+
+        sqe = io_uring_get_sqe(sx->ring);
+        io_uring_prep_statx(sqe, sx->fd, name, AT_STATX_SYNC_AS_STAT,
+                            NGX_HTTP_FANCYINDEX_STATX_MASK, &sx->stx[i]);
+        io_uring_sqe_set_data(sqe, (void *) (uintptr_t) i);
+        sx->res[i] = NGX_HTTP_FANCYINDEX_STATX_PENDING;
+    }
+
+    do {
+        rc = io_uring_submit_and_wait(sx->ring, sx->n);
+    } while (rc == -EINTR);
+
+    if (rc < 0) {
+        ngx_log_error(NGX_LOG_ALERT, log, -rc,
+                      "io_uring_submit_and_wait() failed, using stat()");
+        ngx_http_fancyindex_statx_abandon(sx, log);
+
+    } else {
+        /* All of them completed already, this only reaps them. */
+        for (got = 0; got < sx->n; ) {
+            rc = io_uring_wait_cqe(sx->ring, &cqe);
+            if (rc == -EINTR)
+                continue;
+
+            if (rc < 0) {
+                ngx_log_error(NGX_LOG_ALERT, log, -rc,
+                              "io_uring_wait_cqe() failed, using stat()");
+                ngx_http_fancyindex_statx_abandon(sx, log);
+                break;
+            }
+
+            i = (uintptr_t) io_uring_cqe_get_data(cqe);
+            sx->res[i] = cqe->res;
+            io_uring_cqe_seen(sx->ring, cqe);
+            got++;
+        }
+    }
+
+    for (i = 0; i < sx->n; i++) {
+        e = &entry[sx->index[i]];
+        name = (char *) e->name.data + prefix_len;
+
+        if (sx->res[i] == NGX_HTTP_FANCYINDEX_STATX_PENDING) {
+            sx->res[i] = statx(sx->fd, name, AT_STATX_SYNC_AS_STAT,
+                               NGX_HTTP_FANCYINDEX_STATX_MASK, &sx->stx[i])
+                         ? -ngx_errno : 0;
+        }
+
+        ngx_http_fancyindex_probe2(stat__end, name, -sx->res[i]);
+
+        if (sx->res[i] == 0) {
+            e->dir   = S_ISDIR(sx->stx[i].stx_mode);
+            e->mtime = sx->stx[i].stx_mtime.tv_sec;
+            e->size  = sx->stx[i].stx_size;
+            e->uniq  = sx->stx[i].stx_ino;
+            continue;
+        }
+
+        if (sx->res[i] != -NGX_ENOENT) {
+            ngx_log_error(NGX_LOG_ERR, log, -sx->res[i],
+                          "statx() \"%V/%s\" failed", path, name);
+            e->name.data = NULL;
+            continue;
+        }
+
+        /* Dangling symbolic link, or removed since it was read. */
+        if (fstatat(sx->fd, name, &st, AT_SYMLINK_NOFOLLOW) == -1) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          "fstatat() \"%V/%s\" failed", path, name);
+            e->name.data = NULL;
+            continue;
+        }
+
+        e->dir   = S_ISDIR(st.st_mode);
+        e->mtime = st.st_mtime;
+        e->size  = st.st_size;
+        e->uniq  = st.st_ino;
+    }
+
+    /* Entries after the first pending one may only be pending ones. */
+    for (i = j = sx->index[0]; i < entries->nelts; i++) {
+        if (entry[i].name.data)
+            entry[j++] = entry[i];
+    }
+    entries->nelts = j;
+    sx->n = 0;
+}
+
+#endif /* NGX_HTTP_FANCYINDEX_IO_URING */
+
+
+/*
+ * Reads the entries of the open directory at "path" and appends them to
+ * "entries", with their names prefixed by "prefix" (which is only used
+ * for the subdirectories of recursive listings, and may be NULL). The path
+ * must be NUL-terminated, with "allocated" bytes available at path->data,
+ * because the buffer is reused to build the full path of each entry.
+ *
+ * The scan stops early, without this being an error, when one of the
+ * limits is reached; in that case limit->truncated is set. When "batch" is
+ * not zero, returns NGX_AGAIN once "entries" holds that many, and the next
+ * call continues reading after them. On errors the directory is closed.
+ *
+ * Returns NGX_OK, NGX_AGAIN, or an HTTP status code on errors.
+ */
+static ngx_int_t
+ngx_http_fancyindex_read_entries(ngx_pool_t *pool, ngx_log_t *log,
+                                 ngx_http_fancyindex_loc_conf_t *alcf,
+                                 ngx_dir_t *dir, ngx_str_t *path,
+                                 size_t allocated, ngx_str_t *prefix,
+                                 ngx_uint_t flags,
+                                 ngx_http_fancyindex_limit_t *limit,
+                                 ngx_array_t *entries, ngx_uint_t batch)
+{
+    ngx_http_fancyindex_entry_t *entry;
+    ngx_http_fancyindex_statx_t *sx = NULL;
+
+    size_t       len, prefix_len;
+    u_char      *filename, *last;
+    ngx_uint_t   link;
+    ngx_int_t    rc = NGX_OK;
+#if (NGX_HTTP_FANCYINDEX_IO_URING)
+    struct io_uring *ring;
+
+    if (alcf->io_uring
+        && ngx_has_flag(flags, NGX_HTTP_FANCYINDEX_SCAN_THREAD)
+        && (ring = ngx_http_fancyindex_statx_ring(log)) != NULL)
+    {
+        sx = &ngx_http_fancyindex_statx_batch;
+        sx->ring = ring;
+        sx->fd = dirfd(dir->dir);
+        sx->n = 0;
+    }
+#endif /* NGX_HTTP_FANCYINDEX_IO_URING */
+
+    prefix_len = prefix ? prefix->len : 0;
+
+    filename = path->data;
+    last = path->data + path->len;
+    if (last[-1] != '/') {
+        *last++ = '/';
+    }
+
+    /* Read directory entries and their associated information. */
+    for (;;) {
+        if (batch && entries->nelts == batch) {
+            rc = NGX_AGAIN;
+            break;
+        }
+
+        ngx_set_errno(0);
+
+        if (ngx_read_dir(dir) == NGX_ERROR) {
+            ngx_int_t err = ngx_errno;
+
+            if (err != NGX_ENOMOREFILES) {
+                ngx_log_error(NGX_LOG_CRIT, log, err,
+                        ngx_read_dir_n " \"%V\" failed", path);
+                return ngx_http_fancyindex_error(log, dir, path);
+            }
+            break;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http fancyindex file: \"%s\"", ngx_de_name(dir));
+
+        len = ngx_de_namelen(dir);
+
+        if (!alcf->show_dot_files && ngx_de_name(dir)[0] == '.')
+            continue;
+
+        link = ngx_de_is_link(dir);
+
+        if (alcf->hide_symlinks && link)
+            continue;
+
+        if (ngx_has_flag(flags, NGX_HTTP_FANCYINDEX_SCAN_IGNORE) &&
+            ngx_http_fancyindex_ignored(alcf, ngx_de_name(dir), len, log))
+            continue;
+
+        if (limit && limit->prefix.len
+            && (len < limit->prefix.len
+                || ngx_strncasecmp(ngx_de_name(dir), limit->prefix.data,
+                                   limit->prefix.len) != 0))
+            continue;
+
+        if (limit && ngx_http_fancyindex_limited(limit, entries->nelts))
+            break;
+
+        /* With io_uring, see ngx_http_fancyindex_statx_flush(). */
+        if (!dir->valid_info && sx == NULL) {
+            /* 1 byte for '/' and 1 byte for terminating '\0' */
+            if (path->len + 1 + len + 1 > allocated) {
+                allocated = path->len + 1 + len + 1
+                          + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+                if ((filename = ngx_palloc(pool, allocated)) == NULL)
+                    return ngx_http_fancyindex_error(log, dir, path);
+
+                last = ngx_cpystrn(filename, path->data, path->len + 1);
+                *last++ = '/';
+            }
+
+            ngx_cpystrn(last, ngx_de_name(dir), len + 1);
+
+            ngx_http_fancyindex_probe1(stat__start, filename);
+
+            if (ngx_de_info(filename, dir) == NGX_FILE_ERROR) {
+                ngx_int_t err = ngx_errno;
+
+                ngx_http_fancyindex_probe2(stat__end, filename, err);
+
+                if (err != NGX_ENOENT) {
+                    ngx_log_error(NGX_LOG_ERR, log, err,
+                            ngx_de_info_n " \"%s\" failed", filename);
+                    continue;
+                }
+
+                if (ngx_de_link_info(filename, dir) == NGX_FILE_ERROR) {
+                    ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                            ngx_de_link_info_n " \"%s\" failed", filename);
+                    return ngx_http_fancyindex_error(log, dir, path);
                 }
+            } else {
+                ngx_http_fancyindex_probe2(stat__end, filename, 0);
             }
         }
 
-        if ((entry = ngx_array_push(&entries)) == NULL)
-            return ngx_http_fancyindex_error(r, &dir, &path);
+        if ((entry = ngx_array_push(entries)) == NULL)
+            return ngx_http_fancyindex_error(log, dir, path);
 
-        entry->name.len  = len;
-        entry->name.data = ngx_palloc(r->pool, len + 1);
+        entry->name.len  = prefix_len + len;
+        entry->name.data = ngx_palloc(pool, entry->name.len + 1);
         if (entry->name.data == NULL)
-            return ngx_http_fancyindex_error(r, &dir, &path);
+            return ngx_http_fancyindex_error(log, dir, path);
 
-        ngx_cpystrn(entry->name.data, ngx_de_name(&dir), len + 1);
-        entry->escape = 2 * ngx_fancyindex_escape_filename(NULL,
-                                                           ngx_de_name(&dir),
-                                                           len);
+        if (prefix_len) {
+            ngx_memcpy(entry->name.data, prefix->data, prefix_len);
+        }
+        ngx_cpystrn(entry->name.data + prefix_len, ngx_de_name(dir), len + 1);
+        entry->escape = 2 * ngx_fancyindex_escape_path(NULL,
+                                                       entry->name.data,
+                                                       entry->name.len);
         entry->escape_html = ngx_escape_html(NULL,
                                              entry->name.data,
                                              entry->name.len);
 
-        entry->dir     = ngx_de_is_dir(&dir);
-        entry->mtime   = ngx_de_mtime(&dir);
-        entry->size    = ngx_de_size(&dir);
-        entry->utf_len = (r->headers_out.charset.len == 5 &&
-                ngx_strncasecmp(r->headers_out.charset.data, (u_char*) "utf-8", 5) == 0)
+        entry->dir     = ngx_de_is_dir(dir);
+        entry->link    = link;
+        entry->mtime   = ngx_de_mtime(dir);
+        entry->size    = ngx_de_size(dir);
+#if !(NGX_WIN32)
+        entry->uniq    = ngx_file_uniq(&dir->info);
+#else /* NGX_WIN32 */
+        entry->uniq    = 0;
+#endif /* NGX_WIN32 */
+        entry->checksum = NULL;
+        entry->utf_len = ngx_has_flag(flags, NGX_HTTP_FANCYINDEX_SCAN_UTF8)
             ?  ngx_utf8_length(entry->name.data, entry->name.len)
-            : len;
+            : entry->name.len;
+
+#if (NGX_HTTP_FANCYINDEX_IO_URING)
+        if (sx && !dir->valid_info) {
+            sx->index[sx->n++] = entries->nelts - 1;
+            if (sx->n == NGX_HTTP_FANCYINDEX_STATX_BATCH)
+                ngx_http_fancyindex_statx_flush(sx, log, path, prefix_len,
+                                                entries);
+        }
+#endif /* NGX_HTTP_FANCYINDEX_IO_URING */
     }
 
+#if (NGX_HTTP_FANCYINDEX_IO_URING)
+    if (sx && sx->n)
+        ngx_http_fancyindex_statx_flush(sx, log, path, prefix_len, entries);
+#endif /* NGX_HTTP_FANCYINDEX_IO_URING */
+
+    path->data[path->len] = '\0';
+
+    return rc;
+}
+
+
+/*
+ * Reads all the entries of a directory, see above.
+ */
+static ngx_int_t
+ngx_http_fancyindex_read_dir(ngx_pool_t *pool, ngx_log_t *log,
+                             ngx_http_fancyindex_loc_conf_t *alcf,
+                             ngx_str_t *path, size_t allocated,
+                             ngx_str_t *prefix, ngx_uint_t flags,
+                             ngx_http_fancyindex_limit_t *limit,
+                             ngx_array_t *entries)
+{
+    ngx_dir_t  dir;
+    ngx_int_t  rc;
+
+    if ((rc = ngx_http_fancyindex_open_dir(log, path, &dir)) != NGX_OK)
+        return rc;
+
+    rc = ngx_http_fancyindex_read_entries(pool, log, alcf, &dir, path,
+                                          allocated, prefix, flags, limit,
+                                          entries, 0);
+    if (rc != NGX_OK)
+        return rc;
+
     if (ngx_close_dir(&dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                ngx_close_dir_n " \"%s\" failed", &path);
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                ngx_close_dir_n " \"%V\" failed", path);
     }
 
-    /*
-     * Calculate needed buffer length.
-     */
+    return NGX_OK;
+}
 
-    escape_html = ngx_escape_html(NULL, r->uri.data, r->uri.len);
-
-    if (alcf->show_path)
-        len = r->uri.len + escape_html
-          + ngx_sizeof_ssz(t05_body2)
-          + ngx_sizeof_ssz(t06_list1)
-          + ngx_sizeof_ssz(t_parentdir_entry)
-          + ngx_sizeof_ssz(t07_list2)
-          + ngx_fancyindex_timefmt_calc_size (&alcf->time_format) * entries.nelts
-          ;
-   else
-        len = r->uri.len + escape_html
-          + ngx_sizeof_ssz(t06_list1)
-          + ngx_sizeof_ssz(t_parentdir_entry)
-          + ngx_sizeof_ssz(t07_list2)
-          + ngx_fancyindex_timefmt_calc_size (&alcf->time_format) * entries.nelts
-          ;
 
-    /*
-     * If we are a the root of the webserver (URI =  "/" --> length of 1),
-     * do not display the "Parent Directory" link.
-     */
-    if (r->uri.len == 1) {
-        len -= ngx_sizeof_ssz(t_parentdir_entry);
+/*
+ * Index files are named after the MD5 sum of the path of the directory,
+ * and contain the entries as they would be read by read_dir(), making it
+ * possible to list the directory without reading it again as long as its
+ * modification time has not changed. Files are mapped read-only, so all
+ * the worker processes share them through the page cache and their
+ * contents survive restarts.
+ */
+static u_char *
+ngx_http_fancyindex_index_name(ngx_pool_t *pool,
+                               ngx_http_fancyindex_loc_conf_t *alcf,
+                               ngx_str_t *path)
+{
+    ngx_md5_t  md5;
+    u_char     digest[16], *name, *p;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, path->data, path->len);
+    ngx_md5_final(digest, &md5);
+
+    name = ngx_pnalloc(pool, alcf->index_path.len + 1 + 2 * sizeof(digest) + 1);
+    if (name == NULL)
+        return NULL;
+
+    p = ngx_cpymem_str(name, alcf->index_path);
+    *p++ = '/';
+    p = ngx_hex_dump(p, digest, sizeof(digest));
+    *p = '\0';
+
+    return name;
+}
+
+
+static void
+ngx_http_fancyindex_index_unmap(void *data)
+{
+    ngx_str_t *map = data;
+
+    if (munmap(map->data, map->len) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "munmap(%uz) failed", map->len);
     }
+}
 
-    entry = entries.elts;
-    for (i = 0; i < entries.nelts; i++) {
-        /*
-         * Genearated table rows are as follows, unneeded whitespace
-         * is stripped out:
-         *
-         *   <tr>
-         *     <td><a href="U[?sort]">fname</a></td>
-         *     <td>size</td><td>date</td>
-         *   </tr>
-         */
-        len += ngx_sizeof_ssz("<tr><td colspan=\"2\" class=\"link\"><a href=\"")
-            + entry[i].name.len + entry[i].escape /* Escaped URL */
-            + ngx_sizeof_ssz("?C=x&amp;O=y") /* URL sorting arguments */
-            + ngx_sizeof_ssz("\" title=\"")
-            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
-            + ngx_sizeof_ssz("\">")
-            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
-            + ngx_sizeof_ssz("</a></td><td class=\"size\">")
-            + 20 /* File size */
-            + ngx_sizeof_ssz("</td><td class=\"date\">")    /* Date prefix */
-            + ngx_sizeof_ssz("</td></tr>\n") /* Date suffix */
-            + 2 /* CR LF */
-            ;
+
+/*
+ * Appends the entries in the index file to "entries", if the file exists
+ * and is current. Names point into the mapped file, which is unmapped
+ * when "pool" is destroyed. Returns NGX_DECLINED if the index cannot be
+ * used.
+ */
+static ngx_int_t
+ngx_http_fancyindex_index_read(ngx_pool_t *pool, ngx_log_t *log,
+                               ngx_http_fancyindex_loc_conf_t *alcf,
+                               ngx_http_fancyindex_ctx_t *ctx,
+                               u_char *name, ngx_array_t *entries)
+{
+    ngx_http_fancyindex_index_header_t *h;
+    ngx_http_fancyindex_index_entry_t  *ie;
+    ngx_http_fancyindex_entry_t        *entry;
+    ngx_pool_cleanup_t                 *cln;
+    ngx_file_info_t                     info;
+    ngx_str_t                          *map;
+    ngx_fd_t                            fd;
+    u_char                             *addr, *names;
+    size_t                              size;
+    ngx_uint_t                          i;
+    ngx_int_t                           rc;
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, ngx_errno,
+                       "http fancyindex: no index \"%s\"", name);
+        return NGX_DECLINED;
     }
 
-    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    if (ngx_fd_info(fd, &info) == NGX_FILE_ERROR
+        || ngx_file_size(&info) < (off_t) sizeof(ngx_http_fancyindex_index_header_t))
+    {
+        ngx_close_file(fd);
+        return NGX_DECLINED;
+    }
 
-    /*
-     * Determine the sorting criteria. URL arguments look like:
-     *
-     *    C=x[&O=y]
-     *
-     * Where x={M,S,N} and y={A,D}
-     */
-    if ((r->args.len == 3 || (r->args.len == 7 && r->args.data[3] == '&')) &&
-        r->args.data[0] == 'C' && r->args.data[1] == '=')
+    size = (size_t) ngx_file_size(&info);
+    addr = mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    if (addr == MAP_FAILED) {
+        ngx_log_error(NGX_LOG_CRIT, log, ngx_errno,
+                      "mmap(%uz) \"%s\" failed", size, name);
+        return NGX_DECLINED;
+    }
+
+    h = (ngx_http_fancyindex_index_header_t *) addr;
+
+    if (h->magic != NGX_HTTP_FANCYINDEX_INDEX_MAGIC
+        || h->version != NGX_HTTP_FANCYINDEX_INDEX_VERSION
+        || h->filter != alcf->index_filter
+        || h->flags != ctx->flags
+        || h->uniq != (uint64_t) ctx->uniq
+        || h->mtime != (int64_t) ctx->mtime
+        || h->path_len != ctx->path.len
+        || h->nentries > size / sizeof(ngx_http_fancyindex_index_entry_t)
+        || size != sizeof(ngx_http_fancyindex_index_header_t)
+                   + ngx_align(h->path_len, 8)
+                   + h->nentries * sizeof(ngx_http_fancyindex_index_entry_t)
+                   + h->names_len
+        || ngx_memcmp(addr + sizeof(ngx_http_fancyindex_index_header_t),
+                      ctx->path.data, ctx->path.len) != 0)
     {
-        /* Determine whether the direction of the sorting */
-        ngx_int_t sort_descending = r->args.len == 7
-                                 && r->args.data[4] == 'O'
-                                 && r->args.data[5] == '='
-                                 && r->args.data[6] == 'D';
-
-        /* Pick the sorting criteria */
-        switch (r->args.data[2]) {
-            case 'M': /* Sort by mtime */
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC)
-                        sort_url_args = "?C=M&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE)
-                        sort_url_args = "?C=M&amp;O=A";
-                }
-                break;
-            case 'S': /* Sort by size */
-                if (sort_descending) {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC)
-                        sort_url_args = "?C=S&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
-                        if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE)
-                    sort_url_args = "?C=S&amp;O=A";
-                }
-                break;
-            case 'N': /* Sort by name */
-            default:
-                if (sort_descending) {
-                    sort_cmp_func = alcf->case_sensitive
-                        ? ngx_http_fancyindex_cmp_entries_name_cs_desc
-                        : ngx_http_fancyindex_cmp_entries_name_ci_desc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC)
-                        sort_url_args = "?C=N&amp;O=D";
-                }
-                else {
-                    sort_cmp_func = alcf->case_sensitive
-                        ? ngx_http_fancyindex_cmp_entries_name_cs_asc
-                        : ngx_http_fancyindex_cmp_entries_name_ci_asc;
-                    if (alcf->default_sort != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME)
-                        sort_url_args = "?C=N&amp;O=A";
-                }
-                break;
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, 0,
+                       "http fancyindex: stale index \"%s\"", name);
+        rc = NGX_DECLINED;
+        goto unmap;
+    }
+
+    ie = (ngx_http_fancyindex_index_entry_t *)
+        (addr + sizeof(ngx_http_fancyindex_index_header_t) + ngx_align(h->path_len, 8));
+    names = (u_char *) (ie + h->nentries);
+
+    if ((entry = ngx_array_push_n(entries, h->nentries)) == NULL) {
+        rc = NGX_ERROR;
+        goto unmap;
+    }
+
+    for (i = 0; i < h->nentries; i++, ie++, entry++) {
+        if (ie->name >= h->names_len
+            || h->names_len - ie->name <= ie->name_len
+            || names[ie->name + ie->name_len] != '\0')
+        {
+            ngx_log_error(NGX_LOG_ERR, log, 0,
+                          "http fancyindex: corrupt index \"%s\"", name);
+            entries->nelts -= h->nentries;
+            rc = NGX_DECLINED;
+            goto unmap;
         }
+
+        entry->name.data   = names + ie->name;
+        entry->name.len    = ie->name_len;
+        entry->utf_len     = ie->utf_len;
+        entry->escape      = ie->escape;
+        entry->escape_html = ie->escape_html;
+        entry->dir         = ie->dir;
+        entry->link        = ie->link;
+        entry->mtime       = (time_t) ie->mtime;
+        entry->size        = (off_t) ie->size;
+        entry->uniq        = (ngx_file_uniq_t) ie->uniq;
+        entry->checksum    = NULL;
     }
-    else {
-        switch (alcf->default_sort) {
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_mtime_asc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
-                sort_cmp_func = ngx_http_fancyindex_cmp_entries_size_asc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC:
-                sort_cmp_func = alcf->case_sensitive
-                    ? ngx_http_fancyindex_cmp_entries_name_cs_desc
-                    : ngx_http_fancyindex_cmp_entries_name_ci_desc;
-                break;
-            case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME:
-            default:
-                sort_cmp_func = alcf->case_sensitive
-                    ? ngx_http_fancyindex_cmp_entries_name_cs_asc
-                    : ngx_http_fancyindex_cmp_entries_name_ci_asc;
-                break;
+
+    if ((cln = ngx_pool_cleanup_add(pool, sizeof(ngx_str_t))) == NULL) {
+        entries->nelts -= h->nentries;
+        rc = NGX_ERROR;
+        goto unmap;
+    }
+
+    map = cln->data;
+    map->data = addr;
+    map->len = size;
+    cln->handler = ngx_http_fancyindex_index_unmap;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, log, 0,
+                   "http fancyindex: %uL entries from index \"%s\"",
+                   h->nentries, name);
+
+    return NGX_OK;
+
+unmap:
+    if (munmap(addr, size) == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      "munmap(%uz) failed", size);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Writes the entries of a directory to its index file. A temporary file
+ * is renamed over the index, so other processes never see partial
+ * contents. Failures are logged, but otherwise ignored.
+ */
+static void
+ngx_http_fancyindex_index_write(ngx_log_t *log,
+                                ngx_http_fancyindex_loc_conf_t *alcf,
+                                ngx_http_fancyindex_ctx_t *ctx,
+                                u_char *name, ngx_array_t *entries)
+{
+    ngx_http_fancyindex_index_header_t *h;
+    ngx_http_fancyindex_index_entry_t  *ie;
+    ngx_http_fancyindex_entry_t        *entry = entries->elts;
+    ngx_fd_t                            fd;
+    u_char                             *buf, *names, *p, *temp;
+    size_t                              size, names_len, len;
+    ssize_t                             n;
+    ngx_uint_t                          i, written;
+
+    names_len = 0;
+    for (i = 0; i < entries->nelts; i++) {
+        names_len += entry[i].name.len + 1;
+    }
+
+    size = sizeof(ngx_http_fancyindex_index_header_t)
+         + ngx_align(ctx->path.len, 8)
+         + entries->nelts * sizeof(ngx_http_fancyindex_index_entry_t)
+         + names_len;
+
+    if ((buf = ngx_alloc(size, log)) == NULL)
+        return;
+
+    ngx_memzero(buf, size - names_len);
+
+    h = (ngx_http_fancyindex_index_header_t *) buf;
+    h->magic     = NGX_HTTP_FANCYINDEX_INDEX_MAGIC;
+    h->version   = NGX_HTTP_FANCYINDEX_INDEX_VERSION;
+    h->filter    = alcf->index_filter;
+    h->flags     = (uint32_t) ctx->flags;
+    h->uniq      = (uint64_t) ctx->uniq;
+    h->mtime     = (int64_t) ctx->mtime;
+    h->nentries  = entries->nelts;
+    h->path_len  = ctx->path.len;
+    h->names_len = names_len;
+
+    ngx_memcpy(buf + sizeof(ngx_http_fancyindex_index_header_t),
+               ctx->path.data, ctx->path.len);
+
+    ie = (ngx_http_fancyindex_index_entry_t *)
+        (buf + sizeof(ngx_http_fancyindex_index_header_t) + ngx_align(ctx->path.len, 8));
+    names = p = (u_char *) (ie + entries->nelts);
+
+    for (i = 0; i < entries->nelts; i++, ie++) {
+        ie->mtime       = (int64_t) entry[i].mtime;
+        ie->size        = (int64_t) entry[i].size;
+        ie->uniq        = (uint64_t) entry[i].uniq;
+        ie->name        = p - names;
+        ie->name_len    = (uint32_t) entry[i].name.len;
+        ie->utf_len     = (uint32_t) entry[i].utf_len;
+        ie->escape      = (uint32_t) entry[i].escape;
+        ie->escape_html = (uint32_t) entry[i].escape_html;
+        ie->dir         = (uint8_t) entry[i].dir;
+        ie->link        = (uint8_t) entry[i].link;
+
+        p = ngx_cpymem_str(p, entry[i].name);
+        *p++ = '\0';
+    }
+
+    len = ngx_strlen(name);
+    if ((temp = ngx_alloc(len + 1 + NGX_INT64_LEN + 1, log)) == NULL) {
+        ngx_free(buf);
+        return;
+    }
+    ngx_sprintf(temp, "%s.%P%Z", name, ngx_pid);
+
+    fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        ngx_free(temp);
+        ngx_free(buf);
+        return;
+    }
+
+    for (p = buf; p < buf + size; p += n) {
+        n = ngx_write_fd(fd, p, buf + size - p);
+        if (n == -1) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_write_fd_n " \"%s\" failed", temp);
+            break;
         }
     }
 
-    /* Sort entries, if needed */
-    if (entries.nelts > 1) {
-        if (alcf->dirs_first)
-        {
-            ngx_http_fancyindex_entry_t *l, *r;
+    written = (p == buf + size);
+    ngx_free(buf);
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    if (!written || ngx_rename_file(temp, name) == NGX_FILE_ERROR) {
+        if (written) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                          temp, name);
+        }
+
+        if (ngx_delete_file(temp) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                          ngx_delete_file_n " \"%s\" failed", temp);
+        }
+    }
+
+    ngx_free(temp);
+}
+
+
+/*
+ * Sets ctx->uniq and ctx->mtime from the directory being listed, which are
+ * used to check whether cached entries or listings are current. This goes
+ * through open_file_cache if configured, which saves the stat() while the
+ * cached information is valid. Returns NGX_DECLINED if it is not possible,
+ * to let scanning the directory report the error.
+ */
+static ngx_int_t
+ngx_http_fancyindex_dir_info(ngx_http_request_t *r,
+                             ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_open_file_info_t      of;
+    ngx_file_info_t           fi;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->open_file_cache == NULL) {
+        if (ngx_file_info(ctx->path.data, &fi) == NGX_FILE_ERROR
+            || !ngx_is_dir(&fi))
+            return NGX_DECLINED;
+
+        ctx->uniq = ngx_file_uniq(&fi);
+        ctx->mtime = ngx_file_mtime(&fi);
+        return NGX_OK;
+    }
+
+    ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+    of.test_dir = 1;
+    of.valid = clcf->open_file_cache_valid;
+    of.min_uses = clcf->open_file_cache_min_uses;
+    of.errors = clcf->open_file_cache_errors;
+    of.events = clcf->open_file_cache_events;
+
+    if (ngx_open_cached_file(clcf->open_file_cache, &ctx->path, &of, r->pool)
+            != NGX_OK || !of.is_dir)
+        return NGX_DECLINED;
+
+    ctx->uniq = of.uniq;
+    ctx->mtime = of.mtime;
+    return NGX_OK;
+}
+
+
+/*
+ * Appends the entries of the directory being listed to "entries", reading
+ * them from its index file if fancyindex_index_path is set and the index
+ * is current, or scanning the directory (and updating the index) if not.
+ * Indexes are checked against ctx->uniq and ctx->mtime, which are only
+ * set here if they are not known yet.
+ */
+static ngx_int_t
+ngx_http_fancyindex_load_dir(ngx_http_request_t *r,
+                             ngx_http_fancyindex_ctx_t *ctx,
+                             ngx_http_fancyindex_loc_conf_t *alcf,
+                             ngx_pool_t *pool, ngx_array_t *entries)
+{
+    ngx_int_t  rc;
+    u_char    *name = NULL;
+
+    if (alcf->index_path.len
+        && (ctx->mtime != -1 || ngx_http_fancyindex_dir_info(r, ctx) == NGX_OK))
+    {
+        if ((name = ngx_http_fancyindex_index_name(r->pool, alcf, &ctx->path)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        rc = ngx_http_fancyindex_index_read(pool, r->connection->log, alcf,
+                                            ctx, name, entries);
+        if (rc == NGX_OK)
+            return NGX_OK;
+
+        if (rc == NGX_ERROR)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    rc = ngx_http_fancyindex_read_dir(pool, r->connection->log, alcf,
+                                      &ctx->path, ctx->allocated, NULL,
+                                      ctx->flags | NGX_HTTP_FANCYINDEX_SCAN_IGNORE,
+                                      &ctx->limit, entries);
+
+    if (rc == NGX_OK && name && !ctx->limit.truncated)
+        ngx_http_fancyindex_index_write(r->connection->log, alcf, ctx,
+                                        name, entries);
+
+    return rc;
+}
+
+
+/*
+ * Unlinks a node from the scan cache. Its memory is released once no
+ * request is using its entries anymore.
+ */
+static void
+ngx_http_fancyindex_scan_cache_free(ngx_http_fancyindex_scan_cache_t *cache,
+                                    ngx_http_fancyindex_scan_node_t *node)
+{
+    if (!node->removed) {
+        ngx_rbtree_delete(&cache->rbtree, &node->sn.node);
+        ngx_queue_remove(&node->queue);
+        cache->current--;
+        node->removed = 1;
+    }
+
+    if (node->count == 0)
+        ngx_destroy_pool(node->pool);
+}
+
+
+static void
+ngx_http_fancyindex_scan_cache_release(void *data)
+{
+    ngx_http_fancyindex_scan_node_t *node = data;
+
+    if (--node->count == 0 && node->removed)
+        ngx_destroy_pool(node->pool);
+}
+
+
+/*
+ * Same as ngx_expire_old_cached_files(): n == 1 deletes one or two
+ * inactive nodes, n == 0 deletes the least recently used node by force,
+ * and one or two inactive ones.
+ */
+static void
+ngx_http_fancyindex_scan_cache_expire(ngx_http_fancyindex_scan_cache_t *cache,
+                                      ngx_uint_t n)
+{
+    ngx_http_fancyindex_scan_node_t *node;
+    ngx_queue_t                     *q;
+    time_t                           now;
+
+    now = ngx_time();
+
+    while (n < 3) {
+        if (ngx_queue_empty(&cache->expire_queue))
+            return;
+
+        q = ngx_queue_last(&cache->expire_queue);
+        node = ngx_queue_data(q, ngx_http_fancyindex_scan_node_t, queue);
+
+        if (n++ != 0 && now - node->accessed <= cache->inactive)
+            return;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http fancyindex: expire scan cache \"%V\"",
+                       &node->sn.str);
+
+        ngx_http_fancyindex_scan_cache_free(cache, node);
+    }
+}
+
+
+static void
+ngx_http_fancyindex_scan_cache_cleanup(void *data)
+{
+    ngx_http_fancyindex_scan_cache_t *cache = data;
+    ngx_http_fancyindex_scan_node_t  *node;
+    ngx_queue_t                      *q;
+
+    while (!ngx_queue_empty(&cache->expire_queue)) {
+        q = ngx_queue_head(&cache->expire_queue);
+        node = ngx_queue_data(q, ngx_http_fancyindex_scan_node_t, queue);
+
+        ngx_queue_remove(q);
+        ngx_destroy_pool(node->pool);
+    }
+}
+
+
+/*
+ * Scans a directory into a new scan cache node, replacing the existing
+ * one for the same path, if any.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_cache_add(ngx_http_request_t *r,
+                                   ngx_http_fancyindex_ctx_t *ctx,
+                                   ngx_http_fancyindex_loc_conf_t *alcf,
+                                   uint32_t hash,
+                                   ngx_http_fancyindex_scan_node_t **pnode)
+{
+    ngx_http_fancyindex_scan_cache_t *cache = alcf->scan_cache;
+    ngx_http_fancyindex_scan_node_t  *node;
+    ngx_array_t                       entries;
+    ngx_pool_t                       *pool;
+    ngx_int_t                         rc;
+
+    /* Nodes outlive the request, so the cycle log is used for the pool. */
+    if ((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if ((node = ngx_pcalloc(pool, sizeof(ngx_http_fancyindex_scan_node_t))) == NULL)
+        goto failed;
+
+    node->sn.str.len = ctx->path.len;
+    if ((node->sn.str.data = ngx_pnalloc(pool, ctx->path.len)) == NULL)
+        goto failed;
+    ngx_memcpy(node->sn.str.data, ctx->path.data, ctx->path.len);
+
+    if (ngx_array_init(&entries, pool, 40,
+                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        goto failed;
+
+    rc = ngx_http_fancyindex_load_dir(r, ctx, alcf, pool, &entries);
+    if (rc != NGX_OK) {
+        ngx_destroy_pool(pool);
+        return rc;
+    }
+
+    if (entries.nelts > 1)
+        ngx_qsort(entries.elts, (size_t) entries.nelts,
+                  sizeof(ngx_http_fancyindex_entry_t),
+                  ngx_http_fancyindex_cmp_entries_mtime_desc);
+
+    node->pool     = pool;
+    node->entries  = entries.elts;
+    node->nentries = entries.nelts;
+    node->alcf     = alcf;
+    node->flags    = ctx->flags;
+    node->uniq     = ctx->uniq;
+    node->mtime    = ctx->mtime;
+    node->created  = ngx_time();
+
+    *pnode = node;
+
+    /* Partial scans are used by the request, but not kept. */
+    if (ctx->limit.truncated) {
+        node->removed = 1;
+        return NGX_OK;
+    }
+
+    node->sn.node.key = hash;
+    ngx_rbtree_insert(&cache->rbtree, &node->sn.node);
+    ngx_queue_insert_head(&cache->expire_queue, &node->queue);
+
+    if (++cache->current > cache->max)
+        ngx_http_fancyindex_scan_cache_expire(cache, 0);
+
+    return NGX_OK;
+
+failed:
+    ngx_destroy_pool(pool);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+
+/*
+ * Appends to ctx->entries the entries of the directory modified since
+ * ctx->since (or all of them) using the scan cache. Checking whether the
+ * cached entries are current only needs a stat() of the directory, and
+ * as they are kept newest first the cost of the copy is proportional to
+ * the number of entries listed, not to the size of the directory.
+ *
+ * Returns NGX_DECLINED if the directory cannot be checked, to let the
+ * uncached code path report the error.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_cached(ngx_http_request_t *r,
+                                ngx_http_fancyindex_ctx_t *ctx,
+                                ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_scan_cache_t *cache = alcf->scan_cache;
+    ngx_http_fancyindex_scan_node_t  *node;
+    ngx_pool_cleanup_t               *cln;
+    ngx_uint_t                        n;
+    uint32_t                          hash;
+    ngx_int_t                         rc;
+    void                             *p;
+
+    if (ngx_http_fancyindex_dir_info(r, ctx) != NGX_OK)
+        return NGX_DECLINED;
+
+    ngx_http_fancyindex_scan_cache_expire(cache, 1);
+
+    hash = ngx_crc32_long(ctx->path.data, ctx->path.len);
+    node = (ngx_http_fancyindex_scan_node_t *)
+        ngx_str_rbtree_lookup(&cache->rbtree, &ctx->path, hash);
+
+    if (node
+        && node->uniq == ctx->uniq
+        && node->mtime == ctx->mtime
+        && node->alcf == alcf
+        && node->flags == ctx->flags
+        && ngx_time() - node->created < cache->valid)
+    {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: scan cache hit \"%V\"", &ctx->path);
+
+        ngx_queue_remove(&node->queue);
+        ngx_queue_insert_head(&cache->expire_queue, &node->queue);
+
+    } else {
+        if (node)
+            ngx_http_fancyindex_scan_cache_free(cache, node);
+
+        /*
+         * Tagged with what open_file_cache says, which may lag behind; if
+         * so the directory is scanned again once it catches up.
+         */
+        rc = ngx_http_fancyindex_scan_cache_add(r, ctx, alcf, hash, &node);
+        if (rc != NGX_OK)
+            return rc;
+    }
+
+    node->accessed = ngx_time();
+    ctx->mtime = node->mtime;
+
+    /* Entry names point into the node, keep it around. */
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    cln->handler = ngx_http_fancyindex_scan_cache_release;
+    cln->data = node;
+    node->count++;
+
+    for (n = 0; n < node->nentries; n++) {
+        if (ctx->since != -1 && node->entries[n].mtime < ctx->since)
+            break;
+    }
+
+    if (n) {
+        if ((p = ngx_array_push_n(&ctx->entries, n)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        ngx_memcpy(p, node->entries, n * sizeof(ngx_http_fancyindex_entry_t));
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Determines the sorting criterion. URL arguments look like:
+ *
+ *    C=x[&O=y]
+ *
+ * Where x={M,S,N} and y={A,D}. The arguments which need to be appended to
+ * directory links in order to keep the criterion are stored in "url_args".
+ */
+static ngx_uint_t
+ngx_http_fancyindex_sort_criterion(ngx_http_request_t *r,
+                                   ngx_http_fancyindex_loc_conf_t *alcf,
+                                   const char **url_args)
+{
+    ngx_uint_t criterion, sort_descending;
+    ngx_str_t  value, order;
+
+    *url_args = "";
+
+    if (ngx_http_arg(r, (u_char *) "C", 1, &value) != NGX_OK || value.len == 0)
+        return alcf->default_sort;
+
+    /* Determine whether the direction of the sorting */
+    sort_descending = ngx_http_arg(r, (u_char *) "O", 1, &order) == NGX_OK
+                   && order.len == 1
+                   && order.data[0] == 'D';
+
+    /* Pick the sorting criteria */
+    switch (value.data[0]) {
+        case 'M': /* Sort by mtime */
+            criterion = sort_descending
+                ? NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC
+                : NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE;
+            break;
+        case 'S': /* Sort by size */
+            criterion = sort_descending
+                ? NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC
+                : NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE;
+            break;
+        case 'U': /* Unsorted, in the order of the directory */
+            criterion = NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE;
+            break;
+        case 'N': /* Sort by name */
+        default:
+            criterion = sort_descending
+                ? NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC
+                : NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME;
+            break;
+    }
+
+    if (criterion != alcf->default_sort)
+        *url_args = ngx_http_fancyindex_sort_url_args[criterion];
+
+    return criterion;
+}
+
+
+static ngx_http_fancyindex_cmp_pt
+ngx_http_fancyindex_sort_cmp(ngx_uint_t criterion, ngx_flag_t case_sensitive)
+{
+    switch (criterion) {
+        case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE_DESC:
+            return ngx_http_fancyindex_cmp_entries_mtime_desc;
+        case NGX_HTTP_FANCYINDEX_SORT_CRITERION_DATE:
+            return ngx_http_fancyindex_cmp_entries_mtime_asc;
+        case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE_DESC:
+            return ngx_http_fancyindex_cmp_entries_size_desc;
+        case NGX_HTTP_FANCYINDEX_SORT_CRITERION_SIZE:
+            return ngx_http_fancyindex_cmp_entries_size_asc;
+        case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME_DESC:
+            return case_sensitive
+                ? ngx_http_fancyindex_cmp_entries_name_cs_desc
+                : ngx_http_fancyindex_cmp_entries_name_ci_desc;
+        case NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME:
+        default:
+            return case_sensitive
+                ? ngx_http_fancyindex_cmp_entries_name_cs_asc
+                : ngx_http_fancyindex_cmp_entries_name_ci_asc;
+    }
+}
+
+
+/*
+ * Moves directories before files, returning how many there are.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_partition_dirs(ngx_http_fancyindex_entry_t *entry,
+                                   ngx_uint_t nelts)
+{
+    ngx_http_fancyindex_entry_t *l, *r;
+
+    if (nelts == 0)
+        return 0;
+
+    l = entry;
+    r = entry + nelts - 1;
+    while (l < r)
+    {
+        while (l < r && l->dir)
+            l++;
+        while (l < r && !r->dir)
+            r--;
+        if (l < r) {
+            /* Now l points a file while r points a directory */
+            ngx_http_fancyindex_entry_t tmp;
+            tmp = *l;
+            *l = *r;
+            *r = tmp;
+        }
+    }
+    if (r->dir)
+        r++;
+
+    return r - entry;
+}
+
+
+static void
+ngx_http_fancyindex_sort_entries(ngx_http_fancyindex_entry_t *entry,
+                                 ngx_uint_t nelts,
+                                 ngx_http_fancyindex_cmp_pt sort_cmp_func,
+                                 ngx_flag_t dirs_first)
+{
+    /* Sort entries, if needed */
+    if (nelts > 1) {
+        if (dirs_first)
+        {
+            ngx_http_fancyindex_entry_t *r;
+
+            r = entry + ngx_http_fancyindex_partition_dirs(entry, nelts);
+
+            if (r > entry)
+                /* Sort directories */
+                ngx_qsort(entry, (size_t)(r - entry),
+                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
+            if (r < entry + nelts)
+                /* Sort files */
+                ngx_qsort(r, (size_t)(entry + nelts - r),
+                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
+        } else {
+            ngx_qsort(entry, (size_t)nelts,
+                    sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
+        }
+    }
+}
+
+
+/*
+ * Bytes needed by ngx_http_fancyindex_render_head().
+ */
+static size_t
+ngx_http_fancyindex_head_len(ngx_http_fancyindex_loc_conf_t *alcf,
+                             ngx_str_t *uri)
+{
+    size_t len;
+
+    len = ngx_sizeof_ssz(t06_list1) + ngx_sizeof_ssz(t06_list1_end);
+
+    /* Path, if displayed */
+    if (alcf->show_path) {
+        len += uri->len + ngx_escape_html(NULL, uri->data, uri->len)
+             + ngx_sizeof_ssz(t05_body2);
+    }
+
+    /*
+     * "Parent directory" entry, which is not displayed at the root of the
+     * webserver (URI = "/" --> length of 1). It ends in CR LF, not just LF.
+     */
+    if (uri->len > 1 && !alcf->hide_parent) {
+        len += ngx_sizeof_ssz(t_parentdir_entry) + 1;
+    }
+
+    if (alcf->compact) {
+        len = len - ngx_sizeof_ssz(t06_list1)
+                  + ngx_sizeof_ssz(t06_list1_compact);
+    }
+
+    if (alcf->checksum_zone) {
+        len += ngx_sizeof_ssz("<th>SHA-256</th>")
+             + ngx_sizeof_ssz("<td class=\"checksum\"></td>")
+             + 2 * NGX_HTTP_FANCYINDEX_SHA256_LEN;
+    }
+
+    return len;
+}
+
+
+/*
+ * Bytes needed by ngx_http_fancyindex_render_rows().
+ */
+static size_t
+ngx_http_fancyindex_rows_len(ngx_http_fancyindex_loc_conf_t *alcf,
+                             ngx_http_fancyindex_entry_t *entry,
+                             ngx_uint_t nentries)
+{
+    size_t      len;
+    ngx_uint_t  i;
+
+    len = ngx_fancyindex_timefmt_calc_size (&alcf->time_format) * nentries;
+
+    if (alcf->checksum_zone) {
+        len += nentries * (ngx_sizeof_ssz("<td class=\"checksum\"></td>")
+                           + 2 * NGX_HTTP_FANCYINDEX_SHA256_LEN);
+    }
+
+    for (i = 0; i < nentries && alcf->compact; i++) {
+        /*
+         * Compact rows have no classes nor title:
+         *
+         *   <tr><td><a href="U[?sort]">fname</a></td>
+         *   <td>size</td><td>date</td></tr>
+         */
+        len += ngx_sizeof_ssz("<tr><td><a href=\"")
+            + entry[i].name.len + entry[i].escape /* Escaped URL */
+            + ngx_sizeof_ssz("/?C=x&amp;O=y") /* URL sorting arguments */
+            + ngx_sizeof_ssz("\">")
+            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
+            + ngx_sizeof_ssz("/</a></td><td>")
+            + 20 /* File size */
+            + ngx_sizeof_ssz("</td><td>")    /* Date prefix */
+            + ngx_sizeof_ssz("</td></tr>\n") /* Date suffix */
+            + 2 /* CR LF */
+            ;
+    }
+
+    for (i = 0; i < nentries && !alcf->compact; i++) {
+        /*
+         * Genearated table rows are as follows, unneeded whitespace
+         * is stripped out:
+         *
+         *   <tr>
+         *     <td><a href="U[?sort]">fname</a></td>
+         *     <td>size</td><td>date</td>
+         *   </tr>
+         */
+        len += ngx_sizeof_ssz("<tr><td colspan=\"2\" class=\"link\"><a href=\"")
+            + entry[i].name.len + entry[i].escape /* Escaped URL */
+            + ngx_sizeof_ssz("?C=x&amp;O=y") /* URL sorting arguments */
+            + ngx_sizeof_ssz("\" title=\"")
+            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
+            + ngx_sizeof_ssz("\">")
+            + entry[i].name.len + entry[i].utf_len + entry[i].escape_html
+            + ngx_sizeof_ssz("</a></td><td class=\"size\">")
+            + 20 /* File size */
+            + ngx_sizeof_ssz("</td><td class=\"date\">")    /* Date prefix */
+            + ngx_sizeof_ssz("</td></tr>\n") /* Date suffix */
+            + 2 /* CR LF */
+            ;
+    }
+
+    return len;
+}
+
+
+#define NGX_HTTP_FANCYINDEX_TAIL_LEN                                          \
+    (ngx_sizeof_ssz(t07_list2)                                                \
+     + ngx_sizeof_ssz("<p class=\"truncated\">Listing truncated after  entries.</p>") \
+     + NGX_INT_T_LEN)
+
+
+/*
+ * Renders the path and the table up to the "Parent directory" row.
+ */
+static u_char *
+ngx_http_fancyindex_render_head(u_char *p,
+                                ngx_http_fancyindex_loc_conf_t *alcf,
+                                ngx_str_t *uri,
+                                const char *sort_url_args)
+{
+    /* Display the path, if needed */
+    if (alcf->show_path){
+        p = (u_char *) ngx_escape_html(p, uri->data, uri->len);
+        p = ngx_cpymem_ssz(p, t05_body2);
+    }
+
+    /* Open the <table> tag */
+    if (alcf->compact)
+        p = ngx_cpymem_ssz(p, t06_list1_compact);
+    else
+        p = ngx_cpymem_ssz(p, t06_list1);
+    if (alcf->checksum_zone) {
+        p = ngx_cpymem_ssz(p, "<th>SHA-256</th>");
+    }
+    p = ngx_cpymem_ssz(p, t06_list1_end);
+
+    /* "Parent dir" entry, always first if displayed */
+    if (uri->len > 1 && alcf->hide_parent == 0 && alcf->compact) {
+        p = ngx_cpymem_ssz(p, "<tr><td><a href=\"../");
+        if (*sort_url_args) {
+            p = ngx_cpymem(p,
+                           sort_url_args,
+                           ngx_sizeof_ssz("?C=N&amp;O=A"));
+        }
+        p = ngx_cpymem_ssz(p,
+                           "\">Parent directory/</a></td>"
+                           "<td>-</td><td>-</td>");
+        if (alcf->checksum_zone) {
+            p = ngx_cpymem_ssz(p, "<td>-</td>");
+        }
+        p = ngx_cpymem_ssz(p, "</tr>" CRLF);
+
+    } else if (uri->len > 1 && alcf->hide_parent == 0) {
+        p = ngx_cpymem_ssz(p,
+                           "<tr>"
+                           "<td colspan=\"2\" class=\"link\"><a href=\"../");
+        if (*sort_url_args) {
+            p = ngx_cpymem(p,
+                           sort_url_args,
+                           ngx_sizeof_ssz("?C=N&amp;O=A"));
+        }
+        p = ngx_cpymem_ssz(p,
+                           "\">Parent directory/</a></td>"
+                           "<td class=\"size\">-</td>"
+                           "<td class=\"date\">-</td>");
+        if (alcf->checksum_zone) {
+            p = ngx_cpymem_ssz(p, "<td class=\"checksum\">-</td>");
+        }
+        p = ngx_cpymem_ssz(p, "</tr>" CRLF);
+    }
+
+    return p;
+}
+
+
+/*
+ * Renders one table row for each of the entries.
+ */
+static u_char *
+ngx_http_fancyindex_render_rows(u_char *p,
+                                ngx_http_fancyindex_loc_conf_t *alcf,
+                                ngx_http_fancyindex_entry_t *entry,
+                                ngx_uint_t nentries,
+                                const char *sort_url_args)
+{
+    off_t        length;
+    int64_t      multiplier;
+    ngx_tm_t     tm;
+    ngx_time_t  *tp;
+    time_t       gmtoff;
+    ngx_uint_t   i, j;
+
+    static const char    *sizes[]  = { "EiB", "PiB", "TiB", "GiB", "MiB", "KiB", "B" };
+    static const int64_t  exbibyte = 1024LL * 1024LL * 1024LL *
+                                     1024LL * 1024LL * 1024LL;
+
+    tp = ngx_timeofday();
+    gmtoff = alcf->localtime ? tp->gmtoff * 60 : 0;
+
+    /* Entries for directories and files */
+    for (i = 0; i < nentries; i++) {
+        if (alcf->compact)
+            p = ngx_cpymem_ssz(p, "<tr><td><a href=\"");
+        else
+            p = ngx_cpymem_ssz(p, "<tr><td colspan=\"2\" class=\"link\"><a href=\"");
+
+        if (entry[i].escape) {
+            ngx_fancyindex_escape_path(p,
+                                       entry[i].name.data,
+                                       entry[i].name.len);
+
+            p += entry[i].name.len + entry[i].escape;
+
+        } else {
+            p = ngx_cpymem_str(p, entry[i].name);
+        }
+        if (entry[i].dir) {
+            *p++ = '/';
+            if (*sort_url_args) {
+                p = ngx_cpymem(p,
+                               sort_url_args,
+                               ngx_sizeof_ssz("?C=x&amp;O=y"));
+            }
+        }
+
+        *p++ = '"';
+        if (!alcf->compact) {
+            p = ngx_cpymem_ssz(p, " title=\"");
+            p = (u_char *) ngx_escape_html(p, entry[i].name.data, entry[i].name.len);
+            *p++ = '"';
+        }
+        *p++ = '>';
+
+        p = (u_char *) ngx_escape_html(p, entry[i].name.data, entry[i].name.len);
+
+        if (entry[i].dir) {
+            *p++ = '/';
+        }
+
+        if (alcf->compact)
+            p = ngx_cpymem_ssz(p, "</a></td><td>");
+        else
+            p = ngx_cpymem_ssz(p, "</a></td><td class=\"size\">");
+
+        if (alcf->exact_size) {
+            if (entry[i].dir) {
+                *p++ = '-';
+            } else {
+                p = ngx_sprintf(p, "%19O", entry[i].size);
+            }
+
+        } else {
+            if (entry[i].dir) {
+                *p++ = '-';
+            } else {
+                length = entry[i].size;
+                multiplier = exbibyte;
+
+                for (j = 0; j < DIM(sizes) - 1 && length < multiplier; j++)
+                    multiplier /= 1024;
+
+                /* If we are showing the filesize in bytes, do not show a decimal */
+                if (j == DIM(sizes) - 1)
+                    p = ngx_sprintf(p, "%O %s", length, sizes[j]);
+                else
+                    p = ngx_sprintf(p, "%.1f %s",
+                                    (float) length / multiplier, sizes[j]);
+            }
+        }
+
+        ngx_gmtime(entry[i].mtime + gmtoff, &tm);
+        if (alcf->compact)
+            p = ngx_cpymem_ssz(p, "</td><td>");
+        else
+            p = ngx_cpymem_ssz(p, "</td><td class=\"date\">");
+        p = ngx_fancyindex_timefmt(p, &alcf->time_format, &tm);
+
+        if (alcf->checksum_zone) {
+            if (alcf->compact)
+                p = ngx_cpymem_ssz(p, "</td><td>");
+            else
+                p = ngx_cpymem_ssz(p, "</td><td class=\"checksum\">");
+            if (entry[i].dir) {
+                *p++ = '-';
+            } else if (entry[i].checksum) {
+                p = ngx_hex_dump(p, entry[i].checksum,
+                                 NGX_HTTP_FANCYINDEX_SHA256_LEN);
+            } else {
+                p = ngx_cpymem_ssz(p, "pending");
+            }
+        }
+
+        p = ngx_cpymem_ssz(p, "</td></tr>");
+
+        *p++ = CR;
+        *p++ = LF;
+    }
+
+    return p;
+}
+
+
+/*
+ * Closes the table, noting whether the listing was truncated after
+ * "nentries" entries.
+ */
+static u_char *
+ngx_http_fancyindex_render_tail(u_char *p, ngx_uint_t nentries,
+                                ngx_flag_t truncated)
+{
+    /* Output table bottom */
+    p = ngx_cpymem_ssz(p, t07_list2);
+
+    if (truncated) {
+        p = ngx_sprintf(p, "<p class=\"truncated\">"
+                        "Listing truncated after %ui entries.</p>",
+                        nentries);
+    }
+
+    return p;
+}
+
+
+static uint64_t
+ngx_http_fancyindex_row_hash(ngx_http_fancyindex_entry_t *entry)
+{
+    return ((uint64_t) ngx_crc32_long(entry->name.data, entry->name.len) << 32)
+           | ngx_murmur_hash2(entry->name.data, entry->name.len);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_rows(const void *one, const void *two)
+{
+    const ngx_http_fancyindex_cache_row_t *first = one;
+    const ngx_http_fancyindex_cache_row_t *second = two;
+
+    if (first->hash == second->hash)
+        return 0;
+
+    return (first->hash < second->hash) ? -1 : 1;
+}
+
+
+/*
+ * Finds the row of the old listing for an unchanged entry, if any.
+ */
+static ngx_http_fancyindex_cache_row_t *
+ngx_http_fancyindex_row_find(ngx_http_fancyindex_patch_t *patch,
+                             ngx_http_fancyindex_cache_row_t *row)
+{
+    ngx_http_fancyindex_cache_row_t *base = patch->base;
+    ngx_uint_t                       lo = 0, hi = patch->nbase, mid;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (base[mid].hash < row->hash) {
+            lo = mid + 1;
+        } else if (base[mid].hash > row->hash) {
+            hi = mid;
+        } else {
+            if (base[mid].size == row->size && base[mid].mtime == row->mtime)
+                return &base[mid];
+            return NULL;
+        }
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Renders the rows like ngx_http_fancyindex_render_rows() does, but copies
+ * those of entries which did not change from the listing being replaced,
+ * so the cost is proportional to the changes, and records where each row
+ * is so the next rendering can do the same. A row only depends on its
+ * entry and on settings which are part of the cache key, and the dates
+ * are in the same timezone, so copies are the same as rendering anew.
+ */
+static u_char *
+ngx_http_fancyindex_render_patch(ngx_pool_t *pool,
+                                 u_char *p, u_char *start,
+                                 ngx_http_fancyindex_loc_conf_t *alcf,
+                                 ngx_http_fancyindex_entry_t *entry,
+                                 ngx_uint_t nentries,
+                                 const char *sort_url_args,
+                                 ngx_http_fancyindex_patch_t *patch)
+{
+    ngx_http_fancyindex_cache_row_t *row, *old;
+    ngx_uint_t                       i;
+
+    patch->rows = ngx_palloc(pool, (nentries + 1)
+                                   * sizeof(ngx_http_fancyindex_cache_row_t));
+    if (patch->rows == NULL)
+        return NULL;
+
+    patch->nrows = nentries;
+    patch->reused = 0;
+
+    for (i = 0; i < nentries; i++) {
+        row = &patch->rows[i];
+        row->hash = ngx_http_fancyindex_row_hash(&entry[i]);
+        row->size = entry[i].dir ? -1 : entry[i].size;
+        row->mtime = entry[i].mtime;
+        row->offset = (uint32_t) (p - start);
+
+        old = patch->nbase ? ngx_http_fancyindex_row_find(patch, row) : NULL;
+
+        if (old) {
+            p = ngx_cpymem(p, patch->body + old->offset, old->len);
+            patch->reused++;
+        } else {
+            p = ngx_http_fancyindex_render_rows(p, alcf, &entry[i], 1,
+                                                sort_url_args);
+        }
+
+        row->len = (uint32_t) (p - start) - row->offset;
+    }
+
+    if (nentries > 1)
+        ngx_qsort(patch->rows, (size_t) nentries,
+                  sizeof(ngx_http_fancyindex_cache_row_t),
+                  ngx_http_fancyindex_cmp_rows);
+
+    return p;
+}
+
+
+static void
+ngx_http_fancyindex_buffer_release(void *data)
+{
+    ngx_http_fancyindex_buffer_t    *buf = data;
+    ngx_http_fancyindex_main_conf_t *amcf = buf->amcf;
+    size_t                           size;
+
+    size = (size_t) 1 << (NGX_HTTP_FANCYINDEX_BUFFER_SHIFT + buf->class);
+
+    ngx_http_fancyindex_buffer_lock(amcf);
+    if (amcf->buffer_retained + size <= amcf->buffer_pool) {
+        amcf->buffer_retained += size;
+        ngx_queue_insert_head(&amcf->buffers[buf->class], &buf->queue);
+        buf = NULL;
+    }
+    ngx_http_fancyindex_buffer_unlock(amcf);
+
+    if (buf)
+        ngx_free(buf);
+}
+
+
+/*
+ * Allocates a buffer for a rendered listing, reusing one released by
+ * a previous listing if possible. See NGX_HTTP_FANCYINDEX_BUFFER_SHIFT.
+ */
+static ngx_buf_t *
+ngx_http_fancyindex_buffer(ngx_pool_t *pool, size_t size)
+{
+    ngx_http_fancyindex_main_conf_t *amcf;
+    ngx_http_fancyindex_buffer_t    *buf = NULL;
+    ngx_pool_cleanup_t              *cln;
+    ngx_queue_t                     *q;
+    ngx_uint_t                       class = 0;
+    ngx_buf_t                       *b;
+
+    amcf = ngx_http_cycle_get_module_main_conf(ngx_cycle,
+                                               ngx_http_fancyindex_module);
+
+    if (amcf->buffer_pool == 0
+        || size < (size_t) 1 << NGX_HTTP_FANCYINDEX_BUFFER_SHIFT)
+        return ngx_create_temp_buf(pool, size);
+
+    while (((size_t) 1 << (NGX_HTTP_FANCYINDEX_BUFFER_SHIFT + class)) < size) {
+        if (++class == NGX_HTTP_FANCYINDEX_BUFFER_CLASSES)
+            return ngx_create_temp_buf(pool, size);
+    }
+
+    if ((b = ngx_calloc_buf(pool)) == NULL)
+        return NULL;
+
+    if ((cln = ngx_pool_cleanup_add(pool, 0)) == NULL)
+        return NULL;
+
+    ngx_http_fancyindex_buffer_lock(amcf);
+    if (!ngx_queue_empty(&amcf->buffers[class])) {
+        q = ngx_queue_head(&amcf->buffers[class]);
+        ngx_queue_remove(q);
+        buf = ngx_queue_data(q, ngx_http_fancyindex_buffer_t, queue);
+        amcf->buffer_retained -= (size_t) 1
+                                 << (NGX_HTTP_FANCYINDEX_BUFFER_SHIFT + class);
+    }
+    ngx_http_fancyindex_buffer_unlock(amcf);
+
+    if (buf == NULL) {
+        buf = ngx_alloc(sizeof(ngx_http_fancyindex_buffer_t)
+                        + ((size_t) 1 << (NGX_HTTP_FANCYINDEX_BUFFER_SHIFT + class)),
+                        pool->log);
+        if (buf == NULL)
+            return NULL;
+
+        buf->class = class;
+        buf->amcf = amcf;
+    }
+
+    cln->handler = ngx_http_fancyindex_buffer_release;
+    cln->data = buf;
+
+    b->start = (u_char *) (buf + 1);
+    b->pos = b->start;
+    b->last = b->start;
+    b->end = b->start + size;
+    b->temporary = 1;
+
+    return b;
+}
+
+
+/*
+ * Renders the listing table for the given entries, which must be already
+ * sorted. The result does not depend on the request, other than through
+ * the URI passed, so it can be done in the absence of one. With a "patch"
+ * the rows of the listing being replaced are reused.
+ */
+static ngx_buf_t *
+ngx_http_fancyindex_render(ngx_pool_t *pool,
+                           ngx_http_fancyindex_loc_conf_t *alcf,
+                           ngx_str_t *uri,
+                           ngx_http_fancyindex_entry_t *entry,
+                           ngx_uint_t nentries,
+                           const char *sort_url_args,
+                           ngx_flag_t truncated,
+                           ngx_http_fancyindex_patch_t *patch)
+{
+    ngx_buf_t *b;
+
+    b = ngx_http_fancyindex_buffer(pool, ngx_http_fancyindex_head_len(alcf, uri)
+                                         + ngx_http_fancyindex_rows_len(alcf, entry,
+                                                                        nentries)
+                                         + NGX_HTTP_FANCYINDEX_TAIL_LEN);
+    if (b == NULL)
+        return NULL;
+
+    b->last = ngx_http_fancyindex_render_head(b->last, alcf, uri,
+                                              sort_url_args);
+    if (patch) {
+        b->last = ngx_http_fancyindex_render_patch(pool, b->last, b->pos,
+                                                   alcf, entry, nentries,
+                                                   sort_url_args, patch);
+        if (b->last == NULL)
+            return NULL;
+    } else {
+        b->last = ngx_http_fancyindex_render_rows(b->last, alcf, entry,
+                                                  nentries, sort_url_args);
+    }
+
+    b->last = ngx_http_fancyindex_render_tail(b->last, nentries, truncated);
+
+    return b;
+}
+
+
+static void
+ngx_http_fancyindex_destroy_pool(void *data)
+{
+    ngx_destroy_pool(data);
+}
+
+
+static void
+ngx_http_fancyindex_scan_dirs(ngx_http_fancyindex_scan_t *scan, ngx_log_t *log)
+{
+    ngx_uint_t i, n;
+
+    for (i = 0; i < scan->ndirs; i++) {
+        n = scan->entries.nelts;
+
+        /* Errors are logged, and the directory is skipped. */
+        (void) ngx_http_fancyindex_read_dir(scan->pool, log, scan->alcf,
+                                            &scan->dirs[i].path,
+                                            scan->dirs[i].allocated,
+                                            &scan->dirs[i].prefix,
+                                            scan->flags, &scan->limit,
+                                            &scan->entries);
+
+        scan->dirs[i].nentries = scan->entries.nelts - n;
+    }
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_fancyindex_scan_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_scan_t *scan = data;
+
+    scan->flags |= NGX_HTTP_FANCYINDEX_SCAN_THREAD;
+    ngx_http_fancyindex_scan_dirs(scan, log);
+}
+
+
+static void
+ngx_http_fancyindex_scan_event_handler(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_scan_t *scan = ev->data;
+    ngx_http_fancyindex_ctx_t  *ctx;
+    ngx_http_request_t         *r;
+    ngx_connection_t           *c;
+
+    r = scan->request;
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (--ctx->pending) {
+        return;
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_post_scan(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_http_fancyindex_scan_t *scan)
+{
+    ngx_thread_task_t *task;
+
+    if ((task = ngx_thread_task_alloc(r->pool, 0)) == NULL)
+        return NGX_ERROR;
+
+    task->ctx = scan;
+    task->handler = ngx_http_fancyindex_scan_thread;
+    task->event.data = scan;
+    task->event.handler = ngx_http_fancyindex_scan_event_handler;
+
+    if (ngx_thread_task_post(scan->alcf->thread_pool, task) != NGX_OK)
+        return NGX_ERROR;
+
+    ctx->pending++;
+    return NGX_OK;
+}
+
+#endif /* NGX_THREADS */
+
+
+static ngx_int_t
+ngx_http_fancyindex_push_subdir(ngx_http_request_t *r,
+                                ngx_http_fancyindex_ctx_t *ctx,
+                                ngx_http_fancyindex_entry_t *entry,
+                                ngx_uint_t depth)
+{
+    ngx_http_fancyindex_subdir_t *dir;
+    u_char *p;
+
+    if ((dir = ngx_array_push(&ctx->frontier)) == NULL)
+        return NGX_ERROR;
+
+    /* 1 byte for '/' and 1 byte for terminating '\0' */
+    dir->allocated = ctx->path.len + 1 + entry->name.len + 1
+                   + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+    if ((dir->path.data = ngx_pnalloc(r->pool, dir->allocated)) == NULL)
+        return NGX_ERROR;
+
+    p = ngx_cpymem(dir->path.data, ctx->path.data, ctx->path.len);
+    if (p[-1] != '/') {
+        *p++ = '/';
+    }
+    p = ngx_cpymem_str(p, entry->name);
+    *p = '\0';
+    dir->path.len = p - dir->path.data;
+
+    dir->prefix.len = entry->name.len + 1;
+    if ((dir->prefix.data = ngx_pnalloc(r->pool, dir->prefix.len)) == NULL)
+        return NGX_ERROR;
+
+    p = ngx_cpymem_str(dir->prefix.data, entry->name);
+    *p = '/';
+
+    dir->depth = depth;
+    dir->nentries = 0;
+    return NGX_OK;
+}
+
+
+static ngx_int_t ngx_http_fancyindex_scan_level(ngx_http_request_t *r,
+    ngx_http_fancyindex_ctx_t *ctx);
+
+/*
+ * Collects the results of the tasks which scanned a level of the tree,
+ * and proceeds with the next one. This is done in the main thread, which
+ * is also where fancyindex_ignore is applied: regular expressions cannot
+ * be matched from other threads.
+ */
+static ngx_int_t
+ngx_http_fancyindex_merge_level(ngx_http_request_t *r,
+                                ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_entry_t    *entry, *e, *p;
+    ngx_http_fancyindex_subdir_t   *dir;
+    ngx_http_fancyindex_scan_t     *scan;
+    ngx_uint_t                      i, j, k;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    for (i = 0; i < ctx->nscans; i++) {
+        scan = &ctx->scans[i];
+        entry = scan->entries.elts;
+
+        if (scan->limit.truncated)
+            ctx->limit.truncated = 1;
+
+        for (dir = scan->dirs, k = 0; dir < scan->dirs + scan->ndirs; dir++) {
+            for (j = 0; j < dir->nentries; j++) {
+                e = &entry[k++];
+
+                if (ngx_http_fancyindex_ignored(alcf,
+                                                e->name.data + dir->prefix.len,
+                                                e->name.len - dir->prefix.len,
+                                                r->connection->log))
+                    continue;
+
+                if (ngx_http_fancyindex_limited(&ctx->limit, ctx->entries.nelts)) {
+                    ctx->frontier.nelts = 0;
+                    return NGX_OK;
+                }
+
+                if ((p = ngx_array_push(&ctx->entries)) == NULL)
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+                *p = *e;
+
+                if (e->dir && !e->link && dir->depth < ctx->depth &&
+                    ngx_http_fancyindex_push_subdir(r, ctx, e,
+                                                    dir->depth + 1) != NGX_OK)
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+        }
+    }
+
+    if (ctx->frontier.nelts &&
+        ngx_http_fancyindex_limited(&ctx->limit, ctx->entries.nelts))
+        ctx->frontier.nelts = 0;
+
+    return ngx_http_fancyindex_scan_level(r, ctx);
+}
+
+
+/*
+ * Scans the directories in the frontier, which are distributed among up
+ * to NGX_HTTP_FANCYINDEX_SCAN_TASKS tasks if a thread pool is configured,
+ * or all of them synchronously otherwise. Returns NGX_DONE if the scan
+ * continues in the thread pool, in which case the request is resumed by
+ * ngx_http_fancyindex_scan_resume() once all the tasks have finished.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_level(ngx_http_request_t *r,
+                               ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_subdir_t   *dirs;
+    ngx_http_fancyindex_scan_t     *scan;
+    ngx_pool_cleanup_t             *cln;
+    ngx_uint_t                      i, n, ndirs, per_task;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (ctx->frontier.nelts == 0)
+        return NGX_OK;
+
+    n = 1;
+#if (NGX_THREADS)
+    if (alcf->thread_pool)
+        n = ngx_min(ctx->frontier.nelts, NGX_HTTP_FANCYINDEX_SCAN_TASKS);
+#endif
+
+    dirs = ctx->frontier.elts;
+    ndirs = ctx->frontier.nelts;
+    per_task = (ndirs + n - 1) / n;
+    n = (ndirs + per_task - 1) / per_task;
+
+    /* Directories of the next level go into a new frontier. */
+    if (ngx_array_init(&ctx->frontier, r->pool, 8,
+                sizeof(ngx_http_fancyindex_subdir_t)) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ctx->nscans = n;
+    ctx->scans = ngx_pcalloc(r->pool, n * sizeof(ngx_http_fancyindex_scan_t));
+    if (ctx->scans == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    for (i = 0; i < n; i++) {
+        scan = &ctx->scans[i];
+        scan->request = r;
+        scan->alcf = alcf;
+        scan->flags = ctx->flags;
+        scan->limit = ctx->limit;
+        scan->dirs = dirs + i * per_task;
+        scan->ndirs = ngx_min(per_task, ndirs - i * per_task);
+
+        /* Tasks get their own pool, as pools are not thread-safe. */
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        scan->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log);
+        if (scan->pool == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        cln->handler = ngx_http_fancyindex_destroy_pool;
+        cln->data = scan->pool;
+
+        if (ngx_array_init(&scan->entries, scan->pool, 40,
+                    sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+#if (NGX_THREADS)
+    if (alcf->thread_pool) {
+        for (i = 0; i < n; i++) {
+            if (ngx_http_fancyindex_post_scan(r, ctx, &ctx->scans[i]) != NGX_OK) {
+                /* Do it the hard way if the task cannot be posted. */
+                ngx_http_fancyindex_scan_dirs(&ctx->scans[i], r->connection->log);
+            }
+        }
+
+        if (ctx->pending) {
+            r->main->blocked++;
+            r->aio = 1;
+            r->write_event_handler = ngx_http_fancyindex_scan_resume;
+            return NGX_DONE;
+        }
+
+        return ngx_http_fancyindex_merge_level(r, ctx);
+    }
+#endif
+
+    for (i = 0; i < n; i++) {
+        ngx_http_fancyindex_scan_dirs(&ctx->scans[i], r->connection->log);
+    }
+
+    return ngx_http_fancyindex_merge_level(r, ctx);
+}
+
+
+/*
+ * Recursive listings walk the tree one level at a time. The directory
+ * being listed is read first, as for regular listings, then its
+ * subdirectories are scanned by ngx_http_fancyindex_scan_level(), and so
+ * on until the requested depth is reached.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_tree(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_entry_t    *entry;
+    ngx_uint_t                      i;
+    ngx_int_t                       rc;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    rc = ngx_http_fancyindex_read_dir(r->pool, r->connection->log, alcf,
+                                      &ctx->path, ctx->allocated, NULL,
+                                      ctx->flags | NGX_HTTP_FANCYINDEX_SCAN_IGNORE,
+                                      &ctx->limit, &ctx->entries);
+    if (rc != NGX_OK || ctx->limit.truncated)
+        return rc;
+
+    if (ngx_array_init(&ctx->frontier, r->pool, 8,
+                sizeof(ngx_http_fancyindex_subdir_t)) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    entry = ctx->entries.elts;
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        if (entry[i].dir && !entry[i].link &&
+            ngx_http_fancyindex_push_subdir(r, ctx, &entry[i], 1) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    return ngx_http_fancyindex_scan_level(r, ctx);
+}
+
+
+/*
+ * Parses the "R" argument, which requests a recursive listing with the
+ * given depth, limited by fancyindex_max_depth.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_depth(ngx_http_request_t *r,
+                          ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_str_t value;
+    ngx_int_t depth;
+
+    if (alcf->max_depth == 0 ||
+        ngx_http_arg(r, (u_char *) "R", 1, &value) != NGX_OK)
+        return 0;
+
+    depth = ngx_atoi(value.data, value.len);
+    if (depth == NGX_ERROR)
+        return 0;
+
+    return ngx_min((ngx_uint_t) depth, alcf->max_depth);
+}
+
+
+static void
+ngx_http_fancyindex_checksum_insert_value(ngx_rbtree_node_t *temp,
+                                          ngx_rbtree_node_t *node,
+                                          ngx_rbtree_node_t *sentinel)
+{
+    ngx_http_fancyindex_checksum_node_t *cn, *cnt;
+    ngx_rbtree_node_t                  **p;
+
+    for ( ;; ) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+            cn = (ngx_http_fancyindex_checksum_node_t *) node;
+            cnt = (ngx_http_fancyindex_checksum_node_t *) temp;
+
+            p = (ngx_memcmp(&cn->key, &cnt->key,
+                            sizeof(ngx_http_fancyindex_checksum_key_t)) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel)
+            break;
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+#if (NGX_THREADS)
+
+/*
+ * Minimal SHA-256 (FIPS 180-4), used for the checksum column: Nginx does
+ * not provide one, and OpenSSL may not be available.
+ */
+typedef struct {
+    uint32_t  state[8];
+    uint64_t  bytes;
+    u_char    buffer[64];
+} ngx_http_fancyindex_sha256_t;
+
+
+static const uint32_t ngx_http_fancyindex_sha256_k[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5,
+    0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3,
+    0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc,
+    0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7,
+    0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13,
+    0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3,
+    0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5,
+    0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208,
+    0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2,
+};
+
+#define ngx_sha256_rotr(x, n)  (((x) >> (n)) | ((x) << (32 - (n))))
+
+
+static void
+ngx_http_fancyindex_sha256_block(ngx_http_fancyindex_sha256_t *ctx,
+                                 const u_char *p)
+{
+    uint32_t    w[64], s[8], t1, t2;
+    ngx_uint_t  i;
+
+    for (i = 0; i < 16; i++, p += 4) {
+        w[i] = ((uint32_t) p[0] << 24) | ((uint32_t) p[1] << 16)
+             | ((uint32_t) p[2] << 8) | (uint32_t) p[3];
+    }
+
+    for (i = 16; i < 64; i++) {
+        w[i] = w[i - 16] + w[i - 7]
+             + (ngx_sha256_rotr(w[i - 15], 7) ^ ngx_sha256_rotr(w[i - 15], 18)
+                ^ (w[i - 15] >> 3))
+             + (ngx_sha256_rotr(w[i - 2], 17) ^ ngx_sha256_rotr(w[i - 2], 19)
+                ^ (w[i - 2] >> 10));
+    }
+
+    for (i = 0; i < 8; i++) {
+        s[i] = ctx->state[i];
+    }
+
+    for (i = 0; i < 64; i++) {
+        t1 = s[7] + ngx_http_fancyindex_sha256_k[i] + w[i]
+           + (ngx_sha256_rotr(s[4], 6) ^ ngx_sha256_rotr(s[4], 11)
+              ^ ngx_sha256_rotr(s[4], 25))
+           + ((s[4] & s[5]) ^ (~s[4] & s[6]));
+        t2 = (ngx_sha256_rotr(s[0], 2) ^ ngx_sha256_rotr(s[0], 13)
+              ^ ngx_sha256_rotr(s[0], 22))
+           + ((s[0] & s[1]) ^ (s[0] & s[2]) ^ (s[1] & s[2]));
+
+        s[7] = s[6];
+        s[6] = s[5];
+        s[5] = s[4];
+        s[4] = s[3] + t1;
+        s[3] = s[2];
+        s[2] = s[1];
+        s[1] = s[0];
+        s[0] = t1 + t2;
+    }
+
+    for (i = 0; i < 8; i++) {
+        ctx->state[i] += s[i];
+    }
+}
+
+
+static void
+ngx_http_fancyindex_sha256_init(ngx_http_fancyindex_sha256_t *ctx)
+{
+    ctx->state[0] = 0x6a09e667;
+    ctx->state[1] = 0xbb67ae85;
+    ctx->state[2] = 0x3c6ef372;
+    ctx->state[3] = 0xa54ff53a;
+    ctx->state[4] = 0x510e527f;
+    ctx->state[5] = 0x9b05688c;
+    ctx->state[6] = 0x1f83d9ab;
+    ctx->state[7] = 0x5be0cd19;
+    ctx->bytes = 0;
+}
+
+
+static void
+ngx_http_fancyindex_sha256_update(ngx_http_fancyindex_sha256_t *ctx,
+                                  const u_char *data, size_t size)
+{
+    size_t  used, fill;
+
+    used = (size_t) (ctx->bytes & 0x3f);
+    ctx->bytes += size;
+
+    if (used) {
+        fill = 64 - used;
+
+        if (size < fill) {
+            ngx_memcpy(&ctx->buffer[used], data, size);
+            return;
+        }
+
+        ngx_memcpy(&ctx->buffer[used], data, fill);
+        ngx_http_fancyindex_sha256_block(ctx, ctx->buffer);
+        data += fill;
+        size -= fill;
+    }
+
+    for ( /* void */ ; size >= 64; data += 64, size -= 64) {
+        ngx_http_fancyindex_sha256_block(ctx, data);
+    }
+
+    ngx_memcpy(ctx->buffer, data, size);
+}
+
+
+static void
+ngx_http_fancyindex_sha256_final(u_char *result,
+                                 ngx_http_fancyindex_sha256_t *ctx)
+{
+    size_t      used;
+    uint64_t    bits;
+    ngx_uint_t  i;
+
+    used = (size_t) (ctx->bytes & 0x3f);
+    ctx->buffer[used++] = 0x80;
+
+    if (used > 56) {
+        ngx_memzero(&ctx->buffer[used], 64 - used);
+        ngx_http_fancyindex_sha256_block(ctx, ctx->buffer);
+        used = 0;
+    }
+
+    ngx_memzero(&ctx->buffer[used], 56 - used);
+
+    bits = ctx->bytes << 3;
+    for (i = 0; i < 8; i++) {
+        ctx->buffer[63 - i] = (u_char) (bits >> (8 * i));
+    }
+
+    ngx_http_fancyindex_sha256_block(ctx, ctx->buffer);
+
+    for (i = 0; i < 8; i++) {
+        result[4 * i]     = (u_char) (ctx->state[i] >> 24);
+        result[4 * i + 1] = (u_char) (ctx->state[i] >> 16);
+        result[4 * i + 2] = (u_char) (ctx->state[i] >> 8);
+        result[4 * i + 3] = (u_char) ctx->state[i];
+    }
+}
+
+
+static ngx_http_fancyindex_checksum_node_t *
+ngx_http_fancyindex_checksum_lookup(ngx_http_fancyindex_checksum_ctx_t *zctx,
+                                    ngx_http_fancyindex_checksum_key_t *key,
+                                    uint32_t hash)
+{
+    ngx_http_fancyindex_checksum_node_t *cn;
+    ngx_rbtree_node_t                   *node, *sentinel;
+    ngx_int_t                            rc;
+
+    node = zctx->sh->rbtree.root;
+    sentinel = zctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_http_fancyindex_checksum_node_t *) node;
+
+        rc = ngx_memcmp(key, &cn->key, sizeof(ngx_http_fancyindex_checksum_key_t));
+        if (rc == 0)
+            return cn;
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_fancyindex_checksum_delete(ngx_http_fancyindex_checksum_ctx_t *zctx,
+                                    ngx_http_fancyindex_checksum_node_t *cn)
+{
+    ngx_rbtree_delete(&zctx->sh->rbtree, &cn->node);
+    ngx_queue_remove(&cn->queue);
+    ngx_slab_free_locked(zctx->shpool, cn);
+}
+
+
+/*
+ * Allocates a node from the zone, which must be locked, evicting the least
+ * recently used ones if needed.
+ */
+static ngx_http_fancyindex_checksum_node_t *
+ngx_http_fancyindex_checksum_alloc(ngx_http_fancyindex_checksum_ctx_t *zctx)
+{
+    ngx_http_fancyindex_checksum_node_t *cn;
+    ngx_queue_t                         *q;
+    ngx_uint_t                           n;
+
+    cn = ngx_slab_alloc_locked(zctx->shpool,
+                               sizeof(ngx_http_fancyindex_checksum_node_t));
+    if (cn)
+        return cn;
+
+    for (n = 0; n < 16 && !ngx_queue_empty(&zctx->sh->queue); n++) {
+        q = ngx_queue_last(&zctx->sh->queue);
+        ngx_http_fancyindex_checksum_delete(zctx,
+            ngx_queue_data(q, ngx_http_fancyindex_checksum_node_t, queue));
+    }
+
+    return ngx_slab_alloc_locked(zctx->shpool,
+                                 sizeof(ngx_http_fancyindex_checksum_node_t));
+}
+
+
+typedef struct {
+    ngx_http_fancyindex_checksum_ctx_t *zctx;
+    ngx_http_fancyindex_checksum_key_t  key;
+    ngx_flag_t                          xattr;
+    ngx_int_t                           rc;
+    u_char                              digest[NGX_HTTP_FANCYINDEX_SHA256_LEN];
+    u_char                              path[1];
+} ngx_http_fancyindex_checksum_job_t;
+
+
+static void
+ngx_http_fancyindex_checksum_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_checksum_job_t  *job = data;
+    ngx_http_fancyindex_sha256_t         sha256;
+    ngx_file_info_t                      fi;
+    ngx_fd_t                             fd;
+    u_char                              *buf;
+    ssize_t                              n;
+#if (NGX_LINUX)
+    ngx_http_fancyindex_checksum_xattr_t xa;
+
+    if (job->xattr
+        && getxattr((const char *) job->path, NGX_HTTP_FANCYINDEX_CHECKSUM_XATTR,
+                    &xa, sizeof(xa)) == (ssize_t) sizeof(xa)
+        && xa.size == job->key.size
+        && xa.mtime == job->key.mtime)
+    {
+        ngx_memcpy(job->digest, xa.digest, NGX_HTTP_FANCYINDEX_SHA256_LEN);
+        job->rc = NGX_OK;
+        return;
+    }
+#endif /* NGX_LINUX */
+
+    job->rc = NGX_ERROR;
+
+    fd = ngx_open_file(job->path, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", job->path);
+        return;
+    }
+
+    if ((buf = ngx_alloc(NGX_HTTP_FANCYINDEX_CHECKSUM_BUFSIZE, log)) == NULL)
+        goto done;
+
+    ngx_http_fancyindex_sha256_init(&sha256);
+
+    while ((n = ngx_read_fd(fd, buf, NGX_HTTP_FANCYINDEX_CHECKSUM_BUFSIZE)) > 0) {
+        ngx_http_fancyindex_sha256_update(&sha256, buf, n);
+    }
+
+    ngx_free(buf);
+
+    if (n == -1) {
+        ngx_log_error(NGX_LOG_ERR, log, ngx_errno,
+                      ngx_read_fd_n " \"%s\" failed", job->path);
+        goto done;
+    }
+
+    /* Discard the digest if the file was modified while reading it. */
+    if (ngx_fd_info(fd, &fi) == NGX_FILE_ERROR
+        || (uint64_t) ngx_file_uniq(&fi) != job->key.uniq
+        || (int64_t) ngx_file_size(&fi) != job->key.size
+        || (int64_t) ngx_file_mtime(&fi) != job->key.mtime)
+        goto done;
+
+    ngx_http_fancyindex_sha256_final(job->digest, &sha256);
+    job->rc = NGX_OK;
+
+#if (NGX_LINUX)
+    if (job->xattr) {
+        xa.size = job->key.size;
+        xa.mtime = job->key.mtime;
+        ngx_memcpy(xa.digest, job->digest, NGX_HTTP_FANCYINDEX_SHA256_LEN);
+
+        if (fsetxattr(fd, NGX_HTTP_FANCYINDEX_CHECKSUM_XATTR,
+                      &xa, sizeof(xa), 0) == -1)
+        {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, log, ngx_errno,
+                           "http fancyindex: fsetxattr \"%s\" failed",
+                           job->path);
+        }
+    }
+#endif /* NGX_LINUX */
+
+done:
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", job->path);
+    }
+}
+
+
+static void
+ngx_http_fancyindex_checksum_event_handler(ngx_event_t *ev)
+{
+    ngx_thread_task_t                   *task = ev->data;
+    ngx_http_fancyindex_checksum_job_t  *job = task->ctx;
+    ngx_http_fancyindex_checksum_ctx_t  *zctx = job->zctx;
+    ngx_http_fancyindex_checksum_node_t *cn;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    cn = ngx_http_fancyindex_checksum_lookup(zctx, &job->key,
+            ngx_crc32_short((u_char *) &job->key,
+                            sizeof(ngx_http_fancyindex_checksum_key_t)));
+
+    if (cn && !cn->done) {
+        if (job->rc == NGX_OK) {
+            ngx_memcpy(cn->digest, job->digest, NGX_HTTP_FANCYINDEX_SHA256_LEN);
+            cn->done = 1;
+        } else {
+            /* Let the next listing try again. */
+            ngx_http_fancyindex_checksum_delete(zctx, cn);
+        }
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    ngx_free(task);
+}
+
+
+/*
+ * Posts a task which computes the digest of an entry. Tasks are not tied
+ * to the request, which may well be finished by the time they complete.
+ */
+static ngx_int_t
+ngx_http_fancyindex_checksum_post(ngx_http_request_t *r,
+                                  ngx_http_fancyindex_ctx_t *ctx,
+                                  ngx_http_fancyindex_loc_conf_t *alcf,
+                                  ngx_http_fancyindex_checksum_key_t *key,
+                                  ngx_http_fancyindex_entry_t *entry)
+{
+    ngx_http_fancyindex_checksum_job_t *job;
+    ngx_thread_task_t                  *task;
+    u_char                             *p;
+
+    task = ngx_calloc(sizeof(ngx_thread_task_t)
+                      + sizeof(ngx_http_fancyindex_checksum_job_t)
+                      + ctx->path.len + 1 + entry->name.len,
+                      r->connection->log);
+    if (task == NULL)
+        return NGX_ERROR;
+
+    job = (ngx_http_fancyindex_checksum_job_t *) (task + 1);
+    job->zctx = alcf->checksum_zone->data;
+    job->key = *key;
+    job->xattr = alcf->checksum_xattr;
+
+    p = ngx_cpymem_str(job->path, ctx->path);
+    if (p[-1] != '/') {
+        *p++ = '/';
+    }
+    p = ngx_cpymem_str(p, entry->name);
+    *p = '\0';
+
+    task->ctx = job;
+    task->handler = ngx_http_fancyindex_checksum_thread;
+    task->event.data = task;
+    task->event.handler = ngx_http_fancyindex_checksum_event_handler;
+
+    if (ngx_thread_task_post(alcf->thread_pool, task) != NGX_OK) {
+        ngx_free(task);
+        return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Sets the digests of the entries which are known, and requests the
+ * computation of some of the missing ones, without ever waiting for them.
+ */
+static ngx_int_t
+ngx_http_fancyindex_checksums(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_http_fancyindex_loc_conf_t *alcf,
+                              ngx_array_t *entries)
+{
+    ngx_http_fancyindex_checksum_ctx_t  *zctx = alcf->checksum_zone->data;
+    ngx_http_fancyindex_entry_t         *entry = entries->elts;
+    ngx_http_fancyindex_checksum_node_t *cn;
+    ngx_http_fancyindex_checksum_key_t   key;
+    ngx_uint_t                           i, posted;
+    ngx_int_t                            rc;
+    uint32_t                             hash;
+    time_t                               now;
+
+    now = ngx_time();
+    posted = 0;
+    rc = NGX_OK;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    for (i = 0; i < entries->nelts; i++) {
+        if (entry[i].dir)
+            continue;
+
+        key.uniq = (uint64_t) entry[i].uniq;
+        key.size = (int64_t) entry[i].size;
+        key.mtime = (int64_t) entry[i].mtime;
+        hash = ngx_crc32_short((u_char *) &key, sizeof(key));
+
+        cn = ngx_http_fancyindex_checksum_lookup(zctx, &key, hash);
+
+        if (cn && cn->done) {
+            entry[i].checksum = ngx_pnalloc(r->pool, NGX_HTTP_FANCYINDEX_SHA256_LEN);
+            if (entry[i].checksum == NULL) {
+                rc = NGX_ERROR;
+                break;
+            }
+            ngx_memcpy(entry[i].checksum, cn->digest, NGX_HTTP_FANCYINDEX_SHA256_LEN);
+
+            ngx_queue_remove(&cn->queue);
+            ngx_queue_insert_head(&zctx->sh->queue, &cn->queue);
+            continue;
+        }
+
+        if (posted == NGX_HTTP_FANCYINDEX_CHECKSUM_TASKS ||
+            (cn && now - cn->queued < NGX_HTTP_FANCYINDEX_CHECKSUM_TIMEOUT))
+            continue;
+
+        if (cn == NULL) {
+            if ((cn = ngx_http_fancyindex_checksum_alloc(zctx)) == NULL)
+                continue;
+
+            cn->node.key = hash;
+            cn->key = key;
+            cn->done = 0;
+            ngx_rbtree_insert(&zctx->sh->rbtree, &cn->node);
+            ngx_queue_insert_head(&zctx->sh->queue, &cn->queue);
+        }
+
+        cn->queued = now;
+
+        if (ngx_http_fancyindex_checksum_post(r, ctx, alcf, &key, &entry[i]) != NGX_OK) {
+            ngx_http_fancyindex_checksum_delete(zctx, cn);
+            continue;
+        }
+
+        posted++;
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    return rc;
+}
+
+#endif /* NGX_THREADS */
+
+
+static void
+ngx_http_fancyindex_cache_insert_value(ngx_rbtree_node_t *temp,
+                                       ngx_rbtree_node_t *node,
+                                       ngx_rbtree_node_t *sentinel)
+{
+    ngx_http_fancyindex_cache_node_t *cn, *cnt;
+    ngx_rbtree_node_t               **p;
+
+    for ( ;; ) {
+        if (node->key < temp->key) {
+            p = &temp->left;
+
+        } else if (node->key > temp->key) {
+            p = &temp->right;
+
+        } else { /* node->key == temp->key */
+            cn = (ngx_http_fancyindex_cache_node_t *) node;
+            cnt = (ngx_http_fancyindex_cache_node_t *) temp;
+
+            p = (ngx_memcmp(cn->key, cnt->key, 16) < 0)
+                ? &temp->left : &temp->right;
+        }
+
+        if (*p == sentinel)
+            break;
+
+        temp = *p;
+    }
+
+    *p = node;
+    node->parent = temp;
+    node->left = sentinel;
+    node->right = sentinel;
+    ngx_rbt_red(node);
+}
+
+
+static ngx_http_fancyindex_cache_node_t *
+ngx_http_fancyindex_cache_lookup(ngx_http_fancyindex_cache_ctx_t *zctx,
+                                 u_char *key)
+{
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_rbtree_node_t                *node, *sentinel;
+    ngx_rbtree_key_t                  hash;
+    ngx_int_t                         rc;
+
+    ngx_memcpy(&hash, key, sizeof(ngx_rbtree_key_t));
+
+    node = zctx->sh->rbtree.root;
+    sentinel = zctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (hash < node->key) {
+            node = node->left;
+            continue;
+        }
+
+        if (hash > node->key) {
+            node = node->right;
+            continue;
+        }
+
+        /* hash == node->key */
+
+        cn = (ngx_http_fancyindex_cache_node_t *) node;
+
+        rc = ngx_memcmp(key, cn->key, 16);
+        if (rc == 0)
+            return cn;
+
+        node = (rc < 0) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Name of the file which keeps a listing with the given key. The buffer
+ * must be NGX_MAX_PATH bytes long, which is checked at configuration time.
+ */
+static void
+ngx_http_fancyindex_cache_file(ngx_http_fancyindex_cache_ctx_t *zctx,
+                               u_char *key, u_char *name)
+{
+    ngx_path_t *path = zctx->path;
+    u_char     *p;
+
+    p = ngx_cpymem(name, path->name.data, path->name.len) + 1 + path->len;
+    p = ngx_hex_dump(p, key, 16);
+    *p = '\0';
+
+    ngx_create_hashed_filename(path, name, p - name);
+}
+
+
+static void
+ngx_http_fancyindex_cache_unlink(ngx_http_fancyindex_cache_ctx_t *zctx,
+                                 ngx_http_fancyindex_cache_node_t *cn)
+{
+    u_char name[NGX_MAX_PATH];
+
+    zctx->sh->size -= cn->len;
+
+    ngx_http_fancyindex_cache_file(zctx, cn->key, name);
+
+    if (ngx_delete_file(name) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", name);
+    }
+}
+
+
+static void
+ngx_http_fancyindex_cache_delete(ngx_http_fancyindex_cache_ctx_t *zctx,
+                                 ngx_http_fancyindex_cache_node_t *cn)
+{
+    ngx_rbtree_delete(&zctx->sh->rbtree, &cn->node);
+    ngx_queue_remove(&cn->queue);
+
+    if (cn->stored && cn->body == NULL && zctx->path)
+        ngx_http_fancyindex_cache_unlink(zctx, cn);
+    if (cn->body)
+        ngx_slab_free_locked(zctx->shpool, cn->body);
+    if (cn->rows)
+        ngx_slab_free_locked(zctx->shpool, cn->rows);
+
+    ngx_slab_free_locked(zctx->shpool, cn);
+}
+
+
+/*
+ * Allocates memory from the zone, which must be locked, removing the least
+ * recently used listings until there is enough.
+ */
+static void *
+ngx_http_fancyindex_cache_alloc(ngx_http_fancyindex_cache_ctx_t *zctx,
+                                size_t size)
+{
+    ngx_queue_t *q;
+    void        *p;
+
+    while ((p = ngx_slab_alloc_locked(zctx->shpool, size)) == NULL) {
+        if (ngx_queue_empty(&zctx->sh->queue))
+            return NULL;
+
+        q = ngx_queue_last(&zctx->sh->queue);
+        ngx_http_fancyindex_cache_delete(zctx,
+            ngx_queue_data(q, ngx_http_fancyindex_cache_node_t, queue));
+    }
+
+    return p;
+}
+
+
+static ngx_http_fancyindex_cache_node_t *
+ngx_http_fancyindex_cache_node(ngx_http_fancyindex_cache_ctx_t *zctx,
+                               u_char *key, ngx_str_t *uri)
+{
+    ngx_http_fancyindex_cache_node_t *cn;
+
+    cn = ngx_http_fancyindex_cache_alloc(zctx,
+            offsetof(ngx_http_fancyindex_cache_node_t, uri) + uri->len);
+    if (cn == NULL)
+        return NULL;
+
+    ngx_memzero(cn, offsetof(ngx_http_fancyindex_cache_node_t, uri));
+    ngx_memcpy(cn->key, key, 16);
+    ngx_memcpy(cn->uri, uri->data, uri->len);
+    cn->uri_len = uri->len;
+    ngx_memcpy(&cn->node.key, key, sizeof(ngx_rbtree_key_t));
+
+    ngx_rbtree_insert(&zctx->sh->rbtree, &cn->node);
+    ngx_queue_insert_head(&zctx->sh->queue, &cn->queue);
+
+    return cn;
+}
+
+
+/*
+ * Releases the node if the listing could not be rendered, so other
+ * requests do not keep waiting for it.
+ */
+static void
+ngx_http_fancyindex_cache_unlock(void *data)
+{
+    ngx_http_request_t               *r = data;
+    ngx_http_fancyindex_loc_conf_t   *alcf;
+    ngx_http_fancyindex_cache_ctx_t  *zctx;
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_http_fancyindex_ctx_t        *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx->cache_wait.timer_set)
+        ngx_del_timer(&ctx->cache_wait);
+
+    if (!ctx->cache_locked)
+        return;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    zctx = alcf->cache_zone->data;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(zctx, ctx->cache_key);
+    if (cn)
+        cn->updating = 0;
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    ctx->cache_locked = 0;
+}
+
+
+/*
+ * Opens the file of a listing, with the zone locked so it is not replaced
+ * meanwhile. Returns NGX_INVALID_FILE if it is gone.
+ */
+static ngx_fd_t
+ngx_http_fancyindex_cache_open(ngx_http_fancyindex_cache_ctx_t *zctx,
+                               ngx_http_fancyindex_cache_node_t *cn,
+                               u_char *name)
+{
+    ngx_fd_t fd;
+
+    if (zctx->path == NULL)
+        return NGX_INVALID_FILE;
+
+    ngx_http_fancyindex_cache_file(zctx, cn->key, name);
+
+    fd = ngx_open_file(name, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (fd == NGX_INVALID_FILE && ngx_errno != NGX_ENOENT) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", name);
+    }
+
+    return fd;
+}
+
+
+/*
+ * Copies a listing out of the zone, which must be locked, or makes a
+ * buffer for the file it is kept in. Returns NGX_DECLINED, removing the
+ * node, if the file is gone.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_copy(ngx_http_request_t *r,
+                               ngx_http_fancyindex_cache_ctx_t *zctx,
+                               ngx_http_fancyindex_cache_node_t *cn,
+                               ngx_buf_t **pb)
+{
+    ngx_pool_cleanup_file_t *clnf;
+    ngx_pool_cleanup_t      *cln;
+    ngx_buf_t               *b;
+    ngx_fd_t                 fd;
+    u_char                   name[NGX_MAX_PATH];
+
+    *pb = NULL;
+
+    if (cn->body) {
+        if ((b = ngx_create_temp_buf(r->pool, cn->len)) == NULL)
+            return NGX_ERROR;
+
+        b->last = ngx_cpymem(b->last, cn->body, cn->len);
+
+    } else {
+        cln = ngx_pool_cleanup_add(r->pool, sizeof(ngx_pool_cleanup_file_t));
+        b = ngx_calloc_buf(r->pool);
+        if (cln == NULL || b == NULL)
+            return NGX_ERROR;
+
+        b->file = ngx_pcalloc(r->pool, sizeof(ngx_file_t));
+        if (b->file == NULL)
+            return NGX_ERROR;
+
+        fd = ngx_http_fancyindex_cache_open(zctx, cn, name);
+        if (fd == NGX_INVALID_FILE) {
+            ngx_http_fancyindex_cache_delete(zctx, cn);
+            return NGX_DECLINED;
+        }
+
+        b->file->name.len = ngx_strlen(name);
+        b->file->name.data = ngx_pnalloc(r->pool, b->file->name.len + 1);
+        if (b->file->name.data == NULL) {
+            ngx_close_file(fd);
+            return NGX_ERROR;
+        }
+        ngx_memcpy(b->file->name.data, name, b->file->name.len + 1);
+
+        clnf = cln->data;
+        clnf->fd = fd;
+        clnf->name = b->file->name.data;
+        clnf->log = r->connection->log;
+        cln->handler = ngx_pool_cleanup_file;
+
+        b->in_file = 1;
+        b->file_pos = ngx_http_fancyindex_cache_body(cn->uri_len);
+        b->file_last = b->file_pos + cn->len;
+        b->file->fd = fd;
+        b->file->log = r->connection->log;
+    }
+
+    ngx_queue_remove(&cn->queue);
+    ngx_queue_insert_head(&zctx->sh->queue, &cn->queue);
+
+    *pb = b;
+    return NGX_OK;
+}
+
+
+/*
+ * Keys do not depend on the configuration other than through the settings
+ * which affect the listing, so they stay the same after reloads and
+ * restarts, and listings kept in files can be used again.
+ */
+static void
+ngx_http_fancyindex_cache_key(u_char *key,
+                              ngx_http_fancyindex_loc_conf_t *alcf,
+                              ngx_uint_t criterion, ngx_uint_t flags,
+                              ngx_str_t *path, ngx_str_t *uri)
+{
+    ngx_md5_t md5;
+
+    ngx_md5_init(&md5);
+    ngx_md5_update(&md5, &alcf->cache_settings, sizeof(uint32_t));
+    ngx_md5_update(&md5, &criterion, sizeof(ngx_uint_t));
+    ngx_md5_update(&md5, &flags, sizeof(ngx_uint_t));
+    ngx_md5_update(&md5, path->data, path->len + 1);
+    ngx_md5_update(&md5, uri->data, uri->len);
+    ngx_md5_final(key, &md5);
+}
+
+
+/*
+ * Copies the rows of the listing which is going to be replaced, if they
+ * were kept, to reuse them with ngx_http_fancyindex_render(). Returns NULL
+ * if fancyindex_cache_patch is off or memory is short.
+ */
+static ngx_http_fancyindex_patch_t *
+ngx_http_fancyindex_cache_base(ngx_pool_t *pool,
+                               ngx_http_fancyindex_loc_conf_t *alcf,
+                               u_char *key)
+{
+    ngx_http_fancyindex_cache_ctx_t  *zctx = alcf->cache_zone->data;
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_http_fancyindex_patch_t      *patch;
+    ngx_time_t                       *tp;
+    ngx_file_t                        file;
+    size_t                            size, len;
+    ssize_t                           n;
+    off_t                             offset;
+    u_char                            name[NGX_MAX_PATH];
+
+    if (!alcf->cache_patch)
+        return NULL;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.fd = NGX_INVALID_FILE;
+    file.log = pool->log;
+    len = 0;
+    offset = 0;
+
+    if ((patch = ngx_pcalloc(pool, sizeof(ngx_http_fancyindex_patch_t))) == NULL)
+        return NULL;
+
+    tp = ngx_timeofday();
+    patch->gmtoff = tp->gmtoff;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(zctx, key);
+
+    if (cn && cn->stored && cn->rows
+        && (!alcf->localtime || cn->gmtoff == patch->gmtoff))
+    {
+        size = cn->nrows * sizeof(ngx_http_fancyindex_cache_row_t);
+
+        patch->base = ngx_palloc(pool, size);
+        patch->body = ngx_pnalloc(pool, cn->len);
+
+        if (cn->body == NULL)
+            file.fd = ngx_http_fancyindex_cache_open(zctx, cn, name);
+
+        if (patch->base && patch->body
+            && (cn->body || file.fd != NGX_INVALID_FILE))
+        {
+            ngx_memcpy(patch->base, cn->rows, size);
+            if (cn->body)
+                ngx_memcpy(patch->body, cn->body, cn->len);
+            patch->nbase = cn->nrows;
+            len = cn->len;
+            offset = ngx_http_fancyindex_cache_body(cn->uri_len);
+        }
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    if (file.fd == NGX_INVALID_FILE)
+        return patch;
+
+    /* The file descriptor keeps the listing even if it is replaced now. */
+    if (patch->nbase) {
+        file.name.data = name;
+        file.name.len = ngx_strlen(name);
+
+        n = ngx_read_file(&file, patch->body, len, offset);
+        if (n != (ssize_t) len)
+            patch->nbase = 0;
+    }
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, pool->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", name);
+    }
+
+    return patch;
+}
+
+
+/*
+ * Looks up the rendered listing. Returns NGX_OK with the listing copied
+ * into *pb, NGX_DONE if the request has to wait for another one which is
+ * rendering it, or NGX_DECLINED if the directory has to be scanned.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_get(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_http_fancyindex_loc_conf_t *alcf,
+                              ngx_buf_t **pb)
+{
+    ngx_http_fancyindex_cache_ctx_t  *zctx = alcf->cache_zone->data;
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_pool_cleanup_t               *cln;
+    ngx_uint_t                        criterion, refresh;
+    const char                       *sort_url_args;
+    ngx_int_t                         rc;
+    time_t                            now;
+
+    if (ctx->cache_start == 0) {
+        criterion = ngx_http_fancyindex_sort_criterion(r, alcf, &sort_url_args);
+
+        ngx_http_fancyindex_cache_key(ctx->cache_key, alcf, criterion,
+                                      ctx->flags, &ctx->path, &r->uri);
+
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        cln->handler = ngx_http_fancyindex_cache_unlock;
+        cln->data = r;
+
+        ctx->cache_start = ngx_current_msec;
+    }
+
+    /*
+     * Watched listings are replaced as soon as the directory changes, by
+     * the worker processes of the configuration which saved them.
+     */
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(zctx, ctx->cache_key);
+
+    if (cn && cn->stored && cn->watched && cn->generation == zctx->generation
+        && (rc = ngx_http_fancyindex_cache_copy(r, zctx, cn, pb)) != NGX_DECLINED)
+    {
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: cache hit \"%V\", watched", &ctx->path);
+        return (rc == NGX_OK) ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    if (ngx_http_fancyindex_dir_info(r, ctx) != NGX_OK)
+        return NGX_DECLINED;
+
+    now = ngx_time();
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    cn = ngx_http_fancyindex_cache_lookup(zctx, ctx->cache_key);
+
+    if (cn
+        && cn->stored
+        && cn->uniq == (uint64_t) ctx->uniq
+        && cn->mtime == ctx->mtime
+        && now - cn->created < alcf->cache_valid)
+    {
+        rc = ngx_http_fancyindex_cache_copy(r, zctx, cn, pb);
+
+        if (rc != NGX_DECLINED) {
+            ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http fancyindex: cache hit \"%V\"", &ctx->path);
+            return (rc == NGX_OK) ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        /* The file is gone, and so is the node. */
+        cn = NULL;
+    }
+
+    if (cn
+        && cn->stored
+        && alcf->cache_use_stale
+        && now - cn->created < alcf->cache_max_stale)
+    {
+        rc = ngx_http_fancyindex_cache_copy(r, zctx, cn, pb);
+
+        if (rc != NGX_DECLINED) {
+            refresh = !(cn->updating && cn->lock > now);
+
+            if (refresh) {
+                cn->updating = 1;
+                cn->lock = now + (time_t) (alcf->cache_lock_timeout / 1000) + 1;
+            }
+
+            ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+            ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http fancyindex: cache stale \"%V\"%s", &ctx->path,
+                           refresh ? ", refreshing" : "");
+
+            if (refresh
+                && ngx_http_fancyindex_cache_refresh(r, ctx, alcf) != NGX_OK)
+            {
+                ngx_shmtx_lock(&zctx->shpool->mutex);
+                if ((cn = ngx_http_fancyindex_cache_lookup(zctx, ctx->cache_key)))
+                    cn->updating = 0;
+                ngx_shmtx_unlock(&zctx->shpool->mutex);
+            }
+
+            return (rc == NGX_OK) ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        cn = NULL;
+    }
+
+    ctx->cache_store = 1;
+
+    if (cn && cn->updating && cn->lock > now) {
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+        if (!alcf->cache_lock
+            || ngx_current_msec - ctx->cache_start >= alcf->cache_lock_timeout)
+            return NGX_DECLINED;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                       "http fancyindex: cache lock wait \"%V\"", &ctx->path);
+
+        ctx->cache_wait.handler = ngx_http_fancyindex_cache_wait_handler;
+        ctx->cache_wait.data = r;
+        ctx->cache_wait.log = r->connection->log;
+        ngx_add_timer(&ctx->cache_wait, NGX_HTTP_FANCYINDEX_CACHE_LOCK_POLL);
+        return NGX_DONE;
+    }
+
+    if (cn == NULL)
+        cn = ngx_http_fancyindex_cache_node(zctx, ctx->cache_key, &r->uri);
+
+    if (cn) {
+        cn->updating = 1;
+        cn->lock = now + (time_t) (alcf->cache_lock_timeout / 1000) + 1;
+        ctx->cache_locked = 1;
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    return NGX_DECLINED;
+}
+
+
+/*
+ * Writes a listing to a temporary file, after the header "h" and the URI,
+ * creating the directories of the levels if needed.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_write(u_char *temp,
+                                ngx_http_fancyindex_cache_header_t *h,
+                                ngx_str_t *uri, ngx_buf_t *b)
+{
+    ngx_fd_t   fd;
+    ngx_err_t  err;
+    ngx_str_t  part[4];
+    ngx_uint_t i;
+    ssize_t    n;
+    u_char    *p, *last;
+    u_char     padding[8];
+
+    fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                       NGX_FILE_DEFAULT_ACCESS);
+
+    if (fd == NGX_INVALID_FILE && ngx_errno == NGX_ENOENT) {
+        err = ngx_create_full_path(temp, 0700);
+        if (err) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, err,
+                          ngx_create_dir_n " \"%s\" failed", temp);
+            return NGX_ERROR;
+        }
+
+        fd = ngx_open_file(temp, NGX_FILE_WRONLY, NGX_FILE_TRUNCATE,
+                           NGX_FILE_DEFAULT_ACCESS);
+    }
+
+    if (fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_open_file_n " \"%s\" failed", temp);
+        return NGX_ERROR;
+    }
+
+    ngx_memzero(padding, sizeof(padding));
+
+    part[0].data = (u_char *) h;
+    part[0].len = sizeof(ngx_http_fancyindex_cache_header_t);
+    part[1] = *uri;
+    part[2].data = padding;
+    part[2].len = ngx_align(uri->len, 8) - uri->len;
+    part[3].data = b->pos;
+    part[3].len = b->last - b->pos;
+
+    for (i = 0; i < DIM(part); i++) {
+        last = part[i].data + part[i].len;
+
+        for (p = part[i].data; p < last; p += n) {
+            n = ngx_write_fd(fd, p, last - p);
+            if (n == -1) {
+                ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                              ngx_write_fd_n " \"%s\" failed", temp);
+                goto done;
+            }
+        }
+    }
+
+done:
+
+    if (ngx_close_file(fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", temp);
+    }
+
+    return (i == DIM(part)) ? NGX_OK : NGX_ERROR;
+}
+
+
+/*
+ * Saves a listing rendered with the settings of a location. Failing to do
+ * so is not an error, the next request will try again. If "unlock" is set
+ * the node was marked as updating by the caller, which is cleared.
+ * Listings saved as "watched" are used without checking the directory.
+ * The rows of a "patch" are kept too, if there is room for them.
+ */
+static void
+ngx_http_fancyindex_cache_save(ngx_http_fancyindex_loc_conf_t *alcf,
+                               u_char *key, ngx_str_t *uri,
+                               uint64_t uniq, time_t mtime,
+                               ngx_buf_t *b, ngx_flag_t unlock,
+                               ngx_flag_t watched,
+                               ngx_http_fancyindex_patch_t *patch)
+{
+    ngx_http_fancyindex_cache_ctx_t   *zctx = alcf->cache_zone->data;
+    ngx_http_fancyindex_cache_node_t  *cn;
+    ngx_http_fancyindex_cache_row_t   *rows;
+    ngx_http_fancyindex_cache_header_t h;
+    ngx_flag_t                         stored, written;
+    time_t                             now;
+    size_t                             len;
+    u_char                            *body;
+    u_char                             name[NGX_MAX_PATH];
+    u_char                             temp[NGX_MAX_PATH + 1 + NGX_INT64_LEN];
+
+    len = b->last - b->pos;
+    now = ngx_time();
+
+    if (patch) {
+        ngx_log_debug3(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                       "http fancyindex: cache patch, %ui of %ui rows "
+                       "reused, %ui rendered", patch->reused, patch->nrows,
+                       patch->nrows - patch->reused);
+    }
+
+    /* Row offsets are 32-bit. */
+    if (patch && len > NGX_MAX_UINT32_VALUE)
+        patch = NULL;
+
+    body = NULL;
+    written = 0;
+
+    /* The file is written outside of the lock, and renamed with it held. */
+    if (zctx->path) {
+        ngx_http_fancyindex_cache_file(zctx, key, name);
+        ngx_sprintf(temp, "%s.%P%Z", name, ngx_pid);
+
+        ngx_memzero(&h, sizeof(ngx_http_fancyindex_cache_header_t));
+        h.magic    = NGX_HTTP_FANCYINDEX_CACHE_MAGIC;
+        h.version  = NGX_HTTP_FANCYINDEX_CACHE_VERSION;
+        h.settings = alcf->cache_settings;
+        h.uri_len  = (uint32_t) uri->len;
+        h.uniq     = uniq;
+        h.mtime    = (int64_t) mtime;
+        h.created  = (int64_t) now;
+        h.len      = len;
+
+        written = (ngx_http_fancyindex_cache_write(temp, &h, uri, b) == NGX_OK);
+    }
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    /* Allocate first, as this may remove the node. */
+    if (zctx->path == NULL)
+        body = ngx_http_fancyindex_cache_alloc(zctx, len);
+
+    stored = (body || written);
+
+    rows = (stored && patch)
+           ? ngx_http_fancyindex_cache_alloc(zctx, (patch->nrows + 1)
+                       * sizeof(ngx_http_fancyindex_cache_row_t))
+           : NULL;
+
+    cn = ngx_http_fancyindex_cache_lookup(zctx, key);
+    if (cn == NULL && stored)
+        cn = ngx_http_fancyindex_cache_node(zctx, key, uri);
+
+    if (cn && written) {
+        if (ngx_rename_file(temp, name) == NGX_FILE_ERROR) {
+            ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                          ngx_rename_file_n " \"%s\" to \"%s\" failed",
+                          temp, name);
+            stored = 0;
+        } else {
+            written = 0;
+        }
+    }
+
+    if (cn == NULL || !stored) {
+        if (body)
+            ngx_slab_free_locked(zctx->shpool, body);
+        if (rows)
+            ngx_slab_free_locked(zctx->shpool, rows);
+        if (cn && unlock)
+            cn->updating = 0;
+        goto done;
+    }
+
+    /* A previous file was replaced by the new one. */
+    if (cn->stored && cn->body == NULL && zctx->path)
+        zctx->sh->size -= cn->len;
+
+    if (cn->body)
+        ngx_slab_free_locked(zctx->shpool, cn->body);
+    if (cn->rows)
+        ngx_slab_free_locked(zctx->shpool, cn->rows);
+
+    cn->body = body;
+    cn->len = len;
+    cn->stored = 1;
+
+    if (body)
+        ngx_memcpy(body, b->pos, len);
+    else
+        zctx->sh->size += len;
+
+    cn->rows = rows;
+    cn->nrows = 0;
+    if (rows) {
+        cn->nrows = patch->nrows;
+        cn->gmtoff = patch->gmtoff;
+        ngx_memcpy(rows, patch->rows,
+                   patch->nrows * sizeof(ngx_http_fancyindex_cache_row_t));
+    }
+
+    cn->uniq = uniq;
+    cn->mtime = mtime;
+    cn->created = now;
+    cn->settings = alcf->cache_settings;
+    cn->watched = watched;
+    cn->generation = zctx->generation;
+
+    if (unlock)
+        cn->updating = 0;
+
+done:
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    if (written && ngx_delete_file(temp) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", temp);
+    }
+}
+
+
+static void
+ngx_http_fancyindex_cache_put(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_http_fancyindex_loc_conf_t *alcf,
+                              ngx_buf_t *b)
+{
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: cache store \"%V\", %uz bytes",
+                   &ctx->path, (size_t) (b->last - b->pos));
+
+    ngx_http_fancyindex_cache_save(alcf, ctx->cache_key,
+                                   &r->uri, (uint64_t) ctx->uniq, ctx->mtime, b,
+                                   ctx->cache_locked, 0, ctx->cache_patch);
+    ctx->cache_locked = 0;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_cache_noop(ngx_tree_ctx_t *tree, ngx_str_t *path)
+{
+    (void) tree; /* unused */
+    (void) path; /* unused */
+
+    return NGX_OK;
+}
+
+
+/*
+ * Whether a location which uses the zone renders listings with "settings".
+ */
+static ngx_flag_t
+ngx_http_fancyindex_cache_settings_used(ngx_http_fancyindex_cache_ctx_t *zctx,
+                                        uint32_t settings)
+{
+    uint32_t   *used = zctx->settings.elts;
+    ngx_uint_t  i;
+
+    for (i = 0; i < zctx->settings.nelts; i++) {
+        if (used[i] == settings)
+            return 1;
+    }
+
+    return 0;
+}
+
+
+/*
+ * Adds back to the zone the listing kept in a file by a previous run of
+ * Nginx. Returns NGX_DECLINED if the file is not valid, or the listing
+ * was rendered with settings which no location uses anymore.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_load(ngx_http_fancyindex_cache_ctx_t *zctx,
+                               u_char *key, ngx_str_t *path)
+{
+    ngx_http_fancyindex_cache_header_t  h;
+    ngx_http_fancyindex_cache_node_t   *cn;
+    ngx_file_info_t                     fi;
+    ngx_file_t                          file;
+    ngx_str_t                           uri;
+    ngx_int_t                           rc;
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.name = *path;
+    file.log = ngx_cycle->log;
+
+    file.fd = ngx_open_file(path->data, NGX_FILE_RDONLY, NGX_FILE_OPEN, 0);
+    if (file.fd == NGX_INVALID_FILE)
+        return NGX_DECLINED;
+
+    uri.data = NULL;
+    rc = NGX_DECLINED;
+
+    if (ngx_fd_info(file.fd, &fi) == NGX_FILE_ERROR
+        || ngx_read_file(&file, (u_char *) &h, sizeof(h), 0) != (ssize_t) sizeof(h)
+        || h.magic != NGX_HTTP_FANCYINDEX_CACHE_MAGIC
+        || h.version != NGX_HTTP_FANCYINDEX_CACHE_VERSION
+        || !ngx_http_fancyindex_cache_settings_used(zctx, h.settings)
+        || (uint64_t) ngx_file_size(&fi)
+           != ngx_http_fancyindex_cache_body(h.uri_len) + h.len)
+    {
+        goto close;
+    }
+
+    uri.len = h.uri_len;
+    if ((uri.data = ngx_alloc(uri.len + 1, ngx_cycle->log)) == NULL)
+        goto close;
+
+    if (ngx_read_file(&file, uri.data, uri.len, sizeof(h)) != (ssize_t) uri.len)
+        goto close;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    /* A worker process may have cached the listing meanwhile. */
+    if ((cn = ngx_http_fancyindex_cache_lookup(zctx, key)) == NULL
+        && (cn = ngx_http_fancyindex_cache_node(zctx, key, &uri)) != NULL)
+    {
+        cn->uniq = h.uniq;
+        cn->mtime = (time_t) h.mtime;
+        cn->created = (time_t) h.created;
+        cn->settings = h.settings;
+        cn->len = (size_t) h.len;
+        cn->stored = 1;
+        zctx->sh->size += cn->len;
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    rc = (cn != NULL) ? NGX_OK : NGX_DECLINED;
+
+close:
+
+    if (uri.data)
+        ngx_free(uri.data);
+
+    if (ngx_close_file(file.fd) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      ngx_close_file_n " \"%s\" failed", path->data);
+    }
+
+    return rc;
+}
+
+
+/*
+ * Adds back to the zone the files of listings cached before Nginx was
+ * restarted, and removes those which cannot be used, and temporary files
+ * left behind.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_clean_file(ngx_tree_ctx_t *tree, ngx_str_t *path)
+{
+    ngx_http_fancyindex_cache_ctx_t  *zctx = tree->data;
+    ngx_uint_t                        i;
+    ngx_int_t                         n;
+    u_char                            key[16], *p;
+
+    i = 0;
+
+    if (path->len > 2 * sizeof(key)) {
+        p = path->data + path->len - 2 * sizeof(key);
+
+        for ( ; p[-1] == '/' && i < sizeof(key); i++) {
+            if ((n = ngx_hextoi(p + 2 * i, 2)) == NGX_ERROR)
+                break;
+            key[i] = (u_char) n;
+        }
+    }
+
+    if (i == sizeof(key)) {
+        /* Listings in the zone may also be being replaced. */
+        ngx_shmtx_lock(&zctx->shpool->mutex);
+        n = (ngx_http_fancyindex_cache_lookup(zctx, key) != NULL);
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+        if (n || ngx_http_fancyindex_cache_load(zctx, key, path) == NGX_OK)
+            return NGX_OK;
+
+    } else if (ngx_time() - tree->mtime < NGX_HTTP_FANCYINDEX_CACHE_TEMP_AGE) {
+        /* Possibly being written. */
+        return NGX_OK;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http fancyindex: cache remove \"%V\"", path);
+
+    if (ngx_delete_file(path->data) == NGX_FILE_ERROR && ngx_errno != NGX_ENOENT) {
+        ngx_log_error(NGX_LOG_CRIT, ngx_cycle->log, ngx_errno,
+                      ngx_delete_file_n " \"%s\" failed", path->data);
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Called periodically in the cache manager process for zones which keep
+ * listings in files, see NGX_HTTP_FANCYINDEX_CACHE_MANAGER_SLEEP.
+ */
+static ngx_msec_t
+ngx_http_fancyindex_cache_manager(void *data)
+{
+    ngx_http_fancyindex_cache_ctx_t *zctx = data;
+    ngx_tree_ctx_t                   tree;
+    ngx_queue_t                     *q;
+    ngx_uint_t                       n;
+
+    if (!zctx->cleaned) {
+        zctx->cleaned = 1;
+
+        tree.init_handler = NULL;
+        tree.file_handler = ngx_http_fancyindex_cache_clean_file;
+        tree.pre_tree_handler = ngx_http_fancyindex_cache_noop;
+        tree.post_tree_handler = ngx_http_fancyindex_cache_noop;
+        tree.spec_handler = ngx_http_fancyindex_cache_noop;
+        tree.data = zctx;
+        tree.alloc = 0;
+        tree.log = ngx_cycle->log;
+
+        (void) ngx_walk_tree(&tree, &zctx->path->name);
+
+        ngx_log_error(NGX_LOG_NOTICE, ngx_cycle->log, 0,
+                      "http fancyindex: cache \"%V\" loaded, %O bytes",
+                      &zctx->path->name, zctx->sh->size);
+    }
+
+    if (zctx->max_size == 0)
+        return NGX_HTTP_FANCYINDEX_CACHE_MANAGER_SLEEP;
+
+    /* Batches keep the zone locked for short periods only. */
+    do {
+        ngx_shmtx_lock(&zctx->shpool->mutex);
+
+        for (n = 0;
+             n < NGX_HTTP_FANCYINDEX_CACHE_MANAGER_BATCH
+             && zctx->sh->size > zctx->max_size
+             && !ngx_queue_empty(&zctx->sh->queue);
+             n++)
+        {
+            q = ngx_queue_last(&zctx->sh->queue);
+            ngx_http_fancyindex_cache_delete(zctx,
+                ngx_queue_data(q, ngx_http_fancyindex_cache_node_t, queue));
+        }
+
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+    } while (n == NGX_HTTP_FANCYINDEX_CACHE_MANAGER_BATCH);
+
+    return NGX_HTTP_FANCYINDEX_CACHE_MANAGER_SLEEP;
+}
+
+
+/*
+ * Content handler of locations with fancyindex_purge: removes the cached
+ * listings whose URI starts with the configured prefix. Access is left to
+ * the usual modules (allow/deny, auth_basic, auth_request...) which run
+ * before it.
+ */
+static ngx_int_t
+ngx_http_fancyindex_purge_handler(ngx_http_request_t *r)
+{
+    ngx_http_fancyindex_loc_conf_t   *alcf;
+    ngx_http_fancyindex_cache_ctx_t  *zctx;
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_queue_t                      *q, *next;
+    ngx_chain_t                       out;
+    ngx_buf_t                        *b;
+    ngx_str_t                         prefix;
+    ngx_uint_t                        n;
+    ngx_int_t                         rc;
+
+    if (!(r->method & NGX_HTTP_DELETE)
+        && !(r->method_name.len == 5
+             && ngx_strncmp(r->method_name.data, "PURGE", 5) == 0))
+        return NGX_HTTP_NOT_ALLOWED;
+
+    rc = ngx_http_discard_request_body(r);
+    if (rc != NGX_OK)
+        return rc;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    zctx = alcf->purge_zone->data;
+
+    if (ngx_http_complex_value(r, alcf->purge_prefix, &prefix) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (prefix.len == 0 || prefix.data[0] != '/')
+        return NGX_HTTP_BAD_REQUEST;
+
+    n = 0;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    for (q = ngx_queue_head(&zctx->sh->queue);
+         q != ngx_queue_sentinel(&zctx->sh->queue);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        cn = ngx_queue_data(q, ngx_http_fancyindex_cache_node_t, queue);
+
+        if (cn->uri_len >= prefix.len
+            && ngx_memcmp(cn->uri, prefix.data, prefix.len) == 0)
+        {
+            ngx_http_fancyindex_cache_delete(zctx, cn);
+            n++;
+        }
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    ngx_log_error(NGX_LOG_INFO, r->connection->log, 0,
+                  "fancyindex: purged %ui listings under \"%V\"", n, &prefix);
+
+    if (n == 0)
+        return NGX_HTTP_NOT_FOUND;
+
+    if ((b = ngx_create_temp_buf(r->pool, NGX_INT_T_LEN + 8)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    b->last = ngx_sprintf(b->last, "purged %ui\n", n);
+    b->last_buf = (r == r->main) ? 1 : 0;
+    b->last_in_chain = 1;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = b->last - b->pos;
+    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/plain");
+    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/plain");
+    r->headers_out.content_type.data = (u_char *) "text/plain";
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    out.buf = b;
+    out.next = NULL;
+
+    return ngx_http_output_filter(r, &out);
+}
+
+
+/**
+ * Background update of a stale listing. It outlives the request which
+ * triggered it, so everything needed is copied into its own pool.
+ */
+typedef struct {
+    ngx_pool_t                      *pool;
+    ngx_http_fancyindex_loc_conf_t  *alcf;
+    ngx_str_t                        path;      /**< NUL-terminated. */
+    size_t                           allocated; /**< Bytes available at path.data */
+    ngx_str_t                        uri;
+    ngx_uint_t                       criterion;
+    const char                      *sort_url_args;
+    ngx_uint_t                       flags;     /**< NGX_HTTP_FANCYINDEX_SCAN_* */
+    ngx_http_fancyindex_limit_t      limit;
+    u_char                           key[16];
+    uint64_t                         uniq;
+    time_t                           mtime;
+    ngx_http_fancyindex_patch_t     *patch;     /**< Or NULL. */
+    ngx_array_t                      entries;
+    ngx_buf_t                       *buf;       /**< Rendered listing. */
+    ngx_event_t                      event;
+    unsigned                         scanned:1; /**< All entries were read. */
+} ngx_http_fancyindex_refresh_t;
+
+
+/*
+ * Scans the directory; may run in a thread, so fancyindex_ignore is left
+ * to ngx_http_fancyindex_refresh_render(). Index files and the scan cache
+ * are not used, as they are tied to requests, and the stale listing being
+ * replaced means that the directory changed anyway.
+ */
+static void
+ngx_http_fancyindex_refresh_scan(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_refresh_t *rf = data;
+    ngx_file_info_t                fi;
+
+    if (ngx_file_info(rf->path.data, &fi) == NGX_FILE_ERROR || !ngx_is_dir(&fi))
+        return;
+
+    rf->uniq = (uint64_t) ngx_file_uniq(&fi);
+    rf->mtime = ngx_file_mtime(&fi);
+
+    if (ngx_array_init(&rf->entries, rf->pool, 40,
+                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        return;
+
+    ngx_http_fancyindex_limit_init(&rf->limit, rf->alcf, 0);
+
+    /* Partial listings are not cached. */
+    rf->scanned = ngx_http_fancyindex_read_dir(rf->pool, log, rf->alcf,
+                                               &rf->path, rf->allocated, NULL,
+                                               rf->flags, &rf->limit,
+                                               &rf->entries) == NGX_OK
+                  && !rf->limit.truncated;
+}
+
+
+/*
+ * Leaves out the ignored entries, and renders the listing. Runs in the
+ * main thread, as regular expressions cannot be matched from others.
+ */
+static void
+ngx_http_fancyindex_refresh_render(ngx_http_fancyindex_refresh_t *rf,
+                                   ngx_log_t *log)
+{
+    ngx_http_fancyindex_entry_t *entry = rf->entries.elts;
+    ngx_uint_t                   i, n;
+
+    if (!rf->scanned)
+        return;
+
+    for (i = n = 0; i < rf->entries.nelts; i++) {
+        if (!ngx_http_fancyindex_ignored(rf->alcf, entry[i].name.data,
+                                         entry[i].name.len, log))
+            entry[n++] = entry[i];
+    }
+
+    ngx_http_fancyindex_sort_entries(entry, n,
+            ngx_http_fancyindex_sort_cmp(rf->criterion, rf->alcf->case_sensitive),
+            rf->alcf->dirs_first);
+
+    rf->buf = ngx_http_fancyindex_render(rf->pool, rf->alcf, &rf->uri,
+                                         entry, n, rf->sort_url_args, 0,
+                                         rf->patch);
+}
+
+
+static void
+ngx_http_fancyindex_refresh_done(ngx_http_fancyindex_refresh_t *rf)
+{
+    ngx_http_fancyindex_cache_ctx_t  *zctx = rf->alcf->cache_zone->data;
+    ngx_http_fancyindex_cache_node_t *cn;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http fancyindex: cache refresh \"%V\": %s",
+                   &rf->path, rf->buf ? "done" : "failed");
+
+    if (rf->buf) {
+        ngx_http_fancyindex_cache_save(rf->alcf, rf->key, &rf->uri, rf->uniq,
+                                       rf->mtime, rf->buf, 1, 0, rf->patch);
+    } else {
+        ngx_shmtx_lock(&zctx->shpool->mutex);
+        if ((cn = ngx_http_fancyindex_cache_lookup(zctx, rf->key)))
+            cn->updating = 0;
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+    }
+
+    ngx_destroy_pool(rf->pool);
+}
+
+
+static void
+ngx_http_fancyindex_refresh_handler(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_refresh_t *rf = ev->data;
+
+    ngx_http_fancyindex_refresh_scan(rf, ev->log);
+    ngx_http_fancyindex_refresh_render(rf, ev->log);
+    ngx_http_fancyindex_refresh_done(rf);
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_fancyindex_refresh_thread_handler(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_refresh_t *rf = ev->data;
+
+    ngx_http_fancyindex_refresh_render(rf, ngx_cycle->log);
+    ngx_http_fancyindex_refresh_done(rf);
+}
+
+#endif /* NGX_THREADS */
+
+
+/*
+ * Starts updating a stale listing, in the thread pool if configured, or
+ * else from a timer which fires once the current request is served. In
+ * the latter case the directory is scanned by the worker process, which
+ * blocks every other request it handles meanwhile.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_refresh(ngx_http_request_t *r,
+                                  ngx_http_fancyindex_ctx_t *ctx,
+                                  ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_refresh_t *rf;
+    ngx_pool_t                    *pool;
+#if (NGX_THREADS)
+    ngx_thread_task_t             *task;
+#endif
+
+    if ((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log)) == NULL)
+        return NGX_ERROR;
+
+    if ((rf = ngx_pcalloc(pool, sizeof(ngx_http_fancyindex_refresh_t))) == NULL)
+        goto failed;
+
+    rf->pool = pool;
+    rf->alcf = alcf;
+    rf->flags = ctx->flags;
+    rf->criterion = ngx_http_fancyindex_sort_criterion(r, alcf, &rf->sort_url_args);
+    ngx_memcpy(rf->key, ctx->cache_key, 16);
+
+    /* Copied here, as the zone is not locked from threads. */
+    rf->patch = ngx_http_fancyindex_cache_base(pool, alcf, rf->key);
+
+    rf->allocated = ctx->path.len + 1 + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+    if ((rf->path.data = ngx_pnalloc(pool, rf->allocated)) == NULL)
+        goto failed;
+    rf->path.len = ctx->path.len;
+    ngx_memcpy(rf->path.data, ctx->path.data, ctx->path.len + 1);
+
+    if ((rf->uri.data = ngx_pnalloc(pool, r->uri.len)) == NULL)
+        goto failed;
+    rf->uri.len = r->uri.len;
+    ngx_memcpy(rf->uri.data, r->uri.data, r->uri.len);
+
+#if (NGX_THREADS)
+    if (alcf->thread_pool) {
+        if ((task = ngx_thread_task_alloc(pool, 0)) == NULL)
+            goto failed;
+
+        rf->flags |= NGX_HTTP_FANCYINDEX_SCAN_THREAD;
+
+        task->ctx = rf;
+        task->handler = ngx_http_fancyindex_refresh_scan;
+        task->event.data = rf;
+        task->event.handler = ngx_http_fancyindex_refresh_thread_handler;
+
+        if (ngx_thread_task_post(alcf->thread_pool, task) != NGX_OK)
+            goto failed;
+
+        return NGX_OK;
+    }
+#endif /* NGX_THREADS */
+
+    rf->event.handler = ngx_http_fancyindex_refresh_handler;
+    rf->event.data = rf;
+    rf->event.log = ngx_cycle->log;
+    rf->event.cancelable = 1;
+    ngx_add_timer(&rf->event, 1);
+
+    return NGX_OK;
+
+failed:
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+}
+
+
+/*
+ * Allocates a directory of a tree, which is released with ngx_free() as
+ * it may outlive any pool.
+ */
+static ngx_http_fancyindex_tree_dir_t *
+ngx_http_fancyindex_tree_dir(ngx_http_fancyindex_tree_t *tree,
+                             u_char *path, size_t path_len,
+                             u_char *uri, size_t uri_len, ngx_uint_t depth)
+{
+    ngx_http_fancyindex_tree_dir_t *d;
+    size_t                          allocated;
+
+    allocated = path_len + 1 + NGX_HTTP_FANCYINDEX_PREALLOCATE;
+
+    d = ngx_alloc(sizeof(ngx_http_fancyindex_tree_dir_t) + allocated + uri_len,
+                  ngx_cycle->log);
+    if (d == NULL)
+        return NULL;
+
+    d->tree = tree;
+
+    d->path.data = (u_char *) (d + 1);
+    d->path.len = path_len;
+    ngx_memcpy(d->path.data, path, path_len);
+    d->path.data[path_len] = '\0';
+    d->allocated = allocated;
+
+    d->uri.data = d->path.data + allocated;
+    d->uri.len = uri_len;
+    ngx_memcpy(d->uri.data, uri, uri_len);
+
+    d->depth = depth;
+    d->dirty = 0;
+
+    return d;
+}
+
+
+typedef void (*ngx_http_fancyindex_subdir_pt)(void *data,
+    ngx_http_fancyindex_tree_dir_t *parent, u_char *path, size_t path_len,
+    u_char *uri, size_t uri_len);
+
+
+/*
+ * Renders the listing of a directory of a tree into the cache, with the
+ * default sorting, and passes its subdirectories to "subdir" if the tree
+ * is deep enough. Listings saved as "watched" are kept up to date by
+ * fancyindex_watch.
+ */
+static ngx_int_t
+ngx_http_fancyindex_tree_render(ngx_http_fancyindex_tree_dir_t *d,
+                                ngx_flag_t watched,
+                                ngx_http_fancyindex_subdir_pt subdir,
+                                void *data)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = d->tree->alcf;
+    ngx_http_fancyindex_entry_t    *entry;
+    ngx_http_fancyindex_patch_t    *patch;
+    ngx_http_fancyindex_limit_t     limit;
+    ngx_file_info_t                 fi;
+    ngx_array_t                     entries;
+    ngx_pool_t                     *pool;
+    ngx_buf_t                      *b;
+    ngx_uint_t                      i;
+    ngx_int_t                       rc;
+    u_char                          key[16];
+    u_char                         *path, *uri, *p, *q;
+
+    if ((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, ngx_cycle->log)) == NULL)
+        return NGX_ERROR;
+
+    if (ngx_file_info(d->path.data, &fi) == NGX_FILE_ERROR || !ngx_is_dir(&fi))
+        goto failed;
+
+    if (ngx_array_init(&entries, pool, 40,
+                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        goto failed;
+
+    ngx_http_fancyindex_limit_init(&limit, alcf, 0);
+
+    rc = ngx_http_fancyindex_read_dir(pool, ngx_cycle->log, alcf, &d->path,
+                                      d->allocated, NULL,
+                                      NGX_HTTP_FANCYINDEX_SCAN_IGNORE,
+                                      &limit, &entries);
+
+    /* Reading the directory overwrites the terminating NUL. */
+    d->path.data[d->path.len] = '\0';
+
+    /* Partial listings are not cached. */
+    if (rc != NGX_OK || limit.truncated)
+        goto failed;
+
+    entry = entries.elts;
+
+    for (i = 0; d->depth && i < entries.nelts; i++) {
+        if (!entry[i].dir)
+            continue;
+
+        path = ngx_pnalloc(pool, d->path.len + 1 + entry[i].name.len);
+        uri = ngx_pnalloc(pool, d->uri.len + entry[i].name.len + 1);
+        if (path == NULL || uri == NULL)
+            goto failed;
+
+        p = ngx_cpymem(path, d->path.data, d->path.len);
+        if (p[-1] != '/')
+            *p++ = '/';
+        p = ngx_cpymem(p, entry[i].name.data, entry[i].name.len);
+
+        q = ngx_cpymem(uri, d->uri.data, d->uri.len);
+        q = ngx_cpymem(q, entry[i].name.data, entry[i].name.len);
+        *q++ = '/';
+
+        subdir(data, d, path, p - path, uri, q - uri);
+    }
+
+    ngx_http_fancyindex_sort_entries(entries.elts, entries.nelts,
+            ngx_http_fancyindex_sort_cmp(alcf->default_sort, alcf->case_sensitive),
+            alcf->dirs_first);
+
+    ngx_http_fancyindex_cache_key(key, alcf, alcf->default_sort, 0,
+                                  &d->path, &d->uri);
+
+    patch = ngx_http_fancyindex_cache_base(pool, alcf, key);
+
+    b = ngx_http_fancyindex_render(pool, alcf, &d->uri, entries.elts,
+                                   entries.nelts, "", 0, patch);
+    if (b == NULL)
+        goto failed;
+
+    ngx_http_fancyindex_cache_save(alcf, key, &d->uri,
+                                   (uint64_t) ngx_file_uniq(&fi),
+                                   ngx_file_mtime(&fi), b, 0, watched, patch);
+
+    ngx_destroy_pool(pool);
+    return NGX_OK;
+
+failed:
+    ngx_destroy_pool(pool);
+    return NGX_ERROR;
+}
+
+
+static void
+ngx_http_fancyindex_preload_add(void *data,
+                                ngx_http_fancyindex_tree_dir_t *parent,
+                                u_char *path, size_t path_len,
+                                u_char *uri, size_t uri_len)
+{
+    ngx_http_fancyindex_main_conf_t *amcf = data;
+    ngx_http_fancyindex_tree_dir_t  *d;
+
+    d = ngx_http_fancyindex_tree_dir(parent->tree, path, path_len,
+                                     uri, uri_len, parent->depth - 1);
+    if (d) {
+        ngx_queue_insert_tail(&amcf->preload_queue, &d->queue);
+    }
+}
+
+
+/*
+ * Renders the next directory to preload; they are spaced out so live
+ * requests are not held up for long.
+ */
+static void
+ngx_http_fancyindex_preload_handler(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_main_conf_t *amcf = ev->data;
+    ngx_http_fancyindex_tree_dir_t  *d;
+    ngx_queue_t                     *q;
+
+    if (ngx_queue_empty(&amcf->preload_queue))
+        return;
+
+    q = ngx_queue_head(&amcf->preload_queue);
+    ngx_queue_remove(q);
+
+    d = ngx_queue_data(q, ngx_http_fancyindex_tree_dir_t, queue);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                   "http fancyindex: preload \"%V\"", &d->uri);
+
+    if (ngx_http_fancyindex_tree_render(d, 0, ngx_http_fancyindex_preload_add,
+                                        amcf) != NGX_OK)
+    {
+        ngx_log_error(NGX_LOG_WARN, ev->log, 0,
+                      "http fancyindex: could not preload \"%V\"", &d->path);
+    }
+
+    ngx_free(d);
+
+    if (ngx_queue_empty(&amcf->preload_queue)) {
+        ngx_log_error(NGX_LOG_NOTICE, ev->log, 0,
+                      "http fancyindex: preloading finished");
+        return;
+    }
+
+    if (!ngx_exiting)
+        ngx_add_timer(ev, NGX_HTTP_FANCYINDEX_PRELOAD_PACE);
+}
+
+
+#if (NGX_LINUX)
+
+static ngx_http_fancyindex_tree_dir_t *
+ngx_http_fancyindex_watch_lookup(ngx_http_fancyindex_watch_t *w, int wd)
+{
+    ngx_rbtree_node_t *node = w->rbtree.root;
+    ngx_rbtree_node_t *sentinel = w->rbtree.sentinel;
+    ngx_rbtree_key_t   key = (ngx_rbtree_key_t) wd;
+
+    while (node != sentinel) {
+        if (key == node->key)
+            return (ngx_http_fancyindex_tree_dir_t *) node;
+
+        node = (key < node->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+static void
+ngx_http_fancyindex_watch_dirty(ngx_http_fancyindex_watch_t *w,
+                                ngx_http_fancyindex_tree_dir_t *d)
+{
+    if (d->dirty)
+        return;
+
+    d->dirty = 1;
+    ngx_queue_insert_tail(&w->dirty, &d->queue);
+
+    if (!w->event.timer_set)
+        ngx_add_timer(&w->event, NGX_HTTP_FANCYINDEX_WATCH_DELAY);
+}
+
+
+/*
+ * The listing of a directory which could not be rendered is left in the
+ * cache, but it is checked again by requests as usual.
+ */
+static void
+ngx_http_fancyindex_watch_forget(ngx_http_fancyindex_tree_dir_t *d)
+{
+    ngx_http_fancyindex_loc_conf_t   *alcf = d->tree->alcf;
+    ngx_http_fancyindex_cache_ctx_t  *zctx = alcf->cache_zone->data;
+    ngx_http_fancyindex_cache_node_t *cn;
+    u_char                            key[16];
+
+    ngx_http_fancyindex_cache_key(key, alcf, alcf->default_sort, 0,
+                                  &d->path, &d->uri);
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    if ((cn = ngx_http_fancyindex_cache_lookup(zctx, key)))
+        cn->watched = 0;
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+}
+
+
+static void
+ngx_http_fancyindex_watch_remove(ngx_http_fancyindex_watch_t *w,
+                                 ngx_http_fancyindex_tree_dir_t *d)
+{
+    ngx_http_fancyindex_watch_forget(d);
+
+    if (d->dirty) {
+        ngx_queue_remove(&d->queue);
+    }
+
+    ngx_rbtree_delete(&w->rbtree, &d->node);
+    ngx_free(d);
+}
+
+
+/*
+ * Starts watching a directory, which is rendered soon after. Renamed
+ * directories keep their watch descriptor, which then gets the new path.
+ */
+static void
+ngx_http_fancyindex_watch_add(ngx_http_fancyindex_watch_t *w,
+                              u_char *path, size_t path_len,
+                              u_char *uri, size_t uri_len, ngx_uint_t depth)
+{
+    ngx_http_fancyindex_tree_dir_t *d, *old;
+    int                             wd;
+
+    d = ngx_http_fancyindex_tree_dir(&w->tree, path, path_len,
+                                     uri, uri_len, depth);
+    if (d == NULL)
+        return;
+
+    wd = inotify_add_watch(w->connection->fd, (const char *) d->path.data,
+                           NGX_HTTP_FANCYINDEX_WATCH_EVENTS);
+    if (wd == -1) {
+        ngx_log_error(NGX_LOG_ERR, ngx_cycle->log, ngx_errno,
+                      "inotify_add_watch(\"%s\") failed", d->path.data);
+        ngx_free(d);
+        return;
+    }
+
+    if ((old = ngx_http_fancyindex_watch_lookup(w, wd))) {
+        if (old->path.len == path_len
+            && ngx_strncmp(old->path.data, path, path_len) == 0)
+        {
+            ngx_free(d);
+            return;
+        }
+
+        ngx_http_fancyindex_watch_remove(w, old);
+    }
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http fancyindex: watch \"%s\", wd:%d", d->path.data, wd);
+
+    d->node.key = (ngx_rbtree_key_t) wd;
+    ngx_rbtree_insert(&w->rbtree, &d->node);
+
+    ngx_http_fancyindex_watch_dirty(w, d);
+}
+
+
+static void
+ngx_http_fancyindex_watch_subdir(void *data,
+                                 ngx_http_fancyindex_tree_dir_t *parent,
+                                 u_char *path, size_t path_len,
+                                 u_char *uri, size_t uri_len)
+{
+    ngx_http_fancyindex_watch_add(data, path, path_len, uri, uri_len,
+                                  parent->depth - 1);
+}
+
+
+static void
+ngx_http_fancyindex_watch_flush(ngx_event_t *ev)
+{
+    ngx_http_fancyindex_watch_t    *w = ev->data;
+    ngx_http_fancyindex_tree_dir_t *d;
+    ngx_queue_t                    *q;
+
+    if (ev->timer_set)
+        ngx_del_timer(ev);
+
+    while (!ngx_queue_empty(&w->dirty)) {
+        q = ngx_queue_head(&w->dirty);
+        ngx_queue_remove(q);
+
+        d = ngx_queue_data(q, ngx_http_fancyindex_tree_dir_t, queue);
+        d->dirty = 0;
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, ev->log, 0,
+                       "http fancyindex: watch render \"%V\"", &d->uri);
+
+        if (ngx_http_fancyindex_tree_render(d, 1,
+                    ngx_http_fancyindex_watch_subdir, w) != NGX_OK)
+            ngx_http_fancyindex_watch_forget(d);
+    }
+}
+
+
+static void
+ngx_http_fancyindex_watch_read(ngx_event_t *rev)
+{
+    ngx_connection_t                *c = rev->data;
+    ngx_http_fancyindex_watch_t     *w = c->data;
+    ngx_http_fancyindex_tree_dir_t *d;
+    ngx_rbtree_node_t               *node;
+    struct inotify_event            *ie;
+    ssize_t                          n;
+    ngx_err_t                        err;
+    u_char                          *p;
+    union {
+        struct inotify_event         event;
+        u_char                       data[4096];
+    } buf;
+
+    for ( ;; ) {
+        n = read(c->fd, buf.data, sizeof(buf.data));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR)
+                continue;
+
+            if (err != NGX_EAGAIN)
+                ngx_log_error(NGX_LOG_ALERT, rev->log, err,
+                              "read() from inotify failed");
+            break;
+        }
+
+        for (p = buf.data; p < buf.data + n;
+             p += sizeof(struct inotify_event) + ie->len)
+        {
+            ie = (struct inotify_event *) p;
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+                /* Some events were lost, render everything again. */
+                ngx_log_error(NGX_LOG_WARN, rev->log, 0,
+                              "http fancyindex: inotify queue overflow");
+
+                if (w->rbtree.root == w->rbtree.sentinel)
+                    continue;
+
+                for (node = ngx_rbtree_min(w->rbtree.root, w->rbtree.sentinel);
+                     node;
+                     node = ngx_rbtree_next(&w->rbtree, node))
+                {
+                    ngx_http_fancyindex_watch_dirty(w,
+                            (ngx_http_fancyindex_tree_dir_t *) node);
+                }
+                continue;
+            }
+
+            if ((d = ngx_http_fancyindex_watch_lookup(w, ie->wd)) == NULL)
+                continue;
+
+            if (ie->mask & IN_IGNORED) {
+                /* The directory was removed, or its file system unmounted. */
+                ngx_http_fancyindex_watch_remove(w, d);
+                continue;
+            }
+
+            ngx_http_fancyindex_watch_dirty(w, d);
+        }
+    }
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, rev->log, 0,
+                      "http fancyindex: cannot wait for inotify events");
+    }
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_watch_start(ngx_http_fancyindex_watch_t *w)
+{
+    ngx_connection_t *c;
+    int               fd;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "inotify_init1() failed");
+        return NGX_ERROR;
+    }
+
+    if ((c = ngx_get_connection(fd, ngx_cycle->log)) == NULL) {
+        close(fd);
+        return NGX_ERROR;
+    }
+
+    c->data = w;
+    c->read->handler = ngx_http_fancyindex_watch_read;
+    c->read->log = c->log;
+
+    w->connection = c;
+    ngx_rbtree_init(&w->rbtree, &w->sentinel, ngx_rbtree_insert_value);
+    ngx_queue_init(&w->dirty);
+
+    w->event.handler = ngx_http_fancyindex_watch_flush;
+    w->event.data = w;
+    w->event.log = ngx_cycle->log;
+    w->event.cancelable = 1;
+
+    ngx_http_fancyindex_watch_add(w, w->tree.path.data, w->tree.path.len,
+                                  w->tree.uri.data, w->tree.uri.len,
+                                  w->tree.depth);
+
+    /* Tried again later, the directory may not exist yet. */
+    if (w->rbtree.root == w->rbtree.sentinel
+        || ngx_handle_read_event(c->read, 0) != NGX_OK)
+    {
+        if (w->event.timer_set)
+            ngx_del_timer(&w->event);
+
+        ngx_close_connection(c);
+        w->connection = NULL;
+        return NGX_ERROR;
+    }
+
+    ngx_http_fancyindex_watch_flush(&w->event);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Called periodically in the cache manager process, see the definition
+ * of NGX_HTTP_FANCYINDEX_WATCH_PATH.
+ */
+static ngx_msec_t
+ngx_http_fancyindex_watch_manager(void *data)
+{
+    ngx_http_fancyindex_main_conf_t *amcf = data;
+    ngx_http_fancyindex_watch_t     *w = amcf->watches.elts;
+    ngx_uint_t                       i;
+
+    for (i = 0; i < amcf->watches.nelts; i++) {
+        if (w[i].connection == NULL)
+            (void) ngx_http_fancyindex_watch_start(&w[i]);
+    }
+
+    return NGX_HTTP_FANCYINDEX_WATCH_RETRY;
+}
+
+#endif /* NGX_LINUX */
+
+
+/*
+ * Parses the "since" argument, a Unix timestamp. Returns -1 if missing.
+ */
+static time_t
+ngx_http_fancyindex_since(ngx_http_request_t *r)
+{
+    ngx_str_t value;
+
+    if (ngx_http_arg(r, (u_char *) "since", 5, &value) != NGX_OK)
+        return -1;
+
+    return ngx_atotm(value.data, value.len);
+}
+
+
+/*
+ * Checks whether the "A" argument asks for a tar archive.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_archive(ngx_http_request_t *r,
+                            ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_str_t value;
+
+    if (!alcf->archive ||
+        ngx_http_arg(r, (u_char *) "A", 1, &value) != NGX_OK)
+        return 0;
+
+    return value.len == 3 && ngx_strncmp(value.data, "tar", 3) == 0;
+}
+
+
+/*
+ * Adds a response header; "key" must be a static string.
+ */
+static ngx_int_t
+ngx_http_fancyindex_add_header(ngx_http_request_t *r, const char *key,
+                               u_char *value, size_t len)
+{
+    ngx_table_elt_t *h;
+
+    if ((h = ngx_list_push(&r->headers_out.headers)) == NULL)
+        return NGX_ERROR;
+
+    h->hash = 1;
+#if defined(nginx_version) && (nginx_version >= 1023000)
+    h->next = NULL;
+#endif
+    h->key.data = (u_char *) key;
+    h->key.len = ngx_strlen(key);
+
+    if ((h->value.data = ngx_pnalloc(r->pool, len)) == NULL)
+        return NGX_ERROR;
+
+    ngx_memcpy(h->value.data, value, len);
+    h->value.len = len;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Length of a key of fancyindex_surrogate_key: "fi" and the CRC32 of the
+ * path of the directory in hexadecimal.
+ */
+#define NGX_HTTP_FANCYINDEX_SURROGATE_KEY_LEN  (2 + 8)
+
+/*
+ * Adds the headers for caches in front of Nginx set with
+ * fancyindex_cache_control and fancyindex_surrogate_key. The surrogate
+ * keys are those of the directory and of each of its parents, so that
+ * purging the key of a directory also purges the listings of everything
+ * under it.
+ */
+static ngx_int_t
+ngx_http_fancyindex_cache_headers(ngx_http_request_t *r,
+                                  ngx_http_fancyindex_ctx_t *ctx,
+                                  ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    u_char     *value, *p;
+    u_char      cache_control[2 * NGX_TIME_T_LEN + 40];
+    ngx_uint_t  i, n;
+
+    if (alcf->cache_control != -1) {
+        p = ngx_sprintf(cache_control, "max-age=%T", alcf->cache_control);
+        if (alcf->cache_control_swr != -1)
+            p = ngx_sprintf(p, ", stale-while-revalidate=%T",
+                            alcf->cache_control_swr);
+
+        if (ngx_http_fancyindex_add_header(r, "Cache-Control", cache_control,
+                                           p - cache_control) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    if (!alcf->surrogate_key || ctx->path.len == 0)
+        return NGX_OK;
+
+    for (i = 1, n = 1; i < ctx->path.len; i++) {
+        if (ctx->path.data[i] == '/')
+            n++;
+    }
+
+    value = ngx_pnalloc(r->pool, (n + 1) * (NGX_HTTP_FANCYINDEX_SURROGATE_KEY_LEN + 1));
+    if (value == NULL)
+        return NGX_ERROR;
+
+    /* The first key is that of the root. */
+    p = ngx_sprintf(value, "fi%08xD", ngx_crc32_short(ctx->path.data, 1));
+
+    for (i = 2; i <= ctx->path.len; i++) {
+        if (i == ctx->path.len || ctx->path.data[i] == '/')
+            p = ngx_sprintf(p, " fi%08xD", ngx_crc32_long(ctx->path.data, i));
+    }
+
+    return ngx_http_fancyindex_add_header(r, "Surrogate-Key", value, p - value);
+}
+
+
+#if (NGX_LINUX)
+
+static ngx_http_fancyindex_events_dir_t *
+ngx_http_fancyindex_events_lookup(ngx_http_fancyindex_main_conf_t *amcf, int wd)
+{
+    ngx_rbtree_node_t *node = amcf->events_rbtree.root;
+    ngx_rbtree_node_t *sentinel = amcf->events_rbtree.sentinel;
+    ngx_rbtree_key_t   key = (ngx_rbtree_key_t) wd;
+
+    while (node != sentinel) {
+        if (key == node->key)
+            return (ngx_http_fancyindex_events_dir_t *) node;
+
+        node = (key < node->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Stops sending the events of a directory to a follower. The watch of the
+ * directory is removed along with its last follower, and the directory is
+ * freed once inotify confirms it with IN_IGNORED.
+ */
+static void
+ngx_http_fancyindex_events_detach(ngx_http_fancyindex_events_sub_t *sub)
+{
+    ngx_http_fancyindex_main_conf_t  *amcf = sub->amcf;
+    ngx_http_fancyindex_events_dir_t *d = sub->dir;
+
+    if (d == NULL)
+        return;
+
+    ngx_queue_remove(&sub->queue);
+    sub->dir = NULL;
+    amcf->events_nsubscribers--;
+
+    if (!ngx_queue_empty(&d->subscribers) || d->removed)
+        return;
+
+    d->removed = 1;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, ngx_cycle->log, 0,
+                   "http fancyindex: events unwatch \"%s\", wd:%d",
+                   d->path.data, (int) d->node.key);
+
+    /* Fails if the watch is already gone, IN_IGNORED is on its way then. */
+    if (inotify_rm_watch(amcf->events_connection->fd, (int) d->node.key) == -1
+        && ngx_errno != NGX_EINVAL)
+    {
+        ngx_log_error(NGX_LOG_ALERT, ngx_cycle->log, ngx_errno,
+                      "inotify_rm_watch(\"%s\") failed", d->path.data);
+    }
+}
+
+
+static void
+ngx_http_fancyindex_events_cleanup(void *data)
+{
+    ngx_http_fancyindex_events_detach(data);
+}
+
+
+/*
+ * Terminates the response to a follower after an error. It is detached
+ * first, as the request may outlive this call, and no further events
+ * must be sent to it meanwhile.
+ */
+static void
+ngx_http_fancyindex_events_fail(ngx_http_fancyindex_events_sub_t *sub)
+{
+    ngx_http_fancyindex_events_detach(sub);
+    ngx_http_finalize_request(sub->request, NGX_ERROR);
+}
+
+
+/*
+ * Sends the pending events of a follower unless others are still being
+ * sent, in which case ngx_http_fancyindex_events_write() sends them later.
+ */
+static ngx_int_t
+ngx_http_fancyindex_events_send(ngx_http_fancyindex_events_sub_t *sub)
+{
+    ngx_http_request_t       *r = sub->request;
+    ngx_connection_t         *c = r->connection;
+    ngx_http_core_loc_conf_t *clcf;
+    ngx_buf_t                *b;
+    ngx_int_t                 rc;
+
+    if (sub->busy || sub->pending->last == sub->pending->pos)
+        return NGX_OK;
+
+    b = sub->pending;
+    sub->pending = sub->out;
+    sub->out = b;
+    sub->pending->pos = sub->pending->last = sub->pending->start;
+
+    b->flush = 1;
+    sub->chain.buf = b;
+    sub->chain.next = NULL;
+
+    rc = ngx_http_output_filter(r, &sub->chain);
+    if (rc == NGX_ERROR)
+        return NGX_ERROR;
+
+    if (rc == NGX_AGAIN || r->buffered || c->buffered) {
+        sub->busy = 1;
+
+        clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+        if (!c->write->delayed)
+            ngx_add_timer(c->write, clcf->send_timeout);
+
+        if (ngx_handle_write_event(c->write, clcf->send_lowat) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    return NGX_OK;
+}
+
+
+static void
+ngx_http_fancyindex_events_write(ngx_http_request_t *r)
+{
+    ngx_connection_t                 *c = r->connection;
+    ngx_event_t                      *wev = c->write;
+    ngx_http_core_loc_conf_t         *clcf;
+    ngx_http_fancyindex_ctx_t        *ctx;
+    ngx_http_fancyindex_events_sub_t *sub;
+    ngx_int_t                         rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    sub = ctx->events;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_fancyindex_events_detach(sub);
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    if (!sub->busy || wev->delayed)
+        return;
+
+    rc = ngx_http_output_filter(r, NULL);
+    if (rc == NGX_ERROR) {
+        ngx_http_fancyindex_events_fail(sub);
+        return;
+    }
+
+    if (rc == NGX_AGAIN || r->buffered || c->buffered) {
+        ngx_add_timer(wev, clcf->send_timeout);
+
+        if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+            ngx_http_fancyindex_events_fail(sub);
+        return;
+    }
+
+    if (wev->timer_set)
+        ngx_del_timer(wev);
+
+    sub->busy = 0;
+
+    if (ngx_handle_write_event(wev, 0) != NGX_OK
+        || ngx_http_fancyindex_events_send(sub) != NGX_OK)
+        ngx_http_fancyindex_events_fail(sub);
+}
+
+
+/*
+ * Ends the response to a follower, when the directory is gone.
+ */
+static void
+ngx_http_fancyindex_events_end(ngx_http_fancyindex_events_sub_t *sub)
+{
+    ngx_http_request_t *r = sub->request;
+    ngx_int_t           rc;
+
+    ngx_http_fancyindex_events_detach(sub);
+
+    rc = ngx_http_fancyindex_events_send(sub);
+    if (rc == NGX_OK)
+        rc = ngx_http_send_special(r, NGX_HTTP_LAST);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+/*
+ * Appends an event to the pending ones of a follower. The data of the
+ * event is the name of the entry escaped as in the links of listings,
+ * with a slash after the names of directories.
+ */
+static ngx_int_t
+ngx_http_fancyindex_events_add(ngx_http_fancyindex_events_sub_t *sub,
+                               const char *event, u_char *name, size_t len,
+                               ngx_uint_t dir)
+{
+    ngx_buf_t *b = sub->pending;
+    uintptr_t  escape;
+
+    escape = ngx_fancyindex_escape_filename(NULL, name, len);
+
+    if ((size_t) (b->end - b->last) < sizeof("event: \ndata: /\n\n") - 1
+                                      + ngx_strlen(event) + len + 2 * escape)
+    {
+        ngx_log_error(NGX_LOG_INFO, sub->request->connection->log, 0,
+                      "http fancyindex: client fell behind the events "
+                      "of \"%s\"", sub->dir->path.data);
+        return NGX_ERROR;
+    }
+
+    b->last = ngx_sprintf(b->last, "event: %s\ndata: ", event);
+
+    if (escape) {
+        ngx_fancyindex_escape_filename(b->last, name, len);
+        b->last += len + 2 * escape;
+    } else {
+        b->last = ngx_cpymem(b->last, name, len);
+    }
+
+    if (dir)
+        *b->last++ = '/';
+
+    *b->last++ = '\n';
+    *b->last++ = '\n';
+
+    return NGX_OK;
+}
+
+
+/*
+ * Adds an event about an entry to the followers of its directory, leaving
+ * out those in locations which would not list the entry.
+ */
+static void
+ngx_http_fancyindex_events_entry(ngx_http_fancyindex_events_dir_t *d,
+                                 struct inotify_event *ie)
+{
+    ngx_http_fancyindex_events_sub_t *sub;
+    ngx_http_fancyindex_loc_conf_t   *alcf;
+    ngx_http_request_t               *r;
+    ngx_file_info_t                   fi;
+    ngx_queue_t                      *q, *next;
+    ngx_int_t                         link = -1;
+    const char                       *event;
+    size_t                            len;
+    u_char                            path[NGX_MAX_PATH];
+
+    len = ngx_strlen(ie->name);
+
+    if (ie->mask & (IN_CREATE | IN_MOVED_TO))
+        event = "added";
+    else if (ie->mask & (IN_DELETE | IN_MOVED_FROM))
+        event = "removed";
+    else
+        event = "modified";
+
+    for (q = ngx_queue_head(&d->subscribers);
+         q != ngx_queue_sentinel(&d->subscribers);
+         q = next)
+    {
+        next = ngx_queue_next(q);
+        sub = ngx_queue_data(q, ngx_http_fancyindex_events_sub_t, queue);
+        r = sub->request;
+        alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+        if (!alcf->show_dot_files && ie->name[0] == '.')
+            continue;
+
+        if (ngx_http_fancyindex_ignored(alcf, (u_char *) ie->name, len,
+                                        r->connection->log))
+            continue;
+
+        /* Removed entries cannot be checked anymore. */
+        if (alcf->hide_symlinks && !(ie->mask & (IN_DELETE | IN_MOVED_FROM))) {
+            if (link == -1) {
+                link = 0;
+
+                if (d->path.len + 1 + len < NGX_MAX_PATH) {
+                    ngx_sprintf(path, "%V/%s%Z", &d->path, ie->name);
+                    link = ngx_link_info(path, &fi) != NGX_FILE_ERROR
+                           && ngx_is_link(&fi);
+                }
+            }
+
+            if (link)
+                continue;
+        }
+
+        if (ngx_http_fancyindex_events_add(sub, event, (u_char *) ie->name,
+                                           len, ie->mask & IN_ISDIR) != NGX_OK)
+            ngx_http_fancyindex_events_fail(sub);
+    }
+}
+
+
+/*
+ * Sends the events collected from a read of the inotify descriptor.
+ */
+static void
+ngx_http_fancyindex_events_flush(ngx_http_fancyindex_main_conf_t *amcf)
+{
+    ngx_http_fancyindex_events_dir_t *d;
+    ngx_http_fancyindex_events_sub_t *sub;
+    ngx_queue_t                      *dq, *q, *next;
+
+    for (dq = ngx_queue_head(&amcf->events_dirs);
+         dq != ngx_queue_sentinel(&amcf->events_dirs);
+         dq = ngx_queue_next(dq))
+    {
+        d = ngx_queue_data(dq, ngx_http_fancyindex_events_dir_t, queue);
+
+        for (q = ngx_queue_head(&d->subscribers);
+             q != ngx_queue_sentinel(&d->subscribers);
+             q = next)
+        {
+            next = ngx_queue_next(q);
+            sub = ngx_queue_data(q, ngx_http_fancyindex_events_sub_t, queue);
+
+            if (ngx_http_fancyindex_events_send(sub) != NGX_OK)
+                ngx_http_fancyindex_events_fail(sub);
+        }
+    }
+}
+
+
+static void
+ngx_http_fancyindex_events_read(ngx_event_t *rev)
+{
+    ngx_connection_t                 *c = rev->data;
+    ngx_http_fancyindex_main_conf_t  *amcf = c->data;
+    ngx_http_fancyindex_events_dir_t *d;
+    ngx_http_fancyindex_events_sub_t *sub;
+    struct inotify_event             *ie;
+    ngx_queue_t                      *dq, *q, *next;
+    ssize_t                           n;
+    ngx_err_t                         err;
+    u_char                           *p;
+    union {
+        struct inotify_event          event;
+        u_char                        data[4096];
+    } buf;
+
+    for ( ;; ) {
+        n = read(c->fd, buf.data, sizeof(buf.data));
+
+        if (n == -1) {
+            err = ngx_errno;
+
+            if (err == NGX_EINTR)
+                continue;
+
+            if (err != NGX_EAGAIN)
+                ngx_log_error(NGX_LOG_ALERT, rev->log, err,
+                              "read() from inotify failed");
+            break;
+        }
+
+        for (p = buf.data; p < buf.data + n;
+             p += sizeof(struct inotify_event) + ie->len)
+        {
+            ie = (struct inotify_event *) p;
+
+            if (ie->mask & IN_Q_OVERFLOW) {
+                /* Some events were lost, followers have to list again. */
+                ngx_log_error(NGX_LOG_WARN, rev->log, 0,
+                              "http fancyindex: inotify queue overflow");
+
+                for (dq = ngx_queue_head(&amcf->events_dirs);
+                     dq != ngx_queue_sentinel(&amcf->events_dirs);
+                     dq = ngx_queue_next(dq))
+                {
+                    d = ngx_queue_data(dq, ngx_http_fancyindex_events_dir_t,
+                                       queue);
+
+                    for (q = ngx_queue_head(&d->subscribers);
+                         q != ngx_queue_sentinel(&d->subscribers);
+                         q = next)
+                    {
+                        next = ngx_queue_next(q);
+                        sub = ngx_queue_data(q,
+                                ngx_http_fancyindex_events_sub_t, queue);
+
+                        if (ngx_http_fancyindex_events_add(sub, "reset",
+                                    (u_char *) "", 0, 0) != NGX_OK)
+                            ngx_http_fancyindex_events_fail(sub);
+                    }
+                }
+                continue;
+            }
+
+            if ((d = ngx_http_fancyindex_events_lookup(amcf, ie->wd)) == NULL)
+                continue;
+
+            if (ie->mask & IN_IGNORED) {
+                d->removed = 1;
+
+                while (!ngx_queue_empty(&d->subscribers)) {
+                    q = ngx_queue_head(&d->subscribers);
+                    ngx_http_fancyindex_events_end(
+                        ngx_queue_data(q, ngx_http_fancyindex_events_sub_t,
+                                       queue));
+                }
+
+                ngx_log_debug1(NGX_LOG_DEBUG_HTTP, rev->log, 0,
+                               "http fancyindex: events forget \"%s\"",
+                               d->path.data);
+
+                ngx_rbtree_delete(&amcf->events_rbtree, &d->node);
+                ngx_queue_remove(&d->queue);
+                amcf->events_nwatches--;
+                ngx_free(d);
+                continue;
+            }
+
+            if (ie->mask & (IN_DELETE_SELF | IN_MOVE_SELF)) {
+                /* The path does not lead to the directory anymore. */
+                while (!ngx_queue_empty(&d->subscribers)) {
+                    q = ngx_queue_head(&d->subscribers);
+                    ngx_http_fancyindex_events_end(
+                        ngx_queue_data(q, ngx_http_fancyindex_events_sub_t,
+                                       queue));
+                }
+                continue;
+            }
+
+            if (ie->len == 0 || ie->name[0] == '\0')
+                continue;
+
+            ngx_http_fancyindex_events_entry(d, ie);
+        }
+    }
+
+    ngx_http_fancyindex_events_flush(amcf);
+
+    if (ngx_handle_read_event(rev, 0) != NGX_OK) {
+        ngx_log_error(NGX_LOG_ALERT, rev->log, 0,
+                      "http fancyindex: cannot wait for inotify events");
+    }
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_events_start(ngx_http_fancyindex_main_conf_t *amcf,
+                                 ngx_log_t *log)
+{
+    ngx_connection_t *c;
+    int               fd;
+
+    fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+    if (fd == -1) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno, "inotify_init1() failed");
+        return NGX_ERROR;
+    }
+
+    if ((c = ngx_get_connection(fd, ngx_cycle->log)) == NULL) {
+        close(fd);
+        return NGX_ERROR;
+    }
+
+    c->data = amcf;
+    c->read->handler = ngx_http_fancyindex_events_read;
+    c->read->log = c->log;
+
+    if (ngx_handle_read_event(c->read, 0) != NGX_OK) {
+        ngx_close_connection(c);
+        return NGX_ERROR;
+    }
+
+    ngx_rbtree_init(&amcf->events_rbtree, &amcf->events_sentinel,
+                    ngx_rbtree_insert_value);
+    ngx_queue_init(&amcf->events_dirs);
+    amcf->events_connection = c;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Finds the watched directory at a path, or starts watching it. The same
+ * directory reached through another path shares the watch, as inotify
+ * gives it the same descriptor.
+ */
+static ngx_int_t
+ngx_http_fancyindex_events_watch(ngx_http_request_t *r,
+                                 ngx_http_fancyindex_main_conf_t *amcf,
+                                 ngx_str_t *path,
+                                 ngx_http_fancyindex_events_dir_t **pd)
+{
+    ngx_http_fancyindex_events_dir_t *d;
+    ngx_queue_t                      *q;
+    ngx_uint_t                        level;
+    ngx_int_t                         rc;
+    ngx_err_t                         err;
+    int                               wd;
+
+    for (q = ngx_queue_head(&amcf->events_dirs);
+         q != ngx_queue_sentinel(&amcf->events_dirs);
+         q = ngx_queue_next(q))
+    {
+        d = ngx_queue_data(q, ngx_http_fancyindex_events_dir_t, queue);
+
+        if (!d->removed && d->path.len == path->len
+            && ngx_strncmp(d->path.data, path->data, path->len) == 0)
+        {
+            *pd = d;
+            return NGX_OK;
+        }
+    }
+
+    if (amcf->events_nwatches >= amcf->events_watches) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "http fancyindex: %ui directories are watched "
+                      "already, see fancyindex_events_limit",
+                      amcf->events_nwatches);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    wd = inotify_add_watch(amcf->events_connection->fd,
+                           (const char *) path->data,
+                           NGX_HTTP_FANCYINDEX_EVENTS_MASK);
+    if (wd == -1) {
+        err = ngx_errno;
+
+        if (err == NGX_ENOENT || err == NGX_ENOTDIR) {
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_NOT_FOUND;
+        } else if (err == NGX_EACCES) {
+            level = NGX_LOG_ERR;
+            rc = NGX_HTTP_FORBIDDEN;
+        } else if (err == NGX_ENOSPC) {
+            /* Above fs.inotify.max_user_watches. */
+            level = NGX_LOG_WARN;
+            rc = NGX_HTTP_SERVICE_UNAVAILABLE;
+        } else {
+            level = NGX_LOG_CRIT;
+            rc = NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_log_error(level, r->connection->log, err,
+                      "inotify_add_watch(\"%s\") failed", path->data);
+        return rc;
+    }
+
+    d = ngx_http_fancyindex_events_lookup(amcf, wd);
+    if (d && !d->removed) {
+        *pd = d;
+        return NGX_OK;
+    }
+
+    d = ngx_alloc(sizeof(ngx_http_fancyindex_events_dir_t) + path->len + 1,
+                  r->connection->log);
+    if (d == NULL) {
+        (void) inotify_rm_watch(amcf->events_connection->fd, wd);
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    ngx_memzero(d, sizeof(ngx_http_fancyindex_events_dir_t));
+    d->path.data = (u_char *) (d + 1);
+    d->path.len = path->len;
+    ngx_cpystrn(d->path.data, path->data, path->len + 1);
+    ngx_queue_init(&d->subscribers);
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: events watch \"%s\", wd:%d",
+                   d->path.data, wd);
+
+    d->node.key = (ngx_rbtree_key_t) wd;
+    ngx_rbtree_insert(&amcf->events_rbtree, &d->node);
+    ngx_queue_insert_tail(&amcf->events_dirs, &d->queue);
+    amcf->events_nwatches++;
+
+    *pd = d;
+    return NGX_OK;
+}
+
+
+/*
+ * Starts following the changes of the directory of the request. Nothing
+ * is rendered, the events are sent by ngx_http_fancyindex_events_stream()
+ * in place of the listing.
+ */
+static ngx_int_t
+ngx_http_fancyindex_events_open(ngx_http_request_t *r,
+                                ngx_http_fancyindex_ctx_t *ctx,
+                                ngx_buf_t **pb)
+{
+    ngx_http_fancyindex_main_conf_t  *amcf;
+    ngx_http_fancyindex_events_dir_t *d;
+    ngx_http_fancyindex_events_sub_t *sub;
+    ngx_pool_cleanup_t               *cln;
+    ngx_int_t                         rc;
+
+    amcf = ngx_http_get_module_main_conf(r, ngx_http_fancyindex_module);
+
+    if (amcf->events_nsubscribers >= amcf->events_subscribers) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "http fancyindex: %ui clients follow events already, "
+                      "see fancyindex_events_limit",
+                      amcf->events_nsubscribers);
+        return NGX_HTTP_SERVICE_UNAVAILABLE;
+    }
+
+    if (amcf->events_connection == NULL
+        && ngx_http_fancyindex_events_start(amcf, r->connection->log) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if ((sub = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_events_sub_t))) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    sub->out = ngx_create_temp_buf(r->pool, NGX_HTTP_FANCYINDEX_EVENTS_BUFFER);
+    sub->pending = ngx_create_temp_buf(r->pool, NGX_HTTP_FANCYINDEX_EVENTS_BUFFER);
+    if (sub->out == NULL || sub->pending == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    rc = ngx_http_fancyindex_events_watch(r, amcf, &ctx->path, &d);
+    if (rc != NGX_OK)
+        return rc;
+
+    sub->request = r;
+    sub->amcf = amcf;
+    sub->dir = d;
+    ngx_queue_insert_tail(&d->subscribers, &sub->queue);
+    amcf->events_nsubscribers++;
+
+    cln->handler = ngx_http_fancyindex_events_cleanup;
+    cln->data = sub;
+    ctx->events = sub;
+
+    *pb = NULL;
+    return NGX_OK;
+}
+
+
+/*
+ * Sends the response to a request which follows a directory, which goes
+ * on until the client goes away or the directory does.
+ */
+static ngx_int_t
+ngx_http_fancyindex_events_stream(ngx_http_request_t *r,
+                                  ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_events_sub_t *sub = ctx->events;
+    ngx_int_t                         rc;
+
+    if (ngx_http_fancyindex_add_header(r, "Cache-Control",
+                                       (u_char *) "no-cache", 8) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = -1;
+    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/event-stream");
+    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/event-stream");
+    r->headers_out.content_type.data = (u_char *) "text/event-stream";
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    /* A comment, so that clients know the stream is open. */
+    sub->pending->last = ngx_cpymem_ssz(sub->pending->last, ":\n\n");
+
+    if (ngx_http_fancyindex_events_send(sub) != NGX_OK)
+        return NGX_ERROR;
+
+    r->main->count++;
+    r->read_event_handler = ngx_http_test_reading;
+    r->write_event_handler = ngx_http_fancyindex_events_write;
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Parses the "W" argument, which asks for the changes of the directory
+ * in locations with fancyindex_events.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_follow(ngx_http_request_t *r,
+                           ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_str_t value;
+
+    if (!alcf->events ||
+        ngx_http_arg(r, (u_char *) "W", 1, &value) != NGX_OK)
+        return 0;
+
+    return value.len == 1 && value.data[0] == '1';
+}
+
+#endif /* NGX_LINUX */
+
+
+/*
+ * Removes the entries modified before ctx->since, and adds the
+ * X-Fancyindex-Mtime header with the modification time of the directory,
+ * which clients can pass as "since" in the next request.
+ */
+static ngx_int_t
+ngx_http_fancyindex_filter_since(ngx_http_request_t *r,
+                                 ngx_http_fancyindex_ctx_t *ctx,
+                                 ngx_array_t *entries)
+{
+    ngx_http_fancyindex_entry_t *entry = entries->elts;
+    ngx_uint_t                   i, n;
+    u_char                       value[NGX_TIME_T_LEN], *last;
+
+    for (i = 0, n = 0; i < entries->nelts; i++) {
+        if (entry[i].mtime >= ctx->since)
+            entry[n++] = entry[i];
+    }
+    entries->nelts = n;
+
+    if (ctx->mtime == -1 && ngx_http_fancyindex_dir_info(r, ctx) != NGX_OK)
+        return NGX_OK;
+
+    last = ngx_sprintf(value, "%T", ctx->mtime);
+
+    return ngx_http_fancyindex_add_header(r, "X-Fancyindex-Mtime",
+                                          value, last - value);
+}
+
+
+static ngx_http_fancyindex_scan_limit_node_t *
+ngx_http_fancyindex_scan_limit_lookup(ngx_http_fancyindex_scan_limit_ctx_t *zctx,
+                                      ngx_rbtree_key_t dev)
+{
+    ngx_rbtree_node_t *node = zctx->sh->rbtree.root;
+    ngx_rbtree_node_t *sentinel = zctx->sh->rbtree.sentinel;
+
+    while (node != sentinel) {
+        if (dev == node->key)
+            return (ngx_http_fancyindex_scan_limit_node_t *) node;
+
+        node = (dev < node->key) ? node->left : node->right;
+    }
+
+    return NULL;
+}
+
+
+/*
+ * Gives back the slot of the request, or its place in the queue. Nodes
+ * are removed once nothing refers to them, the zone must be locked.
+ */
+static void
+ngx_http_fancyindex_scan_limit_put(ngx_http_fancyindex_scan_limit_ctx_t *zctx,
+                                   ngx_http_fancyindex_scan_limit_node_t *ln,
+                                   ngx_http_fancyindex_ctx_t *ctx)
+{
+    if (ctx->scan_slot)
+        ln->active--;
+    if (ctx->scan_queued)
+        ln->queued--;
+
+    ctx->scan_slot = 0;
+    ctx->scan_queued = 0;
+
+    if (ln->active == 0 && ln->queued == 0) {
+        ngx_rbtree_delete(&zctx->sh->rbtree, &ln->node);
+        ngx_slab_free_locked(zctx->shpool, ln);
+    }
+}
+
+
+/*
+ * Called as soon as the directory has been read, or when the request is
+ * done if that did not happen.
+ */
+static void
+ngx_http_fancyindex_scan_release(ngx_http_request_t *r,
+                                 ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_loc_conf_t        *alcf;
+    ngx_http_fancyindex_scan_limit_ctx_t  *zctx;
+    ngx_http_fancyindex_scan_limit_node_t *ln;
+
+    if (!ctx->scan_slot && !ctx->scan_queued)
+        return;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    zctx = alcf->scan_limit_zone->data;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    ln = ngx_http_fancyindex_scan_limit_lookup(zctx, ctx->scan_dev);
+    if (ln)
+        ngx_http_fancyindex_scan_limit_put(zctx, ln, ctx);
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    ctx->scan_slot = 0;
+    ctx->scan_queued = 0;
+}
+
+
+static void
+ngx_http_fancyindex_scan_limit_cleanup(void *data)
+{
+    ngx_http_request_t        *r = data;
+    ngx_http_fancyindex_ctx_t *ctx;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx->scan_wait.timer_set)
+        ngx_del_timer(&ctx->scan_wait);
+
+    ngx_http_fancyindex_scan_release(r, ctx);
+}
+
+
+/*
+ * Takes a slot to scan the directory. Returns NGX_OK when the scan may
+ * go ahead, NGX_DONE if the request has to wait for a slot, in which case
+ * ngx_http_fancyindex_scan_wait_handler() carries on, or NGX_BUSY if the
+ * queue is full or waiting timed out.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_admit(ngx_http_request_t *r,
+                               ngx_http_fancyindex_ctx_t *ctx,
+                               ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_scan_limit_ctx_t  *zctx;
+    ngx_http_fancyindex_scan_limit_node_t *ln;
+    ngx_pool_cleanup_t                    *cln;
+    ngx_file_info_t                        fi;
+    ngx_msec_t                             elapsed;
+    ngx_flag_t                             full;
+
+    if (alcf->scan_limit_zone == NULL || ctx->scan_slot)
+        return NGX_OK;
+
+    if (!ctx->scan_admit) {
+        /* Errors are reported by the scan itself. */
+        if (ngx_file_info(ctx->path.data, &fi) == NGX_FILE_ERROR)
+            return NGX_OK;
+
+#if !(NGX_WIN32)
+        ctx->scan_dev = (ngx_rbtree_key_t) fi.st_dev;
+#endif
+
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+        cln->handler = ngx_http_fancyindex_scan_limit_cleanup;
+        cln->data = r;
+
+        ctx->scan_start = ngx_current_msec;
+        ctx->scan_admit = 1;
+    }
+
+    zctx = alcf->scan_limit_zone->data;
+
+    ngx_shmtx_lock(&zctx->shpool->mutex);
+
+    ln = ngx_http_fancyindex_scan_limit_lookup(zctx, ctx->scan_dev);
+
+    if (ln == NULL) {
+        ln = ngx_slab_alloc_locked(zctx->shpool,
+                                   sizeof(ngx_http_fancyindex_scan_limit_node_t));
+        if (ln == NULL) {
+            /* Scanning is better than refusing to list anything. */
+            ngx_shmtx_unlock(&zctx->shpool->mutex);
+            return NGX_OK;
+        }
+
+        ngx_memzero(ln, sizeof(ngx_http_fancyindex_scan_limit_node_t));
+        ln->node.key = ctx->scan_dev;
+        ngx_rbtree_insert(&zctx->sh->rbtree, &ln->node);
+    }
+
+    if (ln->active < alcf->scan_limit && (ctx->scan_queued || ln->queued == 0)) {
+        if (ctx->scan_queued)
+            ln->queued--;
+
+        ln->active++;
+
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+        ctx->scan_queued = 0;
+        ctx->scan_slot = 1;
+        return NGX_OK;
+    }
+
+    elapsed = ngx_current_msec - ctx->scan_start;
+
+    full = ctx->scan_queued ? elapsed >= alcf->scan_limit_timeout
+                            : ln->queued >= alcf->scan_limit_queue;
+    if (full) {
+        ngx_http_fancyindex_scan_limit_put(zctx, ln, ctx);
+
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "http fancyindex: too many scans, not listing \"%V\"",
+                      &ctx->path);
+        return NGX_BUSY;
+    }
+
+    if (!ctx->scan_queued) {
+        ln->queued++;
+        ctx->scan_queued = 1;
+    }
+
+    ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: scan limit wait \"%V\"", &ctx->path);
+
+    ctx->scan_wait.handler = ngx_http_fancyindex_scan_wait_handler;
+    ctx->scan_wait.data = r;
+    ctx->scan_wait.log = r->connection->log;
+    ngx_add_timer(&ctx->scan_wait,
+                  ngx_min(NGX_HTTP_FANCYINDEX_SCAN_LIMIT_POLL,
+                          alcf->scan_limit_timeout - elapsed));
+    return NGX_DONE;
+}
+
+
+/*
+ * The directory cannot be scanned now: serve the cached listing however
+ * old it is, or ask the client to come back later.
+ */
+static ngx_int_t
+ngx_http_fancyindex_scan_busy(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_http_fancyindex_loc_conf_t *alcf,
+                              ngx_buf_t **pb)
+{
+    ngx_http_fancyindex_cache_ctx_t  *zctx;
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_int_t                         rc;
+    u_char                            value[NGX_TIME_T_LEN];
+    u_char                           *last;
+
+    /* The key is only known for listings which may be cached. */
+    if (alcf->cache_zone && ctx->cache_start) {
+        zctx = alcf->cache_zone->data;
+
+        ngx_shmtx_lock(&zctx->shpool->mutex);
+
+        cn = ngx_http_fancyindex_cache_lookup(zctx, ctx->cache_key);
+        if (cn && cn->stored
+            && (rc = ngx_http_fancyindex_cache_copy(r, zctx, cn, pb)) != NGX_DECLINED)
+        {
+            ngx_shmtx_unlock(&zctx->shpool->mutex);
+
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                           "http fancyindex: cache stale \"%V\", scan limited",
+                           &ctx->path);
+
+            ctx->cache_store = 0;
+            return (rc == NGX_OK) ? NGX_OK : NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+    }
+
+    last = ngx_sprintf(value, "%M",
+                       ngx_max(alcf->scan_limit_timeout / 1000, 1));
+
+    if (ngx_http_fancyindex_add_header(r, "Retry-After",
+                                       value, last - value) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    return NGX_HTTP_SERVICE_UNAVAILABLE;
+}
+
+
+/*
+ * Renders the listing once the entries are sorted, and saves it in the
+ * cache if it goes there.
+ */
+static ngx_int_t
+ngx_http_fancyindex_render_listing(ngx_http_request_t *r,
+                                   ngx_http_fancyindex_ctx_t *ctx,
+                                   ngx_http_fancyindex_loc_conf_t *alcf,
+                                   ngx_array_t *entries,
+                                   ngx_uint_t criterion,
+                                   const char *sort_url_args,
+                                   ngx_buf_t **pb)
+{
+#if !(NGX_HTTP_FANCYINDEX_USDT)
+    (void) criterion; /* unused */
+#endif
+
+    ngx_http_fancyindex_probe2(sort__end, criterion, entries->nelts);
+
+    if (ctx->cache_store && !ctx->limit.truncated)
+        ctx->cache_patch = ngx_http_fancyindex_cache_base(r->pool, alcf,
+                                                          ctx->cache_key);
+
+    *pb = ngx_http_fancyindex_render(r->pool, alcf, &r->uri,
+                                     entries->elts, entries->nelts,
+                                     sort_url_args, ctx->limit.truncated,
+                                     ctx->cache_patch);
+    if (*pb == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ngx_http_fancyindex_probe2(render, ctx->path.data, ngx_buf_size(*pb));
+
+    if (ctx->cache_store && !ctx->limit.truncated)
+        ngx_http_fancyindex_cache_put(r, ctx, alcf, *pb);
+
+    return NGX_OK;
+}
+
+
+#if (NGX_THREADS)
+
+/**
+ * A task of a parallel sort: sorts "a" in place if "dst" is NULL, or
+ * else merges "a" and "b" into "dst".
+ */
+typedef struct {
+    ngx_http_fancyindex_entry_t *a, *b, *dst;
+    ngx_uint_t                   na, nb;
+    ngx_http_fancyindex_cmp_pt   cmp;
+    ngx_flag_t                   dirs_first;
+} ngx_http_fancyindex_sort_task_t;
+
+
+static void
+ngx_http_fancyindex_sort_thread(void *data, ngx_log_t *log)
+{
+    ngx_http_fancyindex_sort_task_t *t = data;
+    ngx_http_fancyindex_entry_t     *a, *b, *dst;
+    ngx_uint_t                       i = 0, j = 0;
+
+    (void) log; /* unused */
+
+    if (t->dst == NULL) {
+        ngx_qsort(t->a, (size_t) t->na, sizeof(ngx_http_fancyindex_entry_t),
+                  t->cmp);
+        return;
+    }
+
+    a = t->a;
+    b = t->b;
+    dst = t->dst;
+
+    /*
+     * Runs hold either directories or files only, so with dirs_first a
+     * merge of the two puts directories first, as partitioning does.
+     */
+    while (i < t->na && j < t->nb) {
+        if (t->dirs_first && a[i].dir != b[j].dir) {
+            *dst++ = a[i].dir ? a[i++] : b[j++];
+        } else if (t->cmp(&b[j], &a[i]) < 0) {
+            *dst++ = b[j++];
+        } else {
+            *dst++ = a[i++];
+        }
+    }
+
+    ngx_memcpy(dst, a + i, (t->na - i) * sizeof(ngx_http_fancyindex_entry_t));
+    dst += t->na - i;
+    ngx_memcpy(dst, b + j, (t->nb - j) * sizeof(ngx_http_fancyindex_entry_t));
+}
+
+
+static void
+ngx_http_fancyindex_sort_event_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t        *r = ev->data;
+    ngx_http_fancyindex_ctx_t *ctx;
+    ngx_connection_t          *c;
+
+    c = r->connection;
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (--ctx->pending) {
+        return;
+    }
+
+    r->main->blocked--;
+    r->aio = 0;
+
+    r->write_event_handler(r);
+
+    ngx_http_run_posted_requests(c);
+}
+
+
+/*
+ * Runs a task in the thread pool, or right away if it cannot be posted.
+ */
+static ngx_int_t
+ngx_http_fancyindex_sort_post(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_http_fancyindex_sort_task_t *st)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_thread_task_t              *task;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    task = ngx_thread_task_alloc(r->pool, sizeof(ngx_http_fancyindex_sort_task_t));
+    if (task == NULL)
+        return NGX_ERROR;
+
+    ngx_memcpy(task->ctx, st, sizeof(ngx_http_fancyindex_sort_task_t));
+
+    task->handler = ngx_http_fancyindex_sort_thread;
+    task->event.data = r;
+    task->event.handler = ngx_http_fancyindex_sort_event_handler;
+
+    if (ngx_thread_task_post(alcf->thread_pool, task) != NGX_OK) {
+        ngx_http_fancyindex_sort_thread(task->ctx, r->connection->log);
+        return NGX_OK;
+    }
+
+    ctx->pending++;
+    return NGX_OK;
+}
+
+
+/*
+ * Number of entries of "b" which go before "e" when merging.
+ */
+static ngx_uint_t
+ngx_http_fancyindex_sort_rank(ngx_http_fancyindex_sort_t *sort,
+                              ngx_http_fancyindex_entry_t *e,
+                              ngx_http_fancyindex_entry_t *b, ngx_uint_t nb)
+{
+    ngx_uint_t lo = 0, hi = nb, mid;
+    ngx_int_t  before;
+
+    while (lo < hi) {
+        mid = lo + (hi - lo) / 2;
+
+        if (sort->dirs_first && b[mid].dir != e->dir)
+            before = b[mid].dir ? 1 : 0;
+        else
+            before = sort->cmp(&b[mid], e) < 0;
+
+        if (before)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+
+    return lo;
+}
+
+
+/*
+ * Posts the tasks of the next round: sorting the runs, or merging them in
+ * pairs, each pair split into pieces at entries of the first run and the
+ * positions where they go in the second. Returns NGX_OK once there is a
+ * single sorted run, or NGX_DONE if tasks are pending.
+ */
+static ngx_int_t
+ngx_http_fancyindex_sort_round(ngx_http_request_t *r,
+                               ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_sort_t      *sort = ctx->sort;
+    ngx_http_fancyindex_sort_task_t  st;
+    ngx_http_fancyindex_entry_t     *a, *b, *tmp;
+    ngx_uint_t                       i, k, q, pieces, na, nb, ia, ja, ib, jb;
+
+    while (!ctx->pending) {
+        ngx_memzero(&st, sizeof(ngx_http_fancyindex_sort_task_t));
+        st.cmp = sort->cmp;
+        st.dirs_first = sort->dirs_first;
+
+        if (!sort->sorted) {
+            for (i = 0; i < sort->nruns; i++) {
+                st.a = sort->src + sort->runs[i];
+                st.na = sort->runs[i + 1] - sort->runs[i];
+
+                if (ngx_http_fancyindex_sort_post(r, ctx, &st) != NGX_OK)
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+
+            sort->sorted = 1;
+            continue;
+        }
+
+        if (sort->nruns == 1) {
+            /* The result may be in the other array. */
+            sort->entries->elts = sort->src;
+            sort->entries->nalloc = sort->entries->nelts;
+            return NGX_OK;
+        }
+
+        pieces = ngx_max(1, NGX_HTTP_FANCYINDEX_SORT_TASKS / (sort->nruns / 2));
+
+        for (i = 0, k = 0; i < sort->nruns; i += 2, k++) {
+            a = sort->src + sort->runs[i];
+            na = sort->runs[i + 1] - sort->runs[i];
+
+            if (i + 1 < sort->nruns) {
+                b = sort->src + sort->runs[i + 1];
+                nb = sort->runs[i + 2] - sort->runs[i + 1];
+            } else {
+                b = NULL;
+                nb = 0;
+            }
+
+            for (q = 0, ia = 0, ib = 0; q < pieces; q++) {
+                if (q + 1 < pieces && nb) {
+                    ja = na * (q + 1) / pieces;
+                    jb = (ja < na)
+                         ? ngx_http_fancyindex_sort_rank(sort, &a[ja], b, nb)
+                         : nb;
+                } else {
+                    ja = na;
+                    jb = nb;
+                }
+
+                if (ja == ia && jb == ib)
+                    continue;
+
+                st.a = a + ia;
+                st.na = ja - ia;
+                st.b = b + ib;
+                st.nb = jb - ib;
+                st.dst = sort->dst + sort->runs[i] + ia + ib;
+
+                if (ngx_http_fancyindex_sort_post(r, ctx, &st) != NGX_OK)
+                    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+                ia = ja;
+                ib = jb;
+
+                if (nb == 0)
+                    break;
+            }
+
+            sort->runs[k] = sort->runs[i];
+        }
+
+        sort->runs[k] = sort->runs[sort->nruns];
+        sort->nruns = k;
+
+        tmp = sort->src;
+        sort->src = sort->dst;
+        sort->dst = tmp;
+    }
+
+    r->main->blocked++;
+    r->aio = 1;
+    r->write_event_handler = ngx_http_fancyindex_sort_resume;
+
+    return NGX_DONE;
+}
+
+
+/*
+ * Starts sorting the entries in the thread pool. Returns NGX_DONE if the
+ * response is sent by ngx_http_fancyindex_sort_resume() once sorted,
+ * NGX_OK if everything was done right away, or NGX_DECLINED to sort them
+ * in the worker process if there is not enough memory.
+ */
+static ngx_int_t
+ngx_http_fancyindex_sort_start(ngx_http_request_t *r,
+                               ngx_http_fancyindex_ctx_t *ctx,
+                               ngx_http_fancyindex_loc_conf_t *alcf,
+                               ngx_array_t *entries,
+                               ngx_uint_t criterion,
+                               const char *sort_url_args)
+{
+    ngx_http_fancyindex_sort_t   *sort;
+    ngx_http_fancyindex_entry_t  *entry = entries->elts;
+    ngx_uint_t                    i, n = entries->nelts, ndirs = n, start;
+
+    sort = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_sort_t));
+    if (sort == NULL)
+        return NGX_DECLINED;
+
+    sort->dst = ngx_palloc(r->pool, n * sizeof(ngx_http_fancyindex_entry_t));
+    if (sort->dst == NULL)
+        return NGX_DECLINED;
+
+    sort->entries = entries;
+    sort->src = entry;
+    sort->cmp = ngx_http_fancyindex_sort_cmp(criterion, alcf->case_sensitive);
+    sort->criterion = criterion;
+    sort->sort_url_args = sort_url_args;
+    sort->dirs_first = alcf->dirs_first ? 1 : 0;
+
+    if (alcf->dirs_first)
+        ndirs = ngx_http_fancyindex_partition_dirs(entry, n);
+
+    /* Runs of about the same size, not mixing directories and files. */
+    for (i = 0; i < NGX_HTTP_FANCYINDEX_SORT_TASKS; i++) {
+        start = n * i / NGX_HTTP_FANCYINDEX_SORT_TASKS;
+
+        if (sort->nruns && sort->runs[sort->nruns - 1] < ndirs && start > ndirs)
+            sort->runs[sort->nruns++] = ndirs;
+
+        if (sort->nruns == 0 || start > sort->runs[sort->nruns - 1])
+            sort->runs[sort->nruns++] = start;
+    }
+
+    if (sort->runs[sort->nruns - 1] < ndirs && ndirs < n)
+        sort->runs[sort->nruns++] = ndirs;
+
+    sort->runs[sort->nruns] = n;
+
+    ngx_log_debug2(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: parallel sort of %ui entries, %ui runs",
+                   n, sort->nruns);
+
+    ctx->sort = sort;
+
+    return ngx_http_fancyindex_sort_round(r, ctx);
+}
+
+#endif /* NGX_THREADS */
+
+
+static ngx_int_t
+make_listing_buf(
+        ngx_http_request_t *r, ngx_buf_t **pb,
+        ngx_http_fancyindex_loc_conf_t *alcf, ngx_array_t *entries)
+{
+    ngx_http_fancyindex_ctx_t *ctx;
+    ngx_uint_t  criterion;
+    ngx_int_t   rc;
+    const char *sort_url_args;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    ngx_http_fancyindex_scan_release(r, ctx);
+
+    ngx_http_fancyindex_probe3(scan__end, ctx->path.data, entries->nelts,
+                               ctx->limit.truncated);
+
+    if (ctx->since != -1 &&
+        ngx_http_fancyindex_filter_since(r, ctx, entries) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (ctx->limit.truncated) {
+        ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                      "http fancyindex: listing of \"%V\" truncated "
+                      "after %ui entries", &ctx->path, entries->nelts);
+
+        if (ngx_http_fancyindex_add_header(r, "X-Fancyindex-Truncated",
+                                           (u_char *) "1", 1) != NGX_OK)
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+
+    if (ctx->archive) {
+        /* Archives are always ordered by name, parents before children. */
+        ngx_http_fancyindex_sort_entries(entries->elts, entries->nelts,
+                ngx_http_fancyindex_cmp_entries_name_cs_asc, 0);
+        *pb = NULL;
+        return NGX_OK;
+    }
+
+#if (NGX_THREADS)
+    if (alcf->checksum_zone &&
+        ngx_http_fancyindex_checksums(r, ctx, alcf, entries) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+#endif
+
+    criterion = ngx_http_fancyindex_sort_criterion(r, alcf, &sort_url_args);
+
+    ngx_http_fancyindex_probe2(sort__start, criterion, entries->nelts);
+
+    rc = NGX_DECLINED;
+
+#if (NGX_THREADS)
+    if (criterion != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE
+        && alcf->parallel_sort && entries->nelts >= alcf->parallel_sort)
+    {
+        rc = ngx_http_fancyindex_sort_start(r, ctx, alcf, entries, criterion,
+                                            sort_url_args);
+        if (rc == NGX_DONE || rc == NGX_HTTP_INTERNAL_SERVER_ERROR)
+            return rc;
+    }
+#endif
+
+    if (rc == NGX_DECLINED
+        && criterion != NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE)
+    {
+        ngx_http_fancyindex_sort_entries(entries->elts, entries->nelts,
+                ngx_http_fancyindex_sort_cmp(criterion, alcf->case_sensitive),
+                alcf->dirs_first);
+    }
+
+    return ngx_http_fancyindex_render_listing(r, ctx, alcf, entries,
+                                              criterion, sort_url_args, pb);
+}
+
+
+static ngx_int_t make_listing(ngx_http_request_t *r, ngx_buf_t **pb,
+    ngx_http_fancyindex_loc_conf_t *alcf);
+
+
+static void
+ngx_http_fancyindex_stream_cleanup(void *data)
+{
+    ngx_http_fancyindex_stream_t *st = data;
+
+    if (st->open && ngx_close_dir(&st->dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, st->pool->log, ngx_errno,
+                      ngx_close_dir_n " failed");
+    }
+
+    ngx_destroy_pool(st->pool);
+}
+
+
+/*
+ * Unsorted listings are not accumulated: the directory is opened here,
+ * and its entries are rendered and sent in batches as they are read by
+ * ngx_http_fancyindex_stream_write(). The buffer for the beginning of the
+ * table is returned in "pb".
+ */
+static ngx_int_t
+ngx_http_fancyindex_stream_open(ngx_http_request_t *r,
+                                ngx_http_fancyindex_ctx_t *ctx,
+                                ngx_http_fancyindex_loc_conf_t *alcf,
+                                const char *sort_url_args,
+                                ngx_buf_t **pb)
+{
+    ngx_http_fancyindex_stream_t *st;
+    ngx_pool_cleanup_t           *cln;
+    ngx_buf_t                    *b;
+    ngx_int_t                     rc;
+
+    ctx->scan_stream = 1;
+
+    rc = ngx_http_fancyindex_scan_admit(r, ctx, alcf);
+    if (rc == NGX_BUSY)
+        return ngx_http_fancyindex_scan_busy(r, ctx, alcf, pb);
+    if (rc != NGX_OK)
+        return rc;
+
+    if ((st = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_stream_t))) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (ngx_array_init(&st->entries, r->pool, NGX_HTTP_FANCYINDEX_STREAM_BATCH,
+                       sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if ((st->pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, r->connection->log)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    cln->handler = ngx_http_fancyindex_stream_cleanup;
+    cln->data = st;
+
+    ngx_http_fancyindex_limit_init(&ctx->limit, alcf, 0);
+
+    ngx_http_fancyindex_probe2(scan__start, ctx->path.data, 0);
+
+    rc = ngx_http_fancyindex_open_dir(r->connection->log, &ctx->path, &st->dir);
+    if (rc != NGX_OK)
+        return rc;
+
+    st->open = 1;
+    st->sort_url_args = sort_url_args;
+
+    b = ngx_create_temp_buf(r->pool, ngx_http_fancyindex_head_len(alcf, &r->uri));
+    if (b == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    b->last = ngx_http_fancyindex_render_head(b->last, alcf, &r->uri,
+                                              sort_url_args);
+
+    ctx->stream = st;
+    *pb = b;
+
+    return NGX_OK;
+}
+
+
+static const struct {
+    time_t      age;
+    const char *label;
+} ngx_http_fancyindex_summary_ages[NGX_HTTP_FANCYINDEX_SUMMARY_AGES] = {
+    { 3600,                 "Last hour"  },
+    { 86400,                "Last day"   },
+    { 7 * 86400,            "Last week"  },
+    { 30 * 86400,           "Last month" },
+    { 365 * 86400,          "Last year"  },
+    { NGX_MAX_TIME_T_VALUE, "Older"      },
+};
+
+
+/*
+ * Parses the "P" argument, which restricts listings of locations with
+ * fancyindex_summary_threshold to entries starting with a prefix, and is
+ * used by the links of summaries.
+ */
+static ngx_int_t
+ngx_http_fancyindex_prefix(ngx_http_request_t *r, ngx_str_t *prefix)
+{
+    ngx_str_t  value;
+    u_char    *dst, *src;
+
+    ngx_str_null(prefix);
+
+    if (ngx_http_arg(r, (u_char *) "P", 1, &value) != NGX_OK || value.len == 0)
+        return NGX_OK;
+
+    if ((dst = ngx_pnalloc(r->pool, value.len)) == NULL)
+        return NGX_ERROR;
+
+    prefix->data = dst;
+    src = value.data;
+    ngx_unescape_uri(&dst, &src, value.len, 0);
+    prefix->len = dst - prefix->data;
+
+    return NGX_OK;
+}
+
+
+static ngx_inline void
+ngx_http_fancyindex_summary_count(ngx_http_fancyindex_summary_group_t *group,
+                                  ngx_http_fancyindex_entry_t *entry)
+{
+    group->count++;
+    if (!entry->dir)
+        group->size += entry->size;
+}
+
+
+static void
+ngx_http_fancyindex_summary_add(ngx_http_fancyindex_summary_t *sm,
+                                size_t prefix_len,
+                                ngx_http_fancyindex_entry_t *entry,
+                                ngx_uint_t nentries)
+{
+    ngx_http_fancyindex_summary_group_t *group;
+    ngx_uint_t                           i, j;
+    u_char                              *name, *dot;
+    size_t                               len;
+    time_t                               now = ngx_time();
+
+    for (i = 0; i < nentries; i++) {
+        name = entry[i].name.data;
+        len = entry[i].name.len;
+
+        ngx_http_fancyindex_summary_count(&sm->total, &entry[i]);
+
+        sm->next[len > prefix_len ? ngx_tolower(name[prefix_len]) : 0]++;
+
+        for (j = 0; j < NGX_HTTP_FANCYINDEX_SUMMARY_AGES - 1
+                    && now - entry[i].mtime >= ngx_http_fancyindex_summary_ages[j].age;
+             j++)
+            /* void */ ;
+        ngx_http_fancyindex_summary_count(&sm->ages[j], &entry[i]);
+
+        if (entry[i].dir) {
+            ngx_http_fancyindex_summary_count(&sm->dirs, &entry[i]);
+            continue;
+        }
+
+        /* The leading dot of hidden files does not start an extension. */
+        for (dot = name + len - 1; dot > name && *dot != '.'; dot--)
+            /* void */ ;
+
+        len = name + len - dot - 1;
+
+        if (dot == name || len == 0) {
+            group = &sm->untyped;
+
+        } else if (len > NGX_HTTP_FANCYINDEX_SUMMARY_TYPE_LEN) {
+            group = &sm->other;
+
+        } else {
+            for (j = 0; j < sm->ntypes; j++) {
+                if (sm->types[j].len == len
+                    && ngx_strncasecmp(sm->types[j].name, dot + 1, len) == 0)
+                    break;
+            }
+
+            if (j == sm->ntypes && j < NGX_HTTP_FANCYINDEX_SUMMARY_TYPES) {
+                ngx_strlow(sm->types[j].name, dot + 1, len);
+                sm->types[j].len = len;
+                sm->ntypes++;
+            }
+
+            group = j < sm->ntypes ? &sm->types[j] : &sm->other;
+        }
+
+        ngx_http_fancyindex_summary_count(group, &entry[i]);
+    }
+}
+
+
+/*
+ * Reads the directory being listed in a location with
+ * fancyindex_summary_threshold. Entries are kept in ctx->entries as long
+ * as there are no more than the threshold, to render a listing as usual.
+ * After that they are only added up into ctx->summary, reading them in
+ * batches into a pool which is reset after each one, so the memory used
+ * does not depend on the size of the directory.
+ */
+static ngx_int_t
+ngx_http_fancyindex_summary_scan(ngx_http_request_t *r,
+                                 ngx_http_fancyindex_ctx_t *ctx,
+                                 ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_summary_t *sm;
+    ngx_log_t                     *log = r->connection->log;
+    ngx_array_t                    batch;
+    ngx_pool_t                    *pool;
+    ngx_dir_t                      dir;
+    ngx_int_t                      rc;
+
+    if ((rc = ngx_http_fancyindex_open_dir(log, &ctx->path, &dir)) != NGX_OK)
+        return rc;
+
+    /* Errors close the directory. */
+    rc = ngx_http_fancyindex_read_entries(r->pool, log, alcf, &dir,
+            &ctx->path, ctx->allocated, NULL,
+            ctx->flags | NGX_HTTP_FANCYINDEX_SCAN_IGNORE, &ctx->limit,
+            &ctx->entries, alcf->summary_threshold + 1);
+
+    if (rc == NGX_AGAIN) {
+        sm = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_summary_t));
+        if (sm == NULL)
+            goto failed;
+
+        if (ngx_array_init(&batch, r->pool, NGX_HTTP_FANCYINDEX_STREAM_BATCH,
+                           sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+            goto failed;
+
+        if ((pool = ngx_create_pool(NGX_DEFAULT_POOL_SIZE, log)) == NULL)
+            goto failed;
+
+        ngx_http_fancyindex_summary_add(sm, ctx->prefix.len,
+                                        ctx->entries.elts, ctx->entries.nelts);
+        ctx->limit.read = ctx->entries.nelts;
+        ctx->entries.nelts = 0;
+        ctx->summary = sm;
+
+        do {
+            rc = ngx_http_fancyindex_read_entries(pool, log, alcf, &dir,
+                    &ctx->path, ctx->allocated, NULL,
+                    ctx->flags | NGX_HTTP_FANCYINDEX_SCAN_IGNORE, &ctx->limit,
+                    &batch, NGX_HTTP_FANCYINDEX_STREAM_BATCH);
+
+            if (rc != NGX_OK && rc != NGX_AGAIN)
+                break;
+
+            ngx_http_fancyindex_summary_add(sm, ctx->prefix.len,
+                                            batch.elts, batch.nelts);
+            ctx->limit.read += batch.nelts;
+            batch.nelts = 0;
+            ngx_reset_pool(pool);
+        } while (rc == NGX_AGAIN);
+
+        ngx_destroy_pool(pool);
+    }
+
+    if (rc != NGX_OK)
+        return rc;
+
+    if (ngx_close_dir(&dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", &ctx->path);
+    }
+
+    return NGX_OK;
+
+failed:
+    (void) ngx_close_dir(&dir);
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+
+/*
+ * Writes the value of the "P" argument for the prefix followed by "c".
+ */
+static u_char *
+ngx_http_fancyindex_summary_arg(u_char *p, ngx_str_t *prefix, u_char c)
+{
+    static const u_char  hex[] = "0123456789ABCDEF";
+    ngx_uint_t           i;
+
+    for (i = 0; i <= prefix->len; i++) {
+        u_char ch = (i < prefix->len) ? prefix->data[i] : c;
+
+        if ((ch >= 'a' && ch <= 'z') || (ch >= 'A' && ch <= 'Z')
+            || (ch >= '0' && ch <= '9') || ch == '-' || ch == '.' || ch == '_')
+        {
+            *p++ = ch;
+        } else {
+            *p++ = '%';
+            *p++ = hex[ch >> 4];
+            *p++ = hex[ch & 0xf];
+        }
+    }
+
+    return p;
+}
+
+
+static u_char *
+ngx_http_fancyindex_summary_row(u_char *p, const char *label,
+                                ngx_http_fancyindex_summary_group_t *group,
+                                ngx_flag_t size)
+{
+    if (group->count == 0)
+        return p;
+
+    p = ngx_sprintf(p, "<tr><td>%s</td><td>%ui</td>", label, group->count);
+
+    return size ? ngx_sprintf(p, "<td>%O</td></tr>" CRLF, group->size)
+                : ngx_cpymem_ssz(p, "<td>-</td></tr>" CRLF);
+}
+
+
+#define NGX_HTTP_FANCYINDEX_SUMMARY_ROW_LEN                                   \
+    (ngx_sizeof_ssz("<tr><td></td><td></td><td></td></tr>" CRLF)              \
+     + 20 + NGX_INT_T_LEN + NGX_OFF_T_LEN)
+
+
+/*
+ * Renders the summary in place of the listing table.
+ */
+static ngx_int_t
+ngx_http_fancyindex_summary_render(ngx_http_request_t *r,
+                                   ngx_http_fancyindex_ctx_t *ctx,
+                                   ngx_http_fancyindex_loc_conf_t *alcf,
+                                   ngx_buf_t **pb)
+{
+    ngx_http_fancyindex_summary_t *sm = ctx->summary;
+    ngx_buf_t                     *b;
+    ngx_uint_t                     i;
+    u_char                         label[8 + 6 * NGX_HTTP_FANCYINDEX_SUMMARY_TYPE_LEN];
+    u_char                        *p, c;
+    size_t                         len;
+
+    ngx_http_fancyindex_scan_release(r, ctx);
+
+    ngx_http_fancyindex_probe3(scan__end, ctx->path.data, sm->total.count,
+                               ctx->limit.truncated);
+
+    if (ctx->limit.truncated
+        && ngx_http_fancyindex_add_header(r, "X-Fancyindex-Truncated",
+                                          (u_char *) "1", 1) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    len = r->uri.len * 6 + ngx_sizeof_ssz(t05_body2)
+          + ngx_sizeof_ssz("<p class=\"summary\">There are  entries starting "
+                           "with &ldquo;&rdquo;, too many to list them.</p>" CRLF)
+          + NGX_INT_T_LEN + ctx->prefix.len * 6
+          + ngx_sizeof_ssz("<p class=\"truncated\">Only the first  entries "
+                           "were counted.</p>" CRLF) + NGX_INT_T_LEN
+          + 2 * ngx_sizeof_ssz("<table class=\"summary\"><thead><tr>"
+                               "<th>Modified</th><th>Entries</th><th>Size</th>"
+                               "</tr></thead>" CRLF "<tbody>"
+                               "</tbody></table>" CRLF)
+          + (NGX_HTTP_FANCYINDEX_SUMMARY_TYPES + 4
+             + NGX_HTTP_FANCYINDEX_SUMMARY_AGES)
+            * (NGX_HTTP_FANCYINDEX_SUMMARY_ROW_LEN + sizeof(label))
+          + ngx_sizeof_ssz("<p class=\"jump\">" "</p>" CRLF)
+          + 256 * (ngx_sizeof_ssz("<a href=\"?P=\">&quot;</a> () " CRLF)
+                   + 3 * (ctx->prefix.len + 1) + NGX_INT_T_LEN);
+
+    if ((b = ngx_create_temp_buf(r->pool, len)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    p = b->last;
+
+    if (alcf->show_path) {
+        p = (u_char *) ngx_escape_html(p, r->uri.data, r->uri.len);
+        p = ngx_cpymem_ssz(p, t05_body2);
+    }
+
+    p = ngx_sprintf(p, "<p class=\"summary\">There are %ui entries",
+                    sm->total.count);
+    if (ctx->prefix.len) {
+        p = ngx_cpymem_ssz(p, " starting with &ldquo;");
+        p = (u_char *) ngx_escape_html(p, ctx->prefix.data, ctx->prefix.len);
+        p = ngx_cpymem_ssz(p, "&rdquo;");
+    }
+    p = ngx_cpymem_ssz(p, ", too many to list them.</p>" CRLF);
+
+    if (ctx->limit.truncated) {
+        p = ngx_sprintf(p, "<p class=\"truncated\">Only the first %ui entries "
+                        "were counted.</p>" CRLF, sm->total.count);
+    }
+
+    p = ngx_cpymem_ssz(p, "<table class=\"summary\"><thead><tr>"
+                          "<th>Type</th><th>Entries</th><th>Size</th>"
+                          "</tr></thead>" CRLF "<tbody>");
+    p = ngx_http_fancyindex_summary_row(p, "Directories", &sm->dirs, 0);
+    for (i = 0; i < sm->ntypes; i++) {
+        label[0] = '.';
+        *((u_char *) ngx_escape_html(label + 1, sm->types[i].name,
+                                     sm->types[i].len)) = '\0';
+        p = ngx_http_fancyindex_summary_row(p, (const char *) label,
+                                            &sm->types[i], 1);
+    }
+    p = ngx_http_fancyindex_summary_row(p, "Other", &sm->other, 1);
+    p = ngx_http_fancyindex_summary_row(p, "No extension", &sm->untyped, 1);
+    p = ngx_http_fancyindex_summary_row(p, "Total", &sm->total, 1);
+    p = ngx_cpymem_ssz(p, "</tbody></table>" CRLF);
+
+    p = ngx_cpymem_ssz(p, "<table class=\"summary\"><thead><tr>"
+                          "<th>Modified</th><th>Entries</th><th>Size</th>"
+                          "</tr></thead>" CRLF "<tbody>");
+    for (i = 0; i < NGX_HTTP_FANCYINDEX_SUMMARY_AGES; i++) {
+        p = ngx_http_fancyindex_summary_row(p,
+                ngx_http_fancyindex_summary_ages[i].label, &sm->ages[i], 1);
+    }
+    p = ngx_cpymem_ssz(p, "</tbody></table>" CRLF);
+
+    /* Entries equal to the prefix, counted in next[0], have no link. */
+    p = ngx_cpymem_ssz(p, "<p class=\"jump\">");
+    for (i = 1; i < 256; i++) {
+        if (sm->next[i] == 0)
+            continue;
+
+        p = ngx_cpymem_ssz(p, "<a href=\"?P=");
+        p = ngx_http_fancyindex_summary_arg(p, &ctx->prefix, (u_char) i);
+        p = ngx_cpymem_ssz(p, "\">");
+
+        c = (u_char) i;
+        if (c > 0x20 && c < 0x7f) {
+            p = (u_char *) ngx_escape_html(p, &c, 1);
+        } else {
+            p = ngx_sprintf(p, "%%%02Xui", i);
+        }
+
+        p = ngx_sprintf(p, "</a> (%ui) " CRLF, sm->next[i]);
+    }
+    p = ngx_cpymem_ssz(p, "</p>" CRLF);
+
+    b->last = p;
+    *pb = b;
+
+    return NGX_OK;
+}
+
+
+/*
+ * Returns NGX_DONE if the directory is being scanned asynchronously, in
+ * which case the response is sent by ngx_http_fancyindex_scan_resume(),
+ * if waiting for a cached listing, which is sent by
+ * ngx_http_fancyindex_cache_wait_handler(), or if waiting for a scan slot,
+ * see ngx_http_fancyindex_scan_wait_handler().
+ */
+static ngx_inline ngx_int_t
+make_content_buf(
+        ngx_http_request_t *r, ngx_buf_t **pb,
+        ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_ctx_t *ctx;
+    const char *sort_url_args;
+    ngx_uint_t  criterion;
+    u_char    *last;
+    size_t     root;
+    ngx_int_t  rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    /*
+     * NGX_DIR_MASK_LEN is lesser than NGX_HTTP_FANCYINDEX_PREALLOCATE
+     */
+    if ((last = ngx_http_map_uri_to_path(r, &ctx->path, &root,
+                    NGX_HTTP_FANCYINDEX_PREALLOCATE)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    ctx->allocated = ctx->path.len;
+    ctx->path.len = last - ctx->path.data;
+    if (ctx->path.len > 1) {
+        ctx->path.len--;
+    }
+    ctx->path.data[ctx->path.len] = '\0';
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: \"%s\"", ctx->path.data);
+
+#if (NGX_LINUX)
+    if (ngx_http_fancyindex_follow(r, alcf))
+        return ngx_http_fancyindex_events_open(r, ctx, pb);
+#endif
+
+#if (NGX_SUPPRESS_WARN)
+    /* MSVC thinks 'entries' may be used without having been initialized */
+    ngx_memzero(&ctx->entries, sizeof(ngx_array_t));
+#endif /* NGX_SUPPRESS_WARN */
+
+    if (ngx_array_init(&ctx->entries, r->pool, 40,
+                sizeof(ngx_http_fancyindex_entry_t)) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    if (r->headers_out.charset.len == 5 &&
+        ngx_strncasecmp(r->headers_out.charset.data, (u_char*) "utf-8", 5) == 0)
+        ctx->flags |= NGX_HTTP_FANCYINDEX_SCAN_UTF8;
+
+    ctx->depth = ngx_http_fancyindex_depth(r, alcf);
+    ctx->since = ngx_http_fancyindex_since(r);
+    ctx->mtime = -1;
+    ctx->archive = ngx_http_fancyindex_archive(r, alcf);
+
+    /* Views of parts of directories are for summaries only. */
+    if (alcf->summary_threshold && ctx->depth == 0 && ctx->since == -1
+        && !ctx->archive
+        && ngx_http_fancyindex_prefix(r, &ctx->prefix) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    /*
+     * Unsorted listings are streamed, unless they need all the entries
+     * anyway, to filter or to add them to an archive or a checksum zone.
+     */
+    criterion = ngx_http_fancyindex_sort_criterion(r, alcf, &sort_url_args);
+
+    if (criterion == NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE
+        && ctx->depth == 0 && ctx->since == -1 && !ctx->archive
+        && alcf->checksum_zone == NULL && ctx->prefix.len == 0)
+    {
+        return ngx_http_fancyindex_stream_open(r, ctx, alcf, sort_url_args, pb);
+    }
+
+    /*
+     * Partial listings, and those which show checksums that may be still
+     * pending, are not cached.
+     */
+    if (alcf->cache_zone && ctx->depth == 0 && ctx->since == -1
+        && alcf->checksum_zone == NULL && !ctx->archive && ctx->prefix.len == 0)
+    {
+        rc = ngx_http_fancyindex_cache_get(r, ctx, alcf, pb);
+        if (rc != NGX_DECLINED)
+            return rc;
+    }
+
+    return make_listing(r, pb, alcf);
+}
+
+
+/*
+ * Scans the directory and renders the listing.
+ */
+static ngx_int_t
+make_listing(
+        ngx_http_request_t *r, ngx_buf_t **pb,
+        ngx_http_fancyindex_loc_conf_t *alcf)
+{
+    ngx_http_fancyindex_ctx_t *ctx;
+    ngx_int_t  rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    rc = ngx_http_fancyindex_scan_admit(r, ctx, alcf);
+    if (rc == NGX_BUSY)
+        return ngx_http_fancyindex_scan_busy(r, ctx, alcf, pb);
+    if (rc != NGX_OK)
+        return rc;
+
+    ngx_http_fancyindex_limit_init(&ctx->limit, alcf, ctx->depth != 0);
+
+    ngx_http_fancyindex_probe2(scan__start, ctx->path.data, ctx->depth);
+
+    if (ctx->depth) {
+        rc = ngx_http_fancyindex_scan_tree(r, ctx);
+    } else if (alcf->summary_threshold && ctx->since == -1 && !ctx->archive) {
+        /* Index files and the scan cache keep whole directories. */
+        ctx->limit.prefix = ctx->prefix;
+        rc = ngx_http_fancyindex_summary_scan(r, ctx, alcf);
+
+        if (rc == NGX_OK && ctx->summary)
+            return ngx_http_fancyindex_summary_render(r, ctx, alcf, pb);
+    } else {
+        rc = NGX_DECLINED;
+
+        if (alcf->scan_cache)
+            rc = ngx_http_fancyindex_scan_cached(r, ctx, alcf);
+
+        if (rc == NGX_DECLINED)
+            rc = ngx_http_fancyindex_load_dir(r, ctx, alcf, r->pool,
+                                              &ctx->entries);
+    }
+
+    if (rc != NGX_OK)
+        return rc;
+
+    return make_listing_buf(r, pb, alcf, &ctx->entries);
+}
+
+
+static u_char ngx_http_fancyindex_tar_zero[2 * NGX_HTTP_FANCYINDEX_TAR_BLOCK];
+
+
+/*
+ * Writes a number into a field of a tar header: in octal followed by a
+ * NUL if it fits, or in the base-256 encoding of GNU tar otherwise.
+ */
+static void
+ngx_http_fancyindex_tar_number(u_char *p, size_t len, uint64_t value)
+{
+    size_t i;
+
+    if (value >> (3 * (len - 1))) {
+        for (i = len - 1; i > 0; i--) {
+            p[i] = (u_char) (value & 0xff);
+            value >>= 8;
+        }
+        p[0] = 0x80;
+        return;
+    }
+
+    p[len - 1] = '\0';
+    for (i = len - 1; i-- > 0; value >>= 3)
+        p[i] = (u_char) ('0' + (value & 7));
+}
+
+
+/*
+ * Names longer than 100 bytes are split at a slash into the "prefix" and
+ * "name" fields of the ustar header. Returns the length of the prefix,
+ * zero if no split is needed, or NGX_ERROR if the name does not fit.
+ */
+static ngx_int_t
+ngx_http_fancyindex_tar_split(ngx_http_fancyindex_entry_t *entry)
+{
+    size_t  len = entry->name.len + (entry->dir ? 1 : 0);
+    u_char *p;
+
+    if (len <= 100)
+        return 0;
+
+    for (p = entry->name.data + ngx_min(entry->name.len - 1, 155);
+         p > entry->name.data; p--)
+    {
+        if (*p == '/' && len - (p - entry->name.data) - 1 <= 100)
+            return p - entry->name.data;
+    }
+
+    return NGX_ERROR;
+}
+
+
+/*
+ * Bytes taken by an entry in the archive, or zero if it is left out.
+ */
+static off_t
+ngx_http_fancyindex_tar_size(ngx_http_fancyindex_entry_t *entry)
+{
+    if (ngx_http_fancyindex_tar_split(entry) == NGX_ERROR)
+        return 0;
+
+    if (entry->dir)
+        return NGX_HTTP_FANCYINDEX_TAR_BLOCK;
+
+    return NGX_HTTP_FANCYINDEX_TAR_BLOCK
+        + ngx_align(entry->size, NGX_HTTP_FANCYINDEX_TAR_BLOCK);
+}
+
+
+static void
+ngx_http_fancyindex_tar_header(u_char *h, ngx_http_fancyindex_entry_t *entry,
+                               size_t split)
+{
+    ngx_uint_t  i, sum;
+    u_char     *p, *name = entry->name.data;
+
+    ngx_memzero(h, NGX_HTTP_FANCYINDEX_TAR_BLOCK);
+
+    if (split) {
+        ngx_memcpy(h + 345, name, split);
+        split++;
+    }
+
+    p = ngx_cpymem(h, name + split, entry->name.len - split);
+    if (entry->dir)
+        *p = '/';
+
+    ngx_memcpy(h + 100, entry->dir ? "0000755" : "0000644", 8);
+    ngx_memcpy(h + 108, "0000000", 8);
+    ngx_memcpy(h + 116, "0000000", 8);
+    ngx_http_fancyindex_tar_number(h + 124, 12,
+                                   entry->dir ? 0 : (uint64_t) entry->size);
+    ngx_http_fancyindex_tar_number(h + 136, 12,
+                                   (uint64_t) ngx_max(entry->mtime, 0));
+    h[156] = entry->dir ? '5' : '0';
+    ngx_memcpy(h + 257, "ustar\0" "00", 8);
+
+    /* The checksum is computed with its own field filled with spaces. */
+    ngx_memset(h + 148, ' ', 8);
+    for (i = 0, sum = 0; i < NGX_HTTP_FANCYINDEX_TAR_BLOCK; i++)
+        sum += h[i];
+
+    ngx_http_fancyindex_tar_number(h + 148, 7, sum);
+}
+
+
+static void
+ngx_http_fancyindex_tar_close(ngx_http_fancyindex_tar_t *tar)
+{
+    ngx_uint_t i;
+
+    for (i = 0; i < tar->nslots; i++) {
+        if (tar->slots[i].file.fd != NGX_INVALID_FILE) {
+            ngx_close_file(tar->slots[i].file.fd);
+            tar->slots[i].file.fd = NGX_INVALID_FILE;
+        }
+    }
+    tar->nslots = 0;
+}
+
+
+static void
+ngx_http_fancyindex_tar_cleanup(void *data)
+{
+    ngx_http_fancyindex_tar_close(data);
+}
+
+
+/*
+ * Opens the file of an entry and chains its contents after the header.
+ * The file must still be the one which was scanned, as the length of
+ * the response has already been sent.
+ */
+static ngx_int_t
+ngx_http_fancyindex_tar_file(ngx_http_request_t *r,
+                             ngx_http_fancyindex_ctx_t *ctx,
+                             ngx_http_fancyindex_entry_t *entry,
+                             ngx_http_fancyindex_tar_slot_t *slot)
+{
+    ngx_file_info_t  fi;
+    ngx_buf_t       *b;
+    size_t           pad;
+    u_char          *last;
+
+    last = ngx_cpymem(slot->file.name.data, ctx->path.data, ctx->path.len);
+    *last++ = '/';
+    last = ngx_cpymem(last, entry->name.data, entry->name.len);
+    *last = '\0';
+    slot->file.name.len = last - slot->file.name.data;
+
+    slot->file.fd = ngx_open_file(slot->file.name.data,
+                                  NGX_FILE_RDONLY|NGX_FILE_NONBLOCK,
+                                  NGX_FILE_OPEN, 0);
+    if (slot->file.fd == NGX_INVALID_FILE) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      ngx_open_file_n " \"%V\" failed", &slot->file.name);
+        return NGX_ERROR;
+    }
+
+    if (ngx_fd_info(slot->file.fd, &fi) == NGX_FILE_ERROR) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, ngx_errno,
+                      ngx_fd_info_n " \"%V\" failed", &slot->file.name);
+        return NGX_ERROR;
+    }
+
+    if (!ngx_is_file(&fi) || ngx_file_size(&fi) != entry->size) {
+        ngx_log_error(NGX_LOG_ERR, r->connection->log, 0,
+                      "http fancyindex: \"%V\" changed while being archived",
+                      &slot->file.name);
+        return NGX_ERROR;
+    }
+
+    slot->file.log = r->connection->log;
+
+    b = &slot->bufs[1];
+    b->in_file = 1;
+    b->file = &slot->file;
+    b->file_pos = 0;
+    b->file_last = entry->size;
+
+    pad = ngx_align(entry->size, NGX_HTTP_FANCYINDEX_TAR_BLOCK) - entry->size;
+    if (pad) {
+        b = &slot->bufs[2];
+        b->memory = 1;
+        b->pos = ngx_http_fancyindex_tar_zero;
+        b->last = ngx_http_fancyindex_tar_zero + pad;
+    }
+
+    return NGX_OK;
+}
+
+
+/*
+ * Chains the next batch of entries, opening their files, followed by
+ * the end of the archive once there are no more entries.
+ */
+static ngx_int_t
+ngx_http_fancyindex_tar_batch(ngx_http_request_t *r,
+                              ngx_http_fancyindex_ctx_t *ctx,
+                              ngx_chain_t **out)
+{
+    ngx_http_fancyindex_tar_t      *tar = ctx->tar;
+    ngx_http_fancyindex_tar_slot_t *slot;
+    ngx_http_fancyindex_entry_t    *entry;
+    ngx_chain_t                   **ll = out;
+    ngx_int_t                       split;
+    ngx_uint_t                      i;
+
+    while (tar->next < tar->nentries
+           && tar->nslots < NGX_HTTP_FANCYINDEX_TAR_BATCH)
+    {
+        entry = &tar->entries[tar->next++];
+
+        if ((split = ngx_http_fancyindex_tar_split(entry)) == NGX_ERROR)
+            continue;
+
+        slot = &tar->slots[tar->nslots++];
+        ngx_memzero(slot->bufs, sizeof(slot->bufs));
+
+        ngx_http_fancyindex_tar_header(slot->header, entry, split);
+        slot->bufs[0].memory = 1;
+        slot->bufs[0].pos = slot->header;
+        slot->bufs[0].last = slot->header + NGX_HTTP_FANCYINDEX_TAR_BLOCK;
+
+        if (!entry->dir && entry->size > 0 &&
+            ngx_http_fancyindex_tar_file(r, ctx, entry, slot) != NGX_OK)
+            return NGX_ERROR;
+
+        for (i = 0; i < 3; i++) {
+            if (ngx_buf_size(&slot->bufs[i]) == 0)
+                continue;
+            slot->chain[i].buf = &slot->bufs[i];
+            *ll = &slot->chain[i];
+            ll = &slot->chain[i].next;
+        }
+    }
+
+    if (tar->next == tar->nentries) {
+        /* The archive ends with two empty blocks. */
+        tar->trailer.memory = 1;
+        tar->trailer.pos = ngx_http_fancyindex_tar_zero;
+        tar->trailer.last = ngx_http_fancyindex_tar_zero
+                          + sizeof(ngx_http_fancyindex_tar_zero);
+        tar->trailer.last_buf = (r == r->main) ? 1 : 0;
+        tar->trailer.last_in_chain = 1;
+        tar->trailer_chain.buf = &tar->trailer;
+        *ll = &tar->trailer_chain;
+        ll = &tar->trailer_chain.next;
+        tar->done = 1;
+    }
+
+    *ll = NULL;
+    return NGX_OK;
+}
+
+
+/*
+ * Write event handler which sends the archive a batch at a time: the
+ * files of a batch are closed once it has been completely sent, before
+ * opening the ones of the next.
+ */
+static void
+ngx_http_fancyindex_tar_write(ngx_http_request_t *r)
+{
+    ngx_connection_t          *c = r->connection;
+    ngx_event_t               *wev = c->write;
+    ngx_http_core_loc_conf_t  *clcf;
+    ngx_http_fancyindex_ctx_t *ctx;
+    ngx_chain_t               *out;
+    ngx_int_t                  rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    for ( ;; ) {
+        if (ctx->tar->busy) {
+            if (wev->delayed || r->aio)
+                goto wait;
+
+            rc = ngx_http_output_filter(r, NULL);
+            if (rc == NGX_ERROR) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+
+            if (rc == NGX_AGAIN || r->buffered || c->buffered)
+                goto wait;
+
+            if (wev->timer_set)
+                ngx_del_timer(wev);
+
+            ngx_http_fancyindex_tar_close(ctx->tar);
+            ctx->tar->busy = 0;
+
+            if (ctx->tar->done) {
+                ngx_http_finalize_request(r, NGX_OK);
+                return;
+            }
+        }
+
+        if (ngx_http_fancyindex_tar_batch(r, ctx, &out) != NGX_OK) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+
+        ctx->tar->busy = 1;
+
+        if (out && ngx_http_output_filter(r, out) == NGX_ERROR) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+    }
+
+wait:
+    if (!wev->delayed)
+        ngx_add_timer(wev, clcf->send_timeout);
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+        ngx_http_finalize_request(r, NGX_ERROR);
+}
+
+
+/*
+ * Streams the scanned entries as an uncompressed ustar archive. Headers
+ * are generated into a handful of reused buffers, and the contents are
+ * chained as file buffers, so memory use does not depend on the size of
+ * the files and they can be sent with sendfile().
+ */
+static ngx_int_t
+ngx_http_fancyindex_tar_send(ngx_http_request_t *r,
+                             ngx_http_fancyindex_ctx_t *ctx)
+{
+    ngx_http_fancyindex_entry_t *entry = ctx->entries.elts;
+    ngx_http_fancyindex_tar_t   *tar;
+    ngx_pool_cleanup_t          *cln;
+    ngx_uint_t                   i;
+    ngx_int_t                    rc;
+    off_t                        size, length = 2 * NGX_HTTP_FANCYINDEX_TAR_BLOCK;
+    size_t                       namelen = 0, len;
+    u_char                      *name, *p, *q;
+
+    for (i = 0; i < ctx->entries.nelts; i++) {
+        if ((size = ngx_http_fancyindex_tar_size(&entry[i])) == 0) {
+            ngx_log_error(NGX_LOG_WARN, r->connection->log, 0,
+                          "http fancyindex: \"%V\" left out of the archive "
+                          "of \"%V\", its name is too long",
+                          &entry[i].name, &ctx->path);
+            continue;
+        }
+        length += size;
+        namelen = ngx_max(namelen, entry[i].name.len);
+    }
+
+    /* Name the archive after the directory, "index.tar" for the root. */
+    name = r->uri.data + r->uri.len - 1;
+    while (name > r->uri.data && name[-1] != '/')
+        name--;
+    len = r->uri.data + r->uri.len - 1 - name;
+
+    if ((p = ngx_pnalloc(r->pool, len + 40)) == NULL)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    q = ngx_cpymem_ssz(p, "attachment; filename=\"");
+    if (len == 0)
+        q = ngx_cpymem_ssz(q, "index");
+    for (i = 0; i < len; i++)
+        *q++ = (name[i] < 0x20 || name[i] == '"' || name[i] == '\\'
+                || name[i] >= 0x7f) ? '_' : name[i];
+    q = ngx_cpymem_ssz(q, ".tar\"");
+
+    if (ngx_http_fancyindex_add_header(r, "Content-Disposition",
+                                       p, q - p) != NGX_OK)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_length_n = length;
+    r->headers_out.content_type_len  = ngx_sizeof_ssz("application/x-tar");
+    r->headers_out.content_type.len  = ngx_sizeof_ssz("application/x-tar");
+    r->headers_out.content_type.data = (u_char *) "application/x-tar";
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    if ((tar = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_tar_t))) == NULL)
+        return NGX_ERROR;
+
+    tar->entries = entry;
+    tar->nentries = ctx->entries.nelts;
+    /* Room for the longest path of a file, and the NUL terminator. */
+    namelen += ctx->path.len + 2;
+
+    for (i = 0; i < NGX_HTTP_FANCYINDEX_TAR_BATCH; i++) {
+        tar->slots[i].file.fd = NGX_INVALID_FILE;
+        tar->slots[i].file.name.data = ngx_pnalloc(r->pool, namelen);
+        if (tar->slots[i].file.name.data == NULL)
+            return NGX_ERROR;
+    }
+
+    if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+        return NGX_ERROR;
+
+    cln->handler = ngx_http_fancyindex_tar_cleanup;
+    cln->data = tar;
+    ctx->tar = tar;
+
+    r->main->count++;
+    r->write_event_handler = ngx_http_fancyindex_tar_write;
+    ngx_http_fancyindex_tar_write(r);
+
+    return NGX_DONE;
+}
+
+
+#if (NGX_HTTP_FANCYINDEX_USDT)
+
+static ngx_int_t
+ngx_http_fancyindex_subrequest_done(ngx_http_request_t *r, void *data,
+                                    ngx_int_t rc)
+{
+    (void) r; /* unused */
+
+    ngx_http_fancyindex_probe2(subrequest__end, data, rc);
+    return rc;
+}
+
+#endif /* NGX_HTTP_FANCYINDEX_USDT */
+
+
+/*
+ * Issues the subrequest for a header or footer ("kind"), which is traced
+ * until it finishes when probes are enabled.
+ */
+static ngx_int_t
+ngx_http_fancyindex_subrequest(ngx_http_request_t *r, ngx_str_t *uri,
+                               ngx_http_request_t **psr, const char *kind)
+{
+    ngx_http_post_subrequest_t *ps = NULL;
+
+#if (NGX_HTTP_FANCYINDEX_USDT)
+    if ((ps = ngx_palloc(r->pool, sizeof(ngx_http_post_subrequest_t))) == NULL)
+        return NGX_ERROR;
+
+    ps->handler = ngx_http_fancyindex_subrequest_done;
+    ps->data = (void *) kind;
+
+    ngx_http_fancyindex_probe1(subrequest__start, kind);
+#else /* !NGX_HTTP_FANCYINDEX_USDT */
+    (void) kind; /* unused */
+#endif /* NGX_HTTP_FANCYINDEX_USDT */
+
+    return ngx_http_subrequest(r, uri, NULL, psr, ps, 0);
+}
+
+
+static void
+ngx_http_fancyindex_local_release(void *data)
+{
+    ngx_fancyindex_local_data_t *ld = data;
+
+    if (--ld->count == 0)
+        ngx_free(ld);
+}
+
+
+/*
+ * Reads a local header or footer file again, replacing the contents
+ * in use. On errors the current contents are kept.
+ */
+static void
+ngx_http_fancyindex_local_read(ngx_http_request_t *r,
+                               ngx_fancyindex_headerfooter_conf_t *item,
+                               ngx_open_file_info_t *of)
+{
+    ngx_fancyindex_local_file_t *lf = item->file;
+    ngx_fancyindex_local_data_t *ld;
+    ngx_file_t                   file;
+    ssize_t                      n;
+
+    ld = ngx_alloc(sizeof(ngx_fancyindex_local_data_t) + (size_t) of->size,
+                   r->connection->log);
+    if (ld == NULL)
+        return;
+
+    ld->count = 1;
+    ld->len = (size_t) of->size;
+    ld->data = (u_char *) (ld + 1);
+
+    ngx_memzero(&file, sizeof(ngx_file_t));
+    file.fd = of->fd;
+    file.name = item->path;
+    file.log = r->connection->log;
+
+    while (file.offset < of->size) {
+        n = ngx_read_file(&file, ld->data + file.offset,
+                          (size_t) (of->size - file.offset), file.offset);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_free(ld);
+            return;
+        }
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                   "http fancyindex: reloaded \"%V\"", &item->path);
+
+    if (lf->data)
+        ngx_http_fancyindex_local_release(lf->data);
+
+    lf->data = ld;
+    lf->uniq = of->uniq;
+    lf->mtime = of->mtime;
+    lf->size = of->size;
+}
+
+
+/*
+ * Makes a buffer with the contents of a local header or footer file.
+ * With open_file_cache the file is checked for changes, and read again
+ * if it changed; otherwise it is the same as read at startup.
+ */
+static ngx_buf_t *
+ngx_http_fancyindex_local_buf(ngx_http_request_t *r,
+                              ngx_fancyindex_headerfooter_conf_t *item)
+{
+    ngx_fancyindex_local_file_t *lf = item->file;
+    ngx_http_core_loc_conf_t    *clcf;
+    ngx_open_file_info_t         of;
+    ngx_pool_cleanup_t          *cln;
+    ngx_buf_t                   *b;
+
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+
+    if (clcf->open_file_cache) {
+        ngx_memzero(&of, sizeof(ngx_open_file_info_t));
+
+        of.read_ahead = clcf->read_ahead;
+        of.directio = NGX_MAX_OFF_T_VALUE;
+        of.valid = clcf->open_file_cache_valid;
+        of.min_uses = clcf->open_file_cache_min_uses;
+        of.errors = clcf->open_file_cache_errors;
+        of.events = clcf->open_file_cache_events;
+
+        if (ngx_open_cached_file(clcf->open_file_cache, &item->path, &of,
+                                 r->pool) != NGX_OK)
+        {
+            ngx_log_error(NGX_LOG_ERR, r->connection->log, of.err,
+                          "%s \"%V\" failed, using its previous contents",
+                          of.failed, &item->path);
+
+        } else if (of.is_file && (of.uniq != lf->uniq
+                                  || of.mtime != lf->mtime
+                                  || of.size != lf->size))
+        {
+            ngx_http_fancyindex_local_read(r, item, &of);
+        }
+    }
+
+    if ((b = ngx_calloc_buf(r->pool)) == NULL)
+        return NULL;
+
+    if (lf->data == NULL) {
+        b->pos = item->local.data;
+        b->last = item->local.data + item->local.len;
+
+    } else {
+        /* Keep the contents while the buffer is in use. */
+        if ((cln = ngx_pool_cleanup_add(r->pool, 0)) == NULL)
+            return NULL;
+
+        cln->handler = ngx_http_fancyindex_local_release;
+        cln->data = lf->data;
+        lf->data->count++;
+
+        b->pos = lf->data->data;
+        b->last = lf->data->data + lf->data->len;
+    }
+
+    if (b->pos == b->last)
+        b->sync = 1;  /* The file became empty. */
+    else
+        b->memory = 1;
+
+    return b;
+}
+
+
+/*
+ * Sends "out", whose last link is "last", followed by the footer, which
+ * ends the response.
+ */
+static ngx_int_t
+ngx_http_fancyindex_send_footer(ngx_http_request_t *r,
+                                ngx_http_fancyindex_loc_conf_t *alcf,
+                                ngx_chain_t *out, ngx_chain_t *last)
+{
+    ngx_http_request_t             *sr;
+    ngx_str_t                      *sr_uri;
+    ngx_str_t                       rel_uri;
+    ngx_int_t                       rc;
+    ngx_chain_t                     footer = { NULL, NULL };
+
+    /* If footer is disabled, chain up footer buffer. */
+    if (alcf->footer.path.len == 0 || alcf->footer.local.len > 0) {
+        last->next = &footer;
+        if (alcf->footer.local.len > 0) {
+            footer.buf = ngx_http_fancyindex_local_buf(r, &alcf->footer);
+            if (footer.buf == NULL)
+                return NGX_ERROR;
+        } else {
+            footer.buf = ngx_calloc_buf(r->pool);
+            if (footer.buf == NULL)
+                return NGX_ERROR;
+
+            footer.buf->memory = 1;
+            footer.buf->pos = (u_char*) t08_foot1;
+            footer.buf->last = (u_char*) t08_foot1 + sizeof(t08_foot1) - 1;
+        }
+
+        last->buf->last_in_chain = 0;
+        footer.buf->last_in_chain = 1;
+        footer.buf->last_buf      = 1;
+        /* Send everything with a single call :D */
+        return ngx_http_output_filter(r, out);
+    }
+
+    /*
+     * If we reach here, we were asked to send a custom footer. We need to:
+     * partially send whatever is referenced from out and then send the
+     * footer as a subrequest. If the subrequest fails, we should send the
+     * standard footer as well.
+     */
+    rc = ngx_http_output_filter(r, out);
+
+    if (rc != NGX_OK && rc != NGX_AGAIN)
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+
+    /* URI is configured, make Nginx take care of with a subrequest. */
+    sr_uri = &alcf->footer.path;
+
+    if (*sr_uri->data != '/') {
+        /* Relative path */
+        rel_uri.len  = r->uri.len + alcf->footer.path.len;
+        rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
+        if (rel_uri.data == NULL) {
+            return NGX_HTTP_INTERNAL_SERVER_ERROR;
+        }
+        ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
+                alcf->footer.path.data, alcf->footer.path.len);
+        sr_uri = &rel_uri;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "http fancyindex: footer subrequest \"%V\"", sr_uri);
+
+    rc = ngx_http_fancyindex_subrequest(r, sr_uri, &sr, "footer");
+    if (rc == NGX_ERROR || rc == NGX_DONE) {
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: footer subrequest for \"%V\" failed", sr_uri);
+        return rc;
+    }
+
+    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+            "http fancyindex: header subrequest status = %i",
+            sr->headers_out.status);
+
+    /* see above: ngx_http_subrequest resturns NGX_OK (0) not NGX_HTTP_OK (200) */
+    if (sr->headers_out.status != NGX_OK) {
+        /*
+         * XXX: Should we write a message to the error log just in case
+         * we get something different from a 404?
+         */
+        footer.buf = ngx_calloc_buf(r->pool);
+        if (footer.buf == NULL)
+            return NGX_ERROR;
+        footer.buf->memory = 1;
+        footer.buf->pos = (u_char*) t08_foot1;
+        footer.buf->last = (u_char*) t08_foot1 + sizeof(t08_foot1) - 1;
+        footer.buf->last_in_chain = 1;
+        footer.buf->last_buf = 1;
+        /* Directly send out the builtin footer */
+        return ngx_http_output_filter(r, &footer);
+    }
+
+    return (r != r->main) ? rc : ngx_http_send_special(r, NGX_HTTP_LAST);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_send(ngx_http_request_t *r,
+                         ngx_http_fancyindex_loc_conf_t *alcf,
+                         ngx_buf_t *content)
+{
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_request_t             *sr;
+    ngx_str_t                      *sr_uri;
+    ngx_str_t                       rel_uri;
+    ngx_int_t                       rc;
+    ngx_chain_t                    *last, *cl;
+    ngx_chain_t                     out[2] = {
+        { NULL, NULL }, { NULL, NULL } };
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (content == NULL) {
+#if (NGX_LINUX)
+        if (ctx->events)
+            return ngx_http_fancyindex_events_stream(r, ctx);
+#endif
+        /* make_listing_buf() did not render anything for archives. */
+        return ngx_http_fancyindex_tar_send(r, ctx);
+    }
+
+    out[0].buf = content;
+    out[0].buf->last_in_chain = 1;
+    last = &out[0];
+
+    r->headers_out.status = NGX_HTTP_OK;
+    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/html");
+    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/html");
+    r->headers_out.content_type.data = (u_char *) "text/html";
+
+    /* Partial listings are not worth keeping. */
+    if (!ctx->limit.truncated
+        && ngx_http_fancyindex_cache_headers(r, ctx, alcf) != NGX_OK)
+        return NGX_ERROR;
+
+    rc = ngx_http_send_header(r);
+    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
+        return rc;
+
+    if (alcf->header.path.len > 0 && alcf->header.local.len == 0) {
+        /* URI is configured, make Nginx take care of with a subrequest. */
+        sr_uri = &alcf->header.path;
+
+        if (*sr_uri->data != '/') {
+            /* Relative path */
+            rel_uri.len  = r->uri.len + alcf->header.path.len;
+            rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
+            if (rel_uri.data == NULL) {
+                return NGX_HTTP_INTERNAL_SERVER_ERROR;
+            }
+            ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
+                    alcf->header.path.data, alcf->header.path.len);
+            sr_uri = &rel_uri;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: header subrequest \"%V\"", sr_uri);
+
+        rc = ngx_http_fancyindex_subrequest(r, sr_uri, &sr, "header");
+        if (rc == NGX_ERROR || rc == NGX_DONE) {
+            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                    "http fancyindex: header subrequest for \"%V\" failed", sr_uri);
+            return rc;
+        }
+
+        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
+                "http fancyindex: header subrequest status = %i",
+                sr->headers_out.status);
+        /* ngx_http_subrequest returns NGX_OK(0), not NGX_HTTP_OK(200) */
+        if (sr->headers_out.status != NGX_OK) {
+            /*
+             * XXX: Should we write a message to the error log just in case
+             * we get something different from a 404?
+             */
+            goto add_builtin_header;
+        }
+    }
+    else {
+add_builtin_header:
+        /* Make space before */
+        out[1].next = out[0].next;
+        out[1].buf  = out[0].buf;
+        last = &out[1];
+        /* Chain header buffer */
+        out[0].next = &out[1];
+        if (alcf->header.local.len > 0) {
+            /* Header buffer is local, make a buffer pointing to the data. */
+            out[0].buf = ngx_http_fancyindex_local_buf(r, &alcf->header);
+            if (out[0].buf == NULL)
+                return NGX_ERROR;
+        } else {
+            /* Chain buffers with the contents of the builtin header. */
+            if ((cl = make_header_chain(r, alcf, &out[1])) == NULL)
+                return NGX_ERROR;
+            out[0] = *cl;
+        }
+    }
+
+    if (ctx->stream) {
+        /* The rows and the footer are sent as the directory is read. */
+        last->buf->flush = 1;
+
+        if (ngx_http_output_filter(r, &out[0]) == NGX_ERROR)
+            return NGX_ERROR;
+
+        r->main->count++;
+        r->write_event_handler = ngx_http_fancyindex_stream_write;
+        ngx_http_fancyindex_stream_write(r);
+
+        return NGX_DONE;
+    }
+
+    return ngx_http_fancyindex_send_footer(r, alcf, &out[0], last);
+}
+
+
+/*
+ * Write event handler which reads the next batch of entries of an
+ * unsorted listing once the previous one has been sent, so only one
+ * batch is kept in memory regardless of the size of the directory.
+ */
+static void
+ngx_http_fancyindex_stream_write(ngx_http_request_t *r)
+{
+    ngx_connection_t               *c = r->connection;
+    ngx_event_t                    *wev = c->write;
+    ngx_http_core_loc_conf_t       *clcf;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_http_fancyindex_stream_t   *st;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    clcf = ngx_http_get_module_loc_conf(r, ngx_http_core_module);
+    st = ctx->stream;
+
+    if (wev->timedout) {
+        ngx_log_error(NGX_LOG_INFO, c->log, NGX_ETIMEDOUT,
+                      "client timed out");
+        c->timedout = 1;
+        ngx_http_finalize_request(r, NGX_HTTP_REQUEST_TIME_OUT);
+        return;
+    }
+
+    for ( ;; ) {
+        if (st->busy) {
+            if (wev->delayed || r->aio)
+                goto wait;
+
+            rc = ngx_http_output_filter(r, NULL);
+            if (rc == NGX_ERROR) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+
+            if (rc == NGX_AGAIN || r->buffered || c->buffered)
+                goto wait;
+
+            if (wev->timer_set)
+                ngx_del_timer(wev);
+
+            ngx_reset_pool(st->pool);
+            st->busy = 0;
+        }
+
+        /* The limit on entries applies to the whole listing. */
+        ctx->limit.read = st->count;
+        st->entries.nelts = 0;
+
+        rc = ngx_http_fancyindex_read_entries(st->pool, c->log, alcf,
+                &st->dir, &ctx->path, ctx->allocated, NULL,
+                ctx->flags | NGX_HTTP_FANCYINDEX_SCAN_IGNORE, &ctx->limit,
+                &st->entries, NGX_HTTP_FANCYINDEX_STREAM_BATCH);
+
+        if (rc != NGX_OK && rc != NGX_AGAIN) {
+            st->open = 0;
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+
+        st->count += st->entries.nelts;
+
+        b = ngx_create_temp_buf(st->pool,
+                ngx_http_fancyindex_rows_len(alcf, st->entries.elts,
+                                             st->entries.nelts)
+                + NGX_HTTP_FANCYINDEX_TAIL_LEN);
+        if (b == NULL) {
+            ngx_http_finalize_request(r, NGX_ERROR);
+            return;
+        }
+
+        b->last = ngx_http_fancyindex_render_rows(b->last, alcf,
+                                                  st->entries.elts,
+                                                  st->entries.nelts,
+                                                  st->sort_url_args);
+        st->out.buf = b;
+        st->out.next = NULL;
+
+        if (rc == NGX_AGAIN) {
+            b->flush = 1;
+
+            if (ngx_http_output_filter(r, &st->out) == NGX_ERROR) {
+                ngx_http_finalize_request(r, NGX_ERROR);
+                return;
+            }
+
+            st->busy = 1;
+            continue;
+        }
+
+        /* The whole directory was read. */
+        if (ngx_close_dir(&st->dir) == NGX_ERROR) {
+            ngx_log_error(NGX_LOG_ALERT, c->log, ngx_errno,
+                          ngx_close_dir_n " \"%V\" failed", &ctx->path);
+        }
+        st->open = 0;
+
+        ngx_http_fancyindex_scan_release(r, ctx);
+
+        ngx_http_fancyindex_probe3(scan__end, ctx->path.data, st->count,
+                                   ctx->limit.truncated);
+
+        if (ctx->limit.truncated) {
+            ngx_log_error(NGX_LOG_WARN, c->log, 0,
+                          "http fancyindex: listing of \"%V\" truncated "
+                          "after %ui entries", &ctx->path, st->count);
+        }
+
+        b->last = ngx_http_fancyindex_render_tail(b->last, st->count,
+                                                  ctx->limit.truncated);
+
+        r->write_event_handler = ngx_http_request_empty_handler;
+        ngx_http_finalize_request(r,
+                ngx_http_fancyindex_send_footer(r, alcf, &st->out, &st->out));
+        return;
+    }
+
+wait:
+    if (!wev->delayed)
+        ngx_add_timer(wev, clcf->send_timeout);
+
+    if (ngx_handle_write_event(wev, clcf->send_lowat) != NGX_OK)
+        ngx_http_finalize_request(r, NGX_ERROR);
+}
+
+
+#if (NGX_THREADS)
+
+static void
+ngx_http_fancyindex_scan_resume(ngx_http_request_t *r)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx->pending) {
+        /* Some other event woke us up, the scan is still in progress. */
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    rc = ngx_http_fancyindex_merge_level(r, ctx);
+    if (rc == NGX_DONE)
+        return;
+
+    if (rc == NGX_OK)
+        rc = make_listing_buf(r, &b, alcf, &ctx->entries);
+
+    if (rc == NGX_DONE)
+        return;
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, alcf, b);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+
+static void
+ngx_http_fancyindex_sort_resume(ngx_http_request_t *r)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+
+    if (ctx->pending) {
+        /* Some other event woke us up, the sort is still in progress. */
+        return;
+    }
+
+    r->write_event_handler = ngx_http_request_empty_handler;
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    rc = ngx_http_fancyindex_sort_round(r, ctx);
+    if (rc == NGX_DONE)
+        return;
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_render_listing(r, ctx, alcf, ctx->sort->entries,
+                                                ctx->sort->criterion,
+                                                ctx->sort->sort_url_args, &b);
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, alcf, b);
+
+    ngx_http_finalize_request(r, rc);
+}
+
+#endif /* NGX_THREADS */
+
+
+static void
+ngx_http_fancyindex_cache_wait_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t             *r = ev->data;
+    ngx_connection_t               *c = r->connection;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    rc = ngx_http_fancyindex_cache_get(r, ctx, alcf, &b);
+    if (rc == NGX_DONE)
+        return;
+
+    if (rc == NGX_DECLINED) {
+        rc = make_listing(r, &b, alcf);
+        if (rc == NGX_DONE)
+            return;
+    }
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, alcf, b);
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static void
+ngx_http_fancyindex_scan_wait_handler(ngx_event_t *ev)
+{
+    ngx_http_request_t             *r = ev->data;
+    ngx_connection_t               *c = r->connection;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    const char                     *sort_url_args;
+    ngx_buf_t                      *b;
+    ngx_int_t                       rc;
+
+    ctx = ngx_http_get_module_ctx(r, ngx_http_fancyindex_module);
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (ctx->scan_stream) {
+        (void) ngx_http_fancyindex_sort_criterion(r, alcf, &sort_url_args);
+        rc = ngx_http_fancyindex_stream_open(r, ctx, alcf, sort_url_args, &b);
+    } else {
+        rc = make_listing(r, &b, alcf);
+    }
+
+    if (rc == NGX_DONE)
+        return;
+
+    if (rc == NGX_OK)
+        rc = ngx_http_fancyindex_send(r, alcf, b);
+
+    ngx_http_finalize_request(r, rc);
+    ngx_http_run_posted_requests(c);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_handler(ngx_http_request_t *r)
+{
+    ngx_int_t                       rc;
+    ngx_http_fancyindex_loc_conf_t *alcf;
+    ngx_http_fancyindex_ctx_t      *ctx;
+    ngx_buf_t                      *b;
+
+
+    if (r->uri.data[r->uri.len - 1] != '/') {
+        return NGX_DECLINED;
+    }
+
+    /* TODO: Win32 */
+#if defined(nginx_version) \
+    && ((nginx_version < 7066) \
+        || ((nginx_version > 8000) && (nginx_version < 8038)))
+    if (r->zero_in_uri) {
+        return NGX_DECLINED;
+    }
+#endif
+
+    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
+        return NGX_DECLINED;
+    }
+
+    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+
+    if (!alcf->enable) {
+        return NGX_DECLINED;
+    }
+
+    ctx = ngx_pcalloc(r->pool, sizeof(ngx_http_fancyindex_ctx_t));
+    if (ctx == NULL) {
+        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    }
+    ngx_http_set_ctx(r, ctx, ngx_http_fancyindex_module);
+
+    rc = make_content_buf(r, &b, alcf);
+
+    if (rc == NGX_DONE) {
+        r->main->count++;
+        return NGX_DONE;
+    }
+
+    if (rc != NGX_OK)
+        return rc;
+
+    return ngx_http_fancyindex_send(r, alcf, b);
+}
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_cs_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcmp(second->name.data, first->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_ci_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcasecmp(second->name.data, first->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_size_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (first->size < second->size) - (first->size > second->size);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_mtime_desc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) (second->mtime - first->mtime);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_cs_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcmp(first->name.data, second->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_name_ci_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) ngx_strcasecmp(first->name.data, second->name.data);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (first->size > second->size) - (first->size < second->size);
+}
+
+
+static int ngx_libc_cdecl
+ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two)
+{
+    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
+    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+
+    return (int) (first->mtime - second->mtime);
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_error(ngx_log_t *log, ngx_dir_t *dir, ngx_str_t *name)
+{
+    if (ngx_close_dir(dir) == NGX_ERROR) {
+        ngx_log_error(NGX_LOG_ALERT, log, ngx_errno,
+                      ngx_close_dir_n " \"%V\" failed", name);
+    }
+
+    return NGX_HTTP_INTERNAL_SERVER_ERROR;
+}
+
+
+static void *
+ngx_http_fancyindex_create_main_conf(ngx_conf_t *cf)
+{
+    ngx_http_fancyindex_main_conf_t  *amcf;
+
+    amcf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_main_conf_t));
+    if (amcf == NULL) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&amcf->watches, cf->pool, 4,
+                       sizeof(ngx_http_fancyindex_watch_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    if (ngx_array_init(&amcf->preloads, cf->pool, 4,
+                       sizeof(ngx_http_fancyindex_tree_t)) != NGX_OK) {
+        return NULL;
+    }
+
+    amcf->buffer_pool = NGX_CONF_UNSET_SIZE;
+    amcf->events_watches = NGX_CONF_UNSET_UINT;
+    amcf->events_subscribers = NGX_CONF_UNSET_UINT;
+
+    return amcf;
+}
+
+
+static char *
+ngx_http_fancyindex_init_main_conf(ngx_conf_t *cf, void *conf)
+{
+    ngx_http_fancyindex_main_conf_t *amcf = conf;
+
+    (void) cf; /* unused */
+
+    ngx_conf_init_size_value(amcf->buffer_pool, 0);
+    ngx_conf_init_uint_value(amcf->events_watches, 64);
+    ngx_conf_init_uint_value(amcf->events_subscribers, 1024);
+
+    return NGX_CONF_OK;
+}
+
+
+static void *
+ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf)
+{
+    ngx_http_fancyindex_loc_conf_t  *conf;
+
+    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_loc_conf_t));
+    if (conf == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    /*
+     * Set by ngx_pcalloc:
+     *    conf->header.*.len     = 0
+     *    conf->header.*.data    = NULL
+     *    conf->footer.*.len     = 0
+     *    conf->footer.*.data    = NULL
+     *    conf->css_href.len     = 0
+     *    conf->css_href.data    = NULL
+     *    conf->css_link.len     = 0
+     *    conf->css_link.data    = NULL
+     *    conf->time_format.len  = 0
+     *    conf->time_format.data = NULL
+     */
+    conf->enable         = NGX_CONF_UNSET;
+    conf->default_sort   = NGX_CONF_UNSET_UINT;
+    conf->case_sensitive = NGX_CONF_UNSET;
+    conf->dirs_first     = NGX_CONF_UNSET;
+    conf->localtime      = NGX_CONF_UNSET;
+    conf->exact_size     = NGX_CONF_UNSET;
+    conf->ignore         = NGX_CONF_UNSET_PTR;
+    conf->hide_symlinks  = NGX_CONF_UNSET;
+    conf->show_path      = NGX_CONF_UNSET;
+    conf->hide_parent    = NGX_CONF_UNSET;
+    conf->show_dot_files = NGX_CONF_UNSET;
+    conf->compact        = NGX_CONF_UNSET;
+    conf->max_depth      = NGX_CONF_UNSET_UINT;
+    conf->scan_timeout   = NGX_CONF_UNSET_MSEC;
+    conf->max_entries    = NGX_CONF_UNSET_UINT;
+    conf->parallel_sort  = NGX_CONF_UNSET_UINT;
+    conf->summary_threshold = NGX_CONF_UNSET_UINT;
+    conf->archive        = NGX_CONF_UNSET;
+    conf->events         = NGX_CONF_UNSET;
+#if (NGX_THREADS)
+    conf->thread_pool    = NGX_CONF_UNSET_PTR;
+#endif
+    conf->io_uring       = NGX_CONF_UNSET;
+    conf->scan_cache     = NGX_CONF_UNSET_PTR;
+    conf->checksum_zone  = NGX_CONF_UNSET_PTR;
+    conf->checksum_xattr = NGX_CONF_UNSET;
+    conf->cache_zone     = NGX_CONF_UNSET_PTR;
+    conf->cache_valid    = NGX_CONF_UNSET;
+    conf->cache_lock     = NGX_CONF_UNSET;
+    conf->cache_lock_timeout = NGX_CONF_UNSET_MSEC;
+    conf->cache_use_stale = NGX_CONF_UNSET;
+    conf->cache_max_stale = NGX_CONF_UNSET;
+    conf->cache_patch    = NGX_CONF_UNSET;
+    conf->scan_limit_zone = NGX_CONF_UNSET_PTR;
+    conf->cache_control  = NGX_CONF_UNSET;
+    conf->cache_control_swr = NGX_CONF_UNSET;
+    conf->surrogate_key  = NGX_CONF_UNSET;
+
+    return conf;
+}
+
+
+/*
+ * Index files are only valid for locations which filter entries in the
+ * same way, so a checksum of the relevant settings is stored in them.
+ */
+static uint32_t
+ngx_http_fancyindex_index_filter(ngx_http_fancyindex_loc_conf_t *conf)
+{
+    uint32_t    crc;
+    u_char      flags[2];
+    ngx_uint_t  i;
+
+    ngx_crc32_init(crc);
+
+    flags[0] = (u_char) conf->show_dot_files;
+    flags[1] = (u_char) conf->hide_symlinks;
+    ngx_crc32_update(&crc, flags, sizeof(flags));
+
+    if (conf->ignore) {
+        for (i = 0; i < conf->ignore->nelts; i++) {
+#if (NGX_PCRE)
+            u_char *pattern = ((ngx_regex_elt_t *) conf->ignore->elts)[i].name;
+            ngx_crc32_update(&crc, pattern, ngx_strlen(pattern) + 1);
+#else /* !NGX_PCRE */
+            ngx_str_t *pattern = &((ngx_str_t *) conf->ignore->elts)[i];
+            ngx_crc32_update(&crc, pattern->data, pattern->len + 1);
+#endif /* NGX_PCRE */
+        }
+    }
+
+    ngx_crc32_final(crc);
+    return crc;
+}
+
+
+/*
+ * Cached listings are only valid for locations which render them in the
+ * same way, so a checksum of the relevant settings is part of their keys,
+ * and of the files they are kept in.
+ */
+static uint32_t
+ngx_http_fancyindex_cache_settings(ngx_http_fancyindex_loc_conf_t *conf)
+{
+    uint32_t    crc;
+    uint64_t    threshold;
+    u_char      flags[8];
+
+    ngx_crc32_init(crc);
+
+    flags[0] = (u_char) conf->compact;
+    flags[1] = (u_char) conf->exact_size;
+    flags[2] = (u_char) conf->localtime;
+    flags[3] = (u_char) conf->show_path;
+    flags[4] = (u_char) conf->hide_parent;
+    flags[5] = (u_char) conf->case_sensitive;
+    flags[6] = (u_char) conf->dirs_first;
+    flags[7] = (u_char) (conf->checksum_zone != NULL);
+    ngx_crc32_update(&crc, flags, sizeof(flags));
+
+    threshold = conf->summary_threshold;
+    ngx_crc32_update(&crc, (u_char *) &threshold, sizeof(threshold));
+    ngx_crc32_update(&crc, (u_char *) &conf->index_filter, sizeof(uint32_t));
+    ngx_crc32_update(&crc, conf->time_format.data, conf->time_format.len);
+
+    ngx_crc32_final(crc);
+    return crc;
+}
+
+
+static char *
+ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+{
+    ngx_http_fancyindex_loc_conf_t  *prev = parent;
+    ngx_http_fancyindex_loc_conf_t  *conf = child;
+    ngx_http_fancyindex_cache_ctx_t *zctx;
+    uint32_t                        *settings;
+    u_char                          *p;
+
+    ngx_conf_merge_value(conf->enable, prev->enable, 0);
+    ngx_conf_merge_uint_value(conf->default_sort, prev->default_sort, NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME);
+    ngx_conf_merge_value(conf->case_sensitive, prev->case_sensitive, 1);
+    ngx_conf_merge_value(conf->dirs_first, prev->dirs_first, 1);
+    ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
+    ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
+    ngx_conf_merge_value(conf->show_path, prev->show_path, 1);
+    ngx_conf_merge_value(conf->show_dot_files, prev->show_dot_files, 0);
+    ngx_conf_merge_value(conf->compact, prev->compact, 0);
+
+    ngx_conf_merge_str_value(conf->header.path, prev->header.path, "");
+    ngx_conf_merge_str_value(conf->header.local, prev->header.local, "");
+    ngx_conf_merge_str_value(conf->footer.path, prev->footer.path, "");
+    ngx_conf_merge_str_value(conf->footer.local, prev->footer.local, "");
+
+    if (conf->header.file == NULL)
+        conf->header.file = prev->header.file;
+    if (conf->footer.file == NULL)
+        conf->footer.file = prev->footer.file;
+
+    ngx_conf_merge_str_value(conf->css_href, prev->css_href, "");
+
+    if (conf->css_href.len) {
+        conf->css_link.len = css_href_pre.len + conf->css_href.len
+                             + css_href_post.len;
+        if ((p = ngx_pnalloc(cf->pool, conf->css_link.len)) == NULL)
+            return NGX_CONF_ERROR;
+
+        conf->css_link.data = p;
+        p = ngx_cpymem_str(p, css_href_pre);
+        p = ngx_cpymem_str(p, conf->css_href);
+        (void) ngx_cpymem_str(p, css_href_post);
+    }
+    ngx_conf_merge_str_value(conf->time_format, prev->time_format, "%Y-%b-%d %H:%M");
+
+    ngx_conf_merge_ptr_value(conf->ignore, prev->ignore, NULL);
+    ngx_conf_merge_value(conf->hide_symlinks, prev->hide_symlinks, 0);
+    ngx_conf_merge_value(conf->hide_parent, prev->hide_parent, 0);
+    ngx_conf_merge_uint_value(conf->max_depth, prev->max_depth, 0);
+    ngx_conf_merge_msec_value(conf->scan_timeout, prev->scan_timeout, 0);
+    ngx_conf_merge_uint_value(conf->max_entries, prev->max_entries, 0);
+    ngx_conf_merge_uint_value(conf->parallel_sort, prev->parallel_sort, 0);
+    ngx_conf_merge_uint_value(conf->summary_threshold, prev->summary_threshold, 0);
+    ngx_conf_merge_value(conf->archive, prev->archive, 0);
+    ngx_conf_merge_value(conf->events, prev->events, 0);
+#if (NGX_THREADS)
+    ngx_conf_merge_ptr_value(conf->thread_pool, prev->thread_pool, NULL);
+#endif
+    ngx_conf_merge_value(conf->io_uring, prev->io_uring, 0);
+    ngx_conf_merge_ptr_value(conf->scan_cache, prev->scan_cache, NULL);
+    ngx_conf_merge_str_value(conf->index_path, prev->index_path, "");
+    conf->index_filter = ngx_http_fancyindex_index_filter(conf);
+    ngx_conf_merge_ptr_value(conf->checksum_zone, prev->checksum_zone, NULL);
+    ngx_conf_merge_value(conf->checksum_xattr, prev->checksum_xattr, 0);
+    ngx_conf_merge_ptr_value(conf->cache_zone, prev->cache_zone, NULL);
+    ngx_conf_merge_sec_value(conf->cache_valid, prev->cache_valid, 60);
+    ngx_conf_merge_value(conf->cache_lock, prev->cache_lock, 0);
+    ngx_conf_merge_msec_value(conf->cache_lock_timeout,
+                              prev->cache_lock_timeout, 5000);
+    ngx_conf_merge_value(conf->cache_use_stale, prev->cache_use_stale, 0);
+    ngx_conf_merge_sec_value(conf->cache_max_stale, prev->cache_max_stale, 600);
+    ngx_conf_merge_value(conf->cache_patch, prev->cache_patch, 0);
+
+    if (conf->cache_zone) {
+        conf->cache_settings = ngx_http_fancyindex_cache_settings(conf);
+        zctx = conf->cache_zone->data;
+
+        /* Unknown zones have no data, and are reported by Nginx later. */
+        if (zctx
+            && !ngx_http_fancyindex_cache_settings_used(zctx, conf->cache_settings))
+        {
+            if ((settings = ngx_array_push(&zctx->settings)) == NULL)
+                return NGX_CONF_ERROR;
+            *settings = conf->cache_settings;
+        }
+    }
+
+    if (conf->scan_limit_zone == NGX_CONF_UNSET_PTR) {
+        conf->scan_limit_zone = prev->scan_limit_zone;
+        conf->scan_limit = prev->scan_limit;
+        conf->scan_limit_queue = prev->scan_limit_queue;
+        conf->scan_limit_timeout = prev->scan_limit_timeout;
+    }
+    if (conf->scan_limit_zone == NGX_CONF_UNSET_PTR)
+        conf->scan_limit_zone = NULL;
+
+    if (conf->cache_control == NGX_CONF_UNSET) {
+        conf->cache_control = prev->cache_control;
+        conf->cache_control_swr = prev->cache_control_swr;
+    }
+    if (conf->cache_control == NGX_CONF_UNSET) {
+        conf->cache_control = -1;
+        conf->cache_control_swr = -1;
+    }
+
+    ngx_conf_merge_value(conf->surrogate_key, prev->surrogate_key, 0);
+
+#if (NGX_THREADS)
+    if (conf->checksum_zone && conf->thread_pool == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_checksum\" requires \"fancyindex_thread_pool\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->parallel_sort && conf->thread_pool == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_parallel_sort\" requires \"fancyindex_thread_pool\"");
+        return NGX_CONF_ERROR;
+    }
+
+    if (conf->io_uring && conf->thread_pool == NULL) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_io_uring\" requires \"fancyindex_thread_pool\"");
+        return NGX_CONF_ERROR;
+    }
+#else /* !NGX_THREADS */
+    if (conf->io_uring) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_io_uring\" requires Nginx built "
+                           "with thread pools support (--with-threads)");
+        return NGX_CONF_ERROR;
+    }
+#endif /* NGX_THREADS */
+
+    /* Just make sure we haven't disabled the show_path directive without providing a custom header */
+    if (conf->show_path == 0 && conf->header.path.len == 0)
+    {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "FancyIndex : cannot set show_path to off without providing a custom header !");
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+}
+
+
+static char*
+ngx_http_fancyindex_ignore(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value;
+
+    (void) cmd; /* unused */
+
+#if (NGX_PCRE)
+    ngx_uint_t          i;
+    ngx_regex_elt_t    *re;
+    ngx_regex_compile_t rc;
+    u_char              errstr[NGX_MAX_CONF_ERRSTR];
+
+    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
+        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
+        if (alcf->ignore == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
+
+    rc.err.data = errstr;
+    rc.err.len  = NGX_MAX_CONF_ERRSTR;
+    rc.pool     = cf->pool;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        re = ngx_array_push(alcf->ignore);
+        if (re == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        rc.pattern = value[i];
+        rc.options = NGX_REGEX_CASELESS;
+
+        if (ngx_regex_compile(&rc) != NGX_OK) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+            return NGX_CONF_ERROR;
+        }
+
+        re->name  = value[i].data;
+        re->regex = rc.regex;
+    }
+
+    return NGX_CONF_OK;
+#else /* !NGX_PCRE */
+    ngx_uint_t i;
+    ngx_str_t *str;
+
+    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
+        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
+        if (alcf->ignore == NULL) {
+            return NGX_CONF_ERROR;
+        }
+    }
+
+    value = cf->args->elts;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+        str = ngx_array_push(alcf->ignore);
+        if (str == NULL) {
+            return NGX_CONF_ERROR;
+        }
+
+        str->data = value[i].data;
+        str->len  = value[i].len;
+    }
+
+    return NGX_CONF_OK;
+#endif /* NGX_PCRE */
+
+}
+
+
+static char*
+ngx_http_fancyindex_thread_pool(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value = cf->args->elts;
+
+    (void) cmd; /* unused */
+
+#if (NGX_THREADS)
+    if (alcf->thread_pool != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->thread_pool = NULL;
+        return NGX_CONF_OK;
+    }
+
+    alcf->thread_pool = ngx_thread_pool_add(cf, &value[1]);
+    if (alcf->thread_pool == NULL) {
+        return NGX_CONF_ERROR;
+    }
+
+    return NGX_CONF_OK;
+#else /* !NGX_THREADS */
+    (void) alcf; /* unused */
+
+    if (ngx_strcmp(value[1].data, "off") == 0)
+        return NGX_CONF_OK;
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"fancyindex_thread_pool\" requires Nginx built "
+                       "with thread pools support (--with-threads)");
+    return NGX_CONF_ERROR;
+#endif /* NGX_THREADS */
+}
+
+
+static char*
+ngx_http_fancyindex_io_uring(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    char                           *rv;
+
+    if ((rv = ngx_conf_set_flag_slot(cf, cmd, conf)) != NGX_CONF_OK)
+        return rv;
+
+#if !(NGX_HTTP_FANCYINDEX_IO_URING)
+    if (alcf->io_uring) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"fancyindex_io_uring\" is not available in this "
+                           "build, files are checked one at a time");
+        alcf->io_uring = 0;
+    }
+#else /* NGX_HTTP_FANCYINDEX_IO_URING */
+    (void) alcf; /* unused */
+#endif /* NGX_HTTP_FANCYINDEX_IO_URING */
+
+    return NGX_CONF_OK;
+}
+
+
+static char*
+ngx_http_fancyindex_parallel_sort(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t *value = cf->args->elts;
+    ngx_int_t  n;
+
+    (void) cmd; /* unused */
+
+    if (alcf->parallel_sort != NGX_CONF_UNSET_UINT)
+        return "is duplicate";
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->parallel_sort = 0;
+        return NGX_CONF_OK;
+    }
+
+#if (NGX_THREADS)
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n < 2) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid number of entries \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
+
+    alcf->parallel_sort = n;
+    return NGX_CONF_OK;
+#else /* !NGX_THREADS */
+    (void) n; /* unused */
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"fancyindex_parallel_sort\" requires Nginx built "
+                       "with thread pools support (--with-threads)");
+    return NGX_CONF_ERROR;
+#endif /* NGX_THREADS */
+}
+
+
+/*
+ * Parses "fancyindex_scan_cache", whose syntax mimics "open_file_cache":
+ *
+ *    fancyindex_scan_cache off | max=N [inactive=time] [valid=time];
+ */
+static char*
+ngx_http_fancyindex_scan_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t   *alcf = conf;
+    ngx_http_fancyindex_scan_cache_t *cache;
+    ngx_pool_cleanup_t               *cln;
+    ngx_str_t                        *value, s;
+    ngx_int_t                         max;
+    time_t                            inactive, valid;
+    ngx_uint_t                        i;
+
+    (void) cmd; /* unused */
+
+    if (alcf->scan_cache != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    value = cf->args->elts;
+
+    max = 0;
+    inactive = 60;
+    valid = 60;
+
+    for (i = 1; i < cf->args->nelts; i++) {
+
+        if (ngx_strncmp(value[i].data, "max=", 4) == 0) {
+            max = ngx_atoi(value[i].data + 4, value[i].len - 4);
+            if (max <= 0)
+                goto failed;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "inactive=", 9) == 0) {
+            s.len = value[i].len - 9;
+            s.data = value[i].data + 9;
+
+            inactive = ngx_parse_time(&s, 1);
+            if (inactive == (time_t) NGX_ERROR)
+                goto failed;
+            continue;
+        }
+
+        if (ngx_strncmp(value[i].data, "valid=", 6) == 0) {
+            s.len = value[i].len - 6;
+            s.data = value[i].data + 6;
+
+            valid = ngx_parse_time(&s, 1);
+            if (valid == (time_t) NGX_ERROR)
+                goto failed;
+            continue;
+        }
+
+        if (ngx_strcmp(value[i].data, "off") == 0) {
+            alcf->scan_cache = NULL;
+            continue;
+        }
+
+    failed:
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid \"fancyindex_scan_cache\" parameter \"%V\"",
+                           &value[i]);
+        return NGX_CONF_ERROR;
+    }
+
+    if (alcf->scan_cache == NULL)
+        return NGX_CONF_OK;
+
+    if (max == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"fancyindex_scan_cache\" must have the \"max\" parameter");
+        return NGX_CONF_ERROR;
+    }
+
+    if ((cache = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_scan_cache_t))) == NULL)
+        return NGX_CONF_ERROR;
+
+    ngx_rbtree_init(&cache->rbtree, &cache->sentinel, ngx_str_rbtree_insert_value);
+    ngx_queue_init(&cache->expire_queue);
+
+    cache->max = max;
+    cache->inactive = inactive;
+    cache->valid = valid;
+
+    if ((cln = ngx_pool_cleanup_add(cf->pool, 0)) == NULL)
+        return NGX_CONF_ERROR;
+
+    cln->handler = ngx_http_fancyindex_scan_cache_cleanup;
+    cln->data = cache;
+
+    alcf->scan_cache = cache;
+    return NGX_CONF_OK;
+}
+
+
+static char*
+ngx_http_fancyindex_index_path(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_str_t *path = (ngx_str_t *) ((char *) conf + cmd->offset);
+    ngx_str_t *value = cf->args->elts;
+
+    if (path->data)
+        return "is duplicate";
+
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        ngx_str_set(path, "");
+        return NGX_CONF_OK;
+    }
+
+    *path = value[1];
+
+    if (ngx_conf_full_name(cf->cycle, path, 0) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_checksum_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_fancyindex_checksum_ctx_t *octx = data;
+    ngx_http_fancyindex_checksum_ctx_t *zctx = shm_zone->data;
+    size_t                              len;
+
+    if (octx) {
+        zctx->sh = octx->sh;
+        zctx->shpool = octx->shpool;
+        return NGX_OK;
+    }
+
+    zctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zctx->sh = zctx->shpool->data;
+        return NGX_OK;
+    }
+
+    zctx->sh = ngx_slab_alloc(zctx->shpool, sizeof(ngx_http_fancyindex_checksum_sh_t));
+    if (zctx->sh == NULL)
+        return NGX_ERROR;
+
+    zctx->shpool->data = zctx->sh;
+
+    ngx_rbtree_init(&zctx->sh->rbtree, &zctx->sh->sentinel,
+                    ngx_http_fancyindex_checksum_insert_value);
+    ngx_queue_init(&zctx->sh->queue);
+
+    len = sizeof(" in fancyindex_checksum_zone \"\"") + shm_zone->shm.name.len;
+
+    zctx->shpool->log_ctx = ngx_slab_alloc(zctx->shpool, len);
+    if (zctx->shpool->log_ctx == NULL)
+        return NGX_ERROR;
+
+    ngx_sprintf(zctx->shpool->log_ctx, " in fancyindex_checksum_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+/*
+ * Adds a shared memory zone defined as "name:size", with its context
+ * data being "ctx".
+ */
+static char*
+ngx_http_fancyindex_zone(ngx_conf_t *cf, ngx_str_t *value,
+                         ngx_shm_zone_init_pt init, void *ctx)
+{
+    ngx_shm_zone_t *shm_zone;
+    ngx_str_t       name, s;
+    ssize_t         size;
+    u_char         *p;
+
+    p = (u_char *) ngx_strchr(value->data, ':');
+    if (p == NULL || p == value->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    name.data = value->data;
+    name.len = p - name.data;
+
+    s.data = p + 1;
+    s.len = value->data + value->len - s.data;
+
+    size = ngx_parse_size(&s);
+    if (size == NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid zone size \"%V\"", value);
+        return NGX_CONF_ERROR;
+    }
+
+    if (size < (ssize_t) (8 * ngx_pagesize)) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "zone \"%V\" is too small", value);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone = ngx_shared_memory_add(cf, &name, size, &ngx_http_fancyindex_module);
+    if (shm_zone == NULL)
+        return NGX_CONF_ERROR;
+
+    if (shm_zone->data) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "duplicate zone \"%V\"", &name);
+        return NGX_CONF_ERROR;
+    }
+
+    shm_zone->init = init;
+    shm_zone->data = ctx;
+
+    return NGX_CONF_OK;
+}
+
+
+static char*
+ngx_http_fancyindex_checksum_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_checksum_ctx_t *zctx;
+    ngx_str_t                          *value = cf->args->elts;
+
+    (void) cmd;  /* unused */
+    (void) conf; /* unused */
+
+    zctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_checksum_ctx_t));
+    if (zctx == NULL)
+        return NGX_CONF_ERROR;
+
+    return ngx_http_fancyindex_zone(cf, &value[1],
+                                    ngx_http_fancyindex_checksum_init_zone, zctx);
+}
+
+
+static char*
+ngx_http_fancyindex_checksum(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value = cf->args->elts;
+
+    (void) cmd; /* unused */
+
+    if (alcf->checksum_zone != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
+
+    if (cf->args->nelts == 2 && ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->checksum_zone = NULL;
+        return NGX_CONF_OK;
+    }
+
+#if (NGX_THREADS)
+    alcf->checksum_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                                &ngx_http_fancyindex_module);
+    if (alcf->checksum_zone == NULL)
+        return NGX_CONF_ERROR;
+
+    alcf->checksum_xattr = 0;
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strcmp(value[2].data, "xattr") != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+#if (NGX_LINUX)
+        alcf->checksum_xattr = 1;
+#else /* !NGX_LINUX */
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "\"xattr\" is not supported on this platform");
+        return NGX_CONF_ERROR;
+#endif /* NGX_LINUX */
+    }
+
+    return NGX_CONF_OK;
+#else /* !NGX_THREADS */
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"fancyindex_checksum\" requires Nginx built "
+                       "with thread pools support (--with-threads)");
+    return NGX_CONF_ERROR;
+#endif /* NGX_THREADS */
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_cache_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_fancyindex_cache_ctx_t  *octx = data;
+    ngx_http_fancyindex_cache_ctx_t  *zctx = shm_zone->data;
+    ngx_http_fancyindex_cache_node_t *cn;
+    ngx_queue_t                      *q;
+    size_t                            len;
+
+    if (octx) {
+        /*
+         * Listings rendered with settings which no location uses anymore
+         * are removed, and those which were watched are not kept up to
+         * date by the new worker processes.
+         */
+        zctx->sh = octx->sh;
+        zctx->shpool = octx->shpool;
+
+        ngx_shmtx_lock(&zctx->shpool->mutex);
+
+        zctx->generation = ++zctx->sh->generation;
+
+        q = ngx_queue_head(&zctx->sh->queue);
+
+        while (q != ngx_queue_sentinel(&zctx->sh->queue)) {
+            cn = ngx_queue_data(q, ngx_http_fancyindex_cache_node_t, queue);
+            q = ngx_queue_next(q);
+
+            if (cn->stored && !cn->updating
+                && !ngx_http_fancyindex_cache_settings_used(zctx, cn->settings))
+                ngx_http_fancyindex_cache_delete(zctx, cn);
+        }
+
+        ngx_shmtx_unlock(&zctx->shpool->mutex);
+        return NGX_OK;
+    }
+
+    zctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
+
+    if (shm_zone->shm.exists) {
+        zctx->sh = zctx->shpool->data;
+        zctx->generation = zctx->sh->generation;
+        return NGX_OK;
+    }
+
+    zctx->sh = ngx_slab_alloc(zctx->shpool, sizeof(ngx_http_fancyindex_cache_sh_t));
+    if (zctx->sh == NULL)
+        return NGX_ERROR;
+
+    zctx->shpool->data = zctx->sh;
+
+    ngx_rbtree_init(&zctx->sh->rbtree, &zctx->sh->sentinel,
+                    ngx_http_fancyindex_cache_insert_value);
+    ngx_queue_init(&zctx->sh->queue);
+    zctx->sh->generation = 0;
+    zctx->sh->size = 0;
+    zctx->generation = 0;
+
+    len = sizeof(" in fancyindex_cache_zone \"\"") + shm_zone->shm.name.len;
+
+    zctx->shpool->log_ctx = ngx_slab_alloc(zctx->shpool, len);
+    if (zctx->shpool->log_ctx == NULL)
+        return NGX_ERROR;
+
+    ngx_sprintf(zctx->shpool->log_ctx, " in fancyindex_cache_zone \"%V\"%Z",
+                &shm_zone->shm.name);
+
+    return NGX_OK;
+}
+
+
+static char*
+ngx_http_fancyindex_cache_zone(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_cache_ctx_t *zctx;
+    ngx_str_t                       *value = cf->args->elts;
+    ngx_str_t                        s;
+    ngx_path_t                      *path;
+    ngx_uint_t                       i, n;
+    u_char                          *p, *last;
+
+    (void) cmd;  /* unused */
+    (void) conf; /* unused */
+
+    zctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_cache_ctx_t));
+    if (zctx == NULL)
+        return NGX_CONF_ERROR;
+
+    if (ngx_array_init(&zctx->settings, cf->pool, 4, sizeof(uint32_t)) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    if ((path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t))) == NULL)
+        return NGX_CONF_ERROR;
+
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "path=", 5) == 0) {
+            path->name.data = value[i].data + 5;
+            path->name.len = value[i].len - 5;
+
+            if (path->name.len == 0)
+                goto invalid;
+
+            if (path->name.data[path->name.len - 1] == '/')
+                path->name.len--;
 
-            l = entry;
-            r = entry + entries.nelts - 1;
-            while (l < r)
-            {
-                while (l < r && l->dir)
-                    l++;
-                while (l < r && !r->dir)
-                    r--;
-                if (l < r) {
-                    /* Now l points a file while r points a directory */
-                    ngx_http_fancyindex_entry_t tmp;
-                    tmp = *l;
-                    *l = *r;
-                    *r = tmp;
-                }
-            }
-            if (r->dir)
-                r++;
+            if (ngx_conf_full_name(cf->cycle, &path->name, 0) != NGX_OK)
+                return NGX_CONF_ERROR;
 
-            if (r > entry)
-                /* Sort directories */
-                ngx_qsort(entry, (size_t)(r - entry),
-                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
-            if (r < entry + entries.nelts)
-                /* Sort files */
-                ngx_qsort(r, (size_t)(entry + entries.nelts - r),
-                        sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
-        } else {
-            ngx_qsort(entry, (size_t)entries.nelts,
-                    sizeof(ngx_http_fancyindex_entry_t), sort_cmp_func);
-        }
-    }
+        } else if (ngx_strncmp(value[i].data, "levels=", 7) == 0) {
+            /* The same as proxy_cache_path. */
+            p = value[i].data + 7;
+            last = value[i].data + value[i].len;
 
-    /* Display the path, if needed */
-    if (alcf->show_path){
-        b->last = last = (u_char *) ngx_escape_html(b->last, r->uri.data, r->uri.len);
-        b->last = ngx_cpymem_ssz(b->last, t05_body2);
-    }
+            for (n = 0; n < NGX_MAX_PATH_LEVEL && p < last; n++) {
+                if (*p <= '0' || *p >= '3')
+                    goto invalid;
 
-    /* Open the <table> tag */
-    b->last = ngx_cpymem_ssz(b->last, t06_list1);
+                path->level[n] = *p++ - '0';
+                path->len += path->level[n] + 1;
 
-    tp = ngx_timeofday();
+                if (p == last)
+                    break;
 
-    /* "Parent dir" entry, always first if displayed */
-    if (r->uri.len > 1 && alcf->hide_parent == 0) {
-        b->last = ngx_cpymem_ssz(b->last,
-                                 "<tr>"
-                                 "<td colspan=\"2\" class=\"link\"><a href=\"../");
-        if (*sort_url_args) {
-            b->last = ngx_cpymem(b->last,
-                                 sort_url_args,
-                                 ngx_sizeof_ssz("?C=N&amp;O=A"));
-        }
-        b->last = ngx_cpymem_ssz(b->last,
-                                 "\">Parent directory/</a></td>"
-                                 "<td class=\"size\">-</td>"
-                                 "<td class=\"date\">-</td>"
-                                 "</tr>"
-                                 CRLF);
-    }
+                if (*p++ != ':' || n == NGX_MAX_PATH_LEVEL - 1 || p == last)
+                    goto invalid;
+            }
 
-    /* Entries for directories and files */
-    for (i = 0; i < entries.nelts; i++) {
-        b->last = ngx_cpymem_ssz(b->last, "<tr><td colspan=\"2\" class=\"link\"><a href=\"");
+            if (path->len == 0 || p != last)
+                goto invalid;
 
-        if (entry[i].escape) {
-            ngx_fancyindex_escape_filename(b->last,
-                                           entry[i].name.data,
-                                           entry[i].name.len);
+        } else if (ngx_strncmp(value[i].data, "max_size=", 9) == 0) {
+            s.data = value[i].data + 9;
+            s.len = value[i].len - 9;
 
-            b->last += entry[i].name.len + entry[i].escape;
+            zctx->max_size = ngx_parse_offset(&s);
+            if (zctx->max_size < 0)
+                goto invalid;
 
         } else {
-            b->last = ngx_cpymem_str(b->last, entry[i].name);
+            goto invalid;
         }
+    }
 
-        if (entry[i].dir) {
-            *b->last++ = '/';
-            if (*sort_url_args) {
-                b->last = ngx_cpymem(b->last,
-                                     sort_url_args,
-                                     ngx_sizeof_ssz("?C=x&amp;O=y"));
-            }
+    if (path->name.len) {
+        if (path->name.len + 1 + path->len + 32 >= NGX_MAX_PATH) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "path \"%V\" is too long", &path->name);
+            return NGX_CONF_ERROR;
         }
 
-        *b->last++ = '"';
-        b->last = ngx_cpymem_ssz(b->last, " title=\"");
-        b->last = (u_char *) ngx_escape_html(b->last, entry[i].name.data, entry[i].name.len);
-        *b->last++ = '"';
-        *b->last++ = '>';
+        path->manager = ngx_http_fancyindex_cache_manager;
+        path->data = zctx;
+        path->conf_file = cf->conf_file->file.name.data;
+        path->line = cf->conf_file->line;
 
-        len = entry[i].utf_len;
+        zctx->path = path;
 
-        b->last = (u_char *) ngx_escape_html(b->last, entry[i].name.data, entry[i].name.len);
-        last = b->last - 3;
+        if (ngx_add_path(cf, &zctx->path) != NGX_OK)
+            return NGX_CONF_ERROR;
 
-        if (entry[i].dir) {
-            *b->last++ = '/';
-            len++;
+        if (zctx->path->data != zctx) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "path \"%V\" is used by something else",
+                               &path->name);
+            return NGX_CONF_ERROR;
         }
 
-        b->last = ngx_cpymem_ssz(b->last, "</a></td><td class=\"size\">");
+    } else if (path->len || zctx->max_size) {
+        return "requires \"path=\" for \"levels=\" and \"max_size=\"";
+    }
 
-        if (alcf->exact_size) {
-            if (entry[i].dir) {
-                *b->last++ = '-';
-            } else {
-                b->last = ngx_sprintf(b->last, "%19O", entry[i].size);
-            }
+    return ngx_http_fancyindex_zone(cf, &value[1],
+                                    ngx_http_fancyindex_cache_init_zone, zctx);
 
-        } else {
-            if (entry[i].dir) {
-                *b->last++ = '-';
-            } else {
-                length = entry[i].size;
-                multiplier = exbibyte;
+invalid:
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "invalid parameter \"%V\"", &value[i]);
+    return NGX_CONF_ERROR;
+}
 
-                for (j = 0; j < DIM(sizes) - 1 && length < multiplier; j++)
-                    multiplier /= 1024;
 
-                /* If we are showing the filesize in bytes, do not show a decimal */
-                if (j == DIM(sizes) - 1)
-                    b->last = ngx_sprintf(b->last, "%O %s", length, sizes[j]);
-                else
-                    b->last = ngx_sprintf(b->last, "%.1f %s",
-                                          (float) length / multiplier, sizes[j]);
-            }
-        }
+static char*
+ngx_http_fancyindex_cache(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value = cf->args->elts;
+
+    (void) cmd; /* unused */
 
-        ngx_gmtime(entry[i].mtime + tp->gmtoff * 60 * alcf->localtime, &tm);
-        b->last = ngx_cpymem_ssz(b->last, "</td><td class=\"date\">");
-        b->last = ngx_fancyindex_timefmt(b->last, &alcf->time_format, &tm);
-        b->last = ngx_cpymem_ssz(b->last, "</td></tr>");
+    if (alcf->cache_zone != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
 
-        *b->last++ = CR;
-        *b->last++ = LF;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        alcf->cache_zone = NULL;
+        return NGX_CONF_OK;
     }
 
-    /* Output table bottom */
-    b->last = ngx_cpymem_ssz(b->last, t07_list2);
+    alcf->cache_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                             &ngx_http_fancyindex_module);
+    if (alcf->cache_zone == NULL)
+        return NGX_CONF_ERROR;
 
-    *pb = b;
-    return NGX_OK;
+    return NGX_CONF_OK;
 }
 
 
-
-static ngx_int_t
-ngx_http_fancyindex_handler(ngx_http_request_t *r)
+static char*
+ngx_http_fancyindex_cache_use_stale(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_request_t             *sr;
-    ngx_str_t                      *sr_uri;
-    ngx_str_t                       rel_uri;
-    ngx_int_t                       rc;
-    ngx_http_fancyindex_loc_conf_t *alcf;
-    ngx_chain_t                     out[3] = {
-        { NULL, NULL }, { NULL, NULL}, { NULL, NULL }};
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value = cf->args->elts;
+    ngx_str_t                       s;
 
+    (void) cmd; /* unused */
 
-    if (r->uri.data[r->uri.len - 1] != '/') {
-        return NGX_DECLINED;
-    }
+    if (alcf->cache_use_stale != NGX_CONF_UNSET)
+        return "is duplicate";
 
-    /* TODO: Win32 */
-#if defined(nginx_version) \
-    && ((nginx_version < 7066) \
-        || ((nginx_version > 8000) && (nginx_version < 8038)))
-    if (r->zero_in_uri) {
-        return NGX_DECLINED;
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2)
+            return "takes no parameters with \"off\"";
+
+        alcf->cache_use_stale = 0;
+        return NGX_CONF_OK;
     }
-#endif
 
-    if (!(r->method & (NGX_HTTP_GET|NGX_HTTP_HEAD))) {
-        return NGX_DECLINED;
+    if (ngx_strcmp(value[1].data, "updating") != 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    alcf = ngx_http_get_module_loc_conf(r, ngx_http_fancyindex_module);
+    alcf->cache_use_stale = 1;
 
-    if (!alcf->enable) {
-        return NGX_DECLINED;
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "max=", 4) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 4;
+        s.len = value[2].len - 4;
+
+        alcf->cache_max_stale = ngx_parse_time(&s, 1);
+        if (alcf->cache_max_stale == (time_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid max value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
     }
 
-    if ((rc = make_content_buf(r, &out[0].buf, alcf)) != NGX_OK)
-        return rc;
+    return NGX_CONF_OK;
+}
 
-    out[0].buf->last_in_chain = 1;
 
-    r->headers_out.status = NGX_HTTP_OK;
-    r->headers_out.content_type_len  = ngx_sizeof_ssz("text/html");
-    r->headers_out.content_type.len  = ngx_sizeof_ssz("text/html");
-    r->headers_out.content_type.data = (u_char *) "text/html";
+static char*
+ngx_http_fancyindex_cache_control(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    ngx_str_t                      *value = cf->args->elts;
+    ngx_str_t                       s;
 
-    rc = ngx_http_send_header(r);
-    if (rc == NGX_ERROR || rc > NGX_OK || r->header_only)
-        return rc;
+    (void) cmd; /* unused */
 
-    if (alcf->header.path.len > 0 && alcf->header.local.len == 0) {
-        /* URI is configured, make Nginx take care of with a subrequest. */
-        sr_uri = &alcf->header.path;
+    if (alcf->cache_control != NGX_CONF_UNSET)
+        return "is duplicate";
 
-        if (*sr_uri->data != '/') {
-            /* Relative path */
-            rel_uri.len  = r->uri.len + alcf->header.path.len;
-            rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
-            if (rel_uri.data == NULL) {
-                return NGX_HTTP_INTERNAL_SERVER_ERROR;
-            }
-            ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
-                    alcf->header.path.data, alcf->header.path.len);
-            sr_uri = &rel_uri;
-        }
+    alcf->cache_control_swr = -1;
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: header subrequest \"%V\"", sr_uri);
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2)
+            return "takes no parameters with \"off\"";
 
-        rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
-        if (rc == NGX_ERROR || rc == NGX_DONE) {
-            ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                    "http fancyindex: header subrequest for \"%V\" failed", sr_uri);
-            return rc;
-        }
+        alcf->cache_control = -1;
+        return NGX_CONF_OK;
+    }
 
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: header subrequest status = %i",
-                sr->headers_out.status);
-        /* ngx_http_subrequest returns NGX_OK(0), not NGX_HTTP_OK(200) */
-        if (sr->headers_out.status != NGX_OK) {
-            /*
-             * XXX: Should we write a message to the error log just in case
-             * we get something different from a 404?
-             */
-            goto add_builtin_header;
-        }
+    alcf->cache_control = ngx_parse_time(&value[1], 1);
+    if (alcf->cache_control == (time_t) NGX_ERROR) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
-    else {
-add_builtin_header:
-        /* Make space before */
-        out[1].next = out[0].next;
-        out[1].buf  = out[0].buf;
-        /* Chain header buffer */
-        out[0].next = &out[1];
-        if (alcf->header.local.len > 0) {
-            /* Header buffer is local, make a buffer pointing to the data. */
-            out[0].buf = ngx_calloc_buf(r->pool);
-            if (out[0].buf == NULL)
-                return NGX_ERROR;
-            out[0].buf->memory = 1;
-            out[0].buf->pos = alcf->header.local.data;
-            out[0].buf->last = alcf->header.local.data + alcf->header.local.len;
-        } else {
-            /* Prepare a buffer with the contents of the builtin header. */
-            out[0].buf = make_header_buf(r, alcf->css_href);
+
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "stale-while-revalidate=", 23) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+
+        s.data = value[2].data + 23;
+        s.len = value[2].len - 23;
+
+        alcf->cache_control_swr = ngx_parse_time(&s, 1);
+        if (alcf->cache_control_swr == (time_t) NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid stale-while-revalidate value \"%V\"",
+                               &value[2]);
+            return NGX_CONF_ERROR;
         }
     }
 
-    /* If footer is disabled, chain up footer buffer. */
-    if (alcf->footer.path.len == 0 || alcf->footer.local.len > 0) {
-        ngx_uint_t last = ((alcf->header.path.len > 0) && (alcf->header.local.len == 0)) ? 1 : 2;
+    return NGX_CONF_OK;
+}
 
-        out[last-1].next = &out[last];
-        out[last].buf = ngx_calloc_buf(r->pool);
-        if (out[last].buf == NULL)
-            return NGX_ERROR;
 
-        out[last].buf->memory = 1;
-        if (alcf->footer.local.len > 0) {
-            out[last].buf->pos = alcf->footer.local.data;
-            out[last].buf->last = alcf->footer.local.data + alcf->footer.local.len;
-        } else {
-            out[last].buf->pos = (u_char*) t08_foot1;
-            out[last].buf->last = (u_char*) t08_foot1 + sizeof(t08_foot1) - 1;
-        }
+static char*
+ngx_http_fancyindex_purge(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t   *alcf = conf;
+    ngx_http_core_loc_conf_t         *clcf;
+    ngx_http_compile_complex_value_t  ccv;
+    ngx_str_t                        *value = cf->args->elts;
 
-        out[last-1].buf->last_in_chain = 0;
-        out[last].buf->last_in_chain   = 1;
-        out[last].buf->last_buf        = 1;
-        /* Send everything with a single call :D */
-        return ngx_http_output_filter(r, &out[0]);
-    }
+    (void) cmd; /* unused */
 
-    /*
-     * If we reach here, we were asked to send a custom footer. We need to:
-     * partially send whatever is referenced from out[0] and then send the
-     * footer as a subrequest. If the subrequest fails, we should send the
-     * standard footer as well.
-     */
-    rc = ngx_http_output_filter(r, &out[0]);
+    if (alcf->purge_zone)
+        return "is duplicate";
 
-    if (rc != NGX_OK && rc != NGX_AGAIN)
-        return NGX_HTTP_INTERNAL_SERVER_ERROR;
+    alcf->purge_zone = ngx_shared_memory_add(cf, &value[1], 0,
+                                             &ngx_http_fancyindex_module);
+    if (alcf->purge_zone == NULL)
+        return NGX_CONF_ERROR;
 
-    /* URI is configured, make Nginx take care of with a subrequest. */
-    sr_uri = &alcf->footer.path;
+    alcf->purge_prefix = ngx_palloc(cf->pool, sizeof(ngx_http_complex_value_t));
+    if (alcf->purge_prefix == NULL)
+        return NGX_CONF_ERROR;
 
-    if (*sr_uri->data != '/') {
-        /* Relative path */
-        rel_uri.len  = r->uri.len + alcf->footer.path.len;
-        rel_uri.data = ngx_palloc(r->pool, rel_uri.len);
-        if (rel_uri.data == NULL) {
-            return NGX_HTTP_INTERNAL_SERVER_ERROR;
-        }
-        ngx_memcpy(ngx_cpymem(rel_uri.data, r->uri.data, r->uri.len),
-                alcf->footer.path.data, alcf->footer.path.len);
-        sr_uri = &rel_uri;
-    }
+    ngx_memzero(&ccv, sizeof(ngx_http_compile_complex_value_t));
+    ccv.cf = cf;
+    ccv.value = &value[2];
+    ccv.complex_value = alcf->purge_prefix;
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "http fancyindex: footer subrequest \"%V\"", sr_uri);
+    if (ngx_http_compile_complex_value(&ccv) != NGX_OK)
+        return NGX_CONF_ERROR;
 
-    rc = ngx_http_subrequest(r, sr_uri, NULL, &sr, NULL, 0);
-    if (rc == NGX_ERROR || rc == NGX_DONE) {
-        ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-                "http fancyindex: footer subrequest for \"%V\" failed", sr_uri);
-        return rc;
+    clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    clcf->handler = ngx_http_fancyindex_purge_handler;
+
+    return NGX_CONF_OK;
+}
+
+
+static ngx_int_t
+ngx_http_fancyindex_scan_limit_init_zone(ngx_shm_zone_t *shm_zone, void *data)
+{
+    ngx_http_fancyindex_scan_limit_ctx_t *octx = data;
+    ngx_http_fancyindex_scan_limit_ctx_t *zctx = shm_zone->data;
+
+    /* Scans started before a reload are still counted. */
+    if (octx) {
+        zctx->sh = octx->sh;
+        zctx->shpool = octx->shpool;
+        return NGX_OK;
     }
 
-    ngx_log_debug1(NGX_LOG_DEBUG_HTTP, r->connection->log, 0,
-            "http fancyindex: header subrequest status = %i",
-            sr->headers_out.status);
+    zctx->shpool = (ngx_slab_pool_t *) shm_zone->shm.addr;
 
-    /* see above: ngx_http_subrequest resturns NGX_OK (0) not NGX_HTTP_OK (200) */
-    if (sr->headers_out.status != NGX_OK) {
-        /*
-         * XXX: Should we write a message to the error log just in case
-         * we get something different from a 404?
-         */
-        out[0].next = NULL;
-        out[0].buf = ngx_calloc_buf(r->pool);
-        if (out[0].buf == NULL)
-            return NGX_ERROR;
-        out[0].buf->memory = 1;
-        out[0].buf->pos = (u_char*) t08_foot1;
-        out[0].buf->last = (u_char*) t08_foot1 + sizeof(t08_foot1) - 1;
-        out[0].buf->last_in_chain = 1;
-        out[0].buf->last_buf = 1;
-        /* Directly send out the builtin footer */
-        return ngx_http_output_filter(r, &out[0]);
+    if (shm_zone->shm.exists) {
+        zctx->sh = zctx->shpool->data;
+        return NGX_OK;
     }
 
-    return (r != r->main) ? rc : ngx_http_send_special(r, NGX_HTTP_LAST);
-}
+    zctx->sh = ngx_slab_alloc(zctx->shpool,
+                              sizeof(ngx_http_fancyindex_scan_limit_sh_t));
+    if (zctx->sh == NULL)
+        return NGX_ERROR;
 
+    zctx->shpool->data = zctx->sh;
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_cs_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_rbtree_init(&zctx->sh->rbtree, &zctx->sh->sentinel,
+                    ngx_rbtree_insert_value);
 
-    return (int) ngx_strcmp(second->name.data, first->name.data);
+    zctx->shpool->log_ctx = (u_char *) " in fancyindex_scan_limit zone";
+
+    return NGX_OK;
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_ci_desc(const void *one, const void *two)
+static char*
+ngx_http_fancyindex_scan_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_http_fancyindex_loc_conf_t       *alcf = conf;
+    ngx_http_fancyindex_scan_limit_ctx_t *zctx;
+    ngx_str_t                            *value = cf->args->elts;
+    ngx_str_t                             name, s;
+    ngx_int_t                             n;
+    ngx_uint_t                            i;
+
+    (void) cmd; /* unused */
+
+    if (alcf->scan_limit_zone != NGX_CONF_UNSET_PTR)
+        return "is duplicate";
 
-    return (int) ngx_strcasecmp(second->name.data, first->name.data);
-}
+    if (ngx_strcmp(value[1].data, "off") == 0) {
+        if (cf->args->nelts != 2)
+            return "takes no parameters with \"off\"";
 
+        alcf->scan_limit_zone = NULL;
+        return NGX_CONF_OK;
+    }
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_size_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
-    return (first->size < second->size) - (first->size > second->size);
-}
+    alcf->scan_limit = n;
+    alcf->scan_limit_queue = 0;
+    alcf->scan_limit_timeout = 5000;
 
+    for (i = 2; i < cf->args->nelts; i++) {
+        if (ngx_strncmp(value[i].data, "queue=", 6) == 0) {
+            n = ngx_atoi(value[i].data + 6, value[i].len - 6);
+            if (n == NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid queue value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            alcf->scan_limit_queue = n;
+            continue;
+        }
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_mtime_desc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+        if (ngx_strncmp(value[i].data, "timeout=", 8) == 0) {
+            s.data = value[i].data + 8;
+            s.len = value[i].len - 8;
 
-    return (int) (second->mtime - first->mtime);
-}
+            alcf->scan_limit_timeout = ngx_parse_time(&s, 0);
+            if (alcf->scan_limit_timeout == (ngx_msec_t) NGX_ERROR) {
+                ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                                   "invalid timeout value \"%V\"", &value[i]);
+                return NGX_CONF_ERROR;
+            }
+            continue;
+        }
 
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid parameter \"%V\"", &value[i]);
+        return NGX_CONF_ERROR;
+    }
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_cs_asc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_str_set(&name, NGX_HTTP_FANCYINDEX_SCAN_LIMIT_ZONE);
 
-    return (int) ngx_strcmp(first->name.data, second->name.data);
-}
+    alcf->scan_limit_zone = ngx_shared_memory_add(cf, &name,
+                                                  NGX_HTTP_FANCYINDEX_SCAN_LIMIT_SIZE,
+                                                  &ngx_http_fancyindex_module);
+    if (alcf->scan_limit_zone == NULL)
+        return NGX_CONF_ERROR;
 
+    if (alcf->scan_limit_zone->data == NULL) {
+        zctx = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_scan_limit_ctx_t));
+        if (zctx == NULL)
+            return NGX_CONF_ERROR;
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_name_ci_asc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+        alcf->scan_limit_zone->init = ngx_http_fancyindex_scan_limit_init_zone;
+        alcf->scan_limit_zone->data = zctx;
+    }
 
-    return (int) ngx_strcasecmp(first->name.data, second->name.data);
+    return NGX_CONF_OK;
 }
 
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_size_asc(const void *one, const void *two)
+/*
+ * Parses the arguments of fancyindex_watch and fancyindex_preload, which
+ * are "uri [depth=number]".
+ */
+static char*
+ngx_http_fancyindex_tree(ngx_conf_t *cf, ngx_http_fancyindex_tree_t *tree,
+                         ngx_http_fancyindex_loc_conf_t *alcf)
 {
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    ngx_str_t *value = cf->args->elts;
+    ngx_int_t  n;
 
-    return (first->size > second->size) - (first->size < second->size);
-}
+    if (value[1].data[0] != '/' || value[1].data[value[1].len - 1] != '/') {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "URI \"%V\" must start and end with a slash",
+                           &value[1]);
+        return NGX_CONF_ERROR;
+    }
 
+    ngx_memzero(tree, sizeof(ngx_http_fancyindex_tree_t));
+    tree->uri = value[1];
+    tree->clcf = ngx_http_conf_get_module_loc_conf(cf, ngx_http_core_module);
+    tree->alcf = alcf;
+    tree->directive = (const char *) value[0].data;
+    tree->file = cf->conf_file->file.name.data;
+    tree->line = cf->conf_file->line;
 
-static int ngx_libc_cdecl
-ngx_http_fancyindex_cmp_entries_mtime_asc(const void *one, const void *two)
-{
-    ngx_http_fancyindex_entry_t *first = (ngx_http_fancyindex_entry_t *) one;
-    ngx_http_fancyindex_entry_t *second = (ngx_http_fancyindex_entry_t *) two;
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "depth=", 6) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
 
-    return (int) (first->mtime - second->mtime);
+        n = ngx_atoi(value[2].data + 6, value[2].len - 6);
+        if (n == NGX_ERROR) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid depth value \"%V\"", &value[2]);
+            return NGX_CONF_ERROR;
+        }
+        tree->depth = n;
+    }
+
+    return NGX_CONF_OK;
 }
 
 
-static ngx_int_t
-ngx_http_fancyindex_error(ngx_http_request_t *r, ngx_dir_t *dir, ngx_str_t *name)
+static char*
+ngx_http_fancyindex_watch(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    if (ngx_close_dir(dir) == NGX_ERROR) {
-        ngx_log_error(NGX_LOG_ALERT, r->connection->log, ngx_errno,
-                      ngx_close_dir_n " \"%V\" failed", name);
-    }
+#if (NGX_LINUX)
+    ngx_http_fancyindex_main_conf_t *amcf;
+    ngx_http_fancyindex_watch_t     *w;
+    ngx_path_t                      *path;
 
-    return NGX_HTTP_INTERNAL_SERVER_ERROR;
-}
+    (void) cmd; /* unused */
 
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
 
-static void *
-ngx_http_fancyindex_create_loc_conf(ngx_conf_t *cf)
-{
-    ngx_http_fancyindex_loc_conf_t  *conf;
+    if ((w = ngx_array_push(&amcf->watches)) == NULL)
+        return NGX_CONF_ERROR;
 
-    conf = ngx_pcalloc(cf->pool, sizeof(ngx_http_fancyindex_loc_conf_t));
-    if (conf == NULL) {
+    ngx_memzero(w, sizeof(ngx_http_fancyindex_watch_t));
+
+    if (ngx_http_fancyindex_tree(cf, &w->tree, conf) != NGX_CONF_OK)
         return NGX_CONF_ERROR;
-    }
+
+    if (amcf->watches.nelts > 1)
+        return NGX_CONF_OK;
 
     /*
-     * Set by ngx_pcalloc:
-     *    conf->header.*.len     = 0
-     *    conf->header.*.data    = NULL
-     *    conf->footer.*.len     = 0
-     *    conf->footer.*.data    = NULL
-     *    conf->css_href.len     = 0
-     *    conf->css_href.data    = NULL
-     *    conf->time_format.len  = 0
-     *    conf->time_format.data = NULL
+     * A path with a "manager" callback makes Nginx start the cache manager
+     * process. Its directory is created, though nothing is stored in it.
      */
-    conf->enable         = NGX_CONF_UNSET;
-    conf->default_sort   = NGX_CONF_UNSET_UINT;
-    conf->case_sensitive = NGX_CONF_UNSET;
-    conf->dirs_first     = NGX_CONF_UNSET;
-    conf->localtime      = NGX_CONF_UNSET;
-    conf->exact_size     = NGX_CONF_UNSET;
-    conf->ignore         = NGX_CONF_UNSET_PTR;
-    conf->hide_symlinks  = NGX_CONF_UNSET;
-    conf->show_path      = NGX_CONF_UNSET;
-    conf->hide_parent    = NGX_CONF_UNSET;
-    conf->show_dot_files = NGX_CONF_UNSET;
+    if ((path = ngx_pcalloc(cf->pool, sizeof(ngx_path_t))) == NULL)
+        return NGX_CONF_ERROR;
 
-    return conf;
+    ngx_str_set(&path->name, NGX_HTTP_FANCYINDEX_WATCH_PATH);
+
+    if (ngx_conf_full_name(cf->cycle, &path->name, 0) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    path->manager = ngx_http_fancyindex_watch_manager;
+    path->data = amcf;
+    path->conf_file = cf->conf_file->file.name.data;
+    path->line = cf->conf_file->line;
+
+    if (ngx_add_path(cf, &path) != NGX_OK)
+        return NGX_CONF_ERROR;
+
+    return NGX_CONF_OK;
+#else /* !NGX_LINUX */
+    (void) cmd;  /* unused */
+    (void) conf; /* unused */
+
+    ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                       "\"fancyindex_watch\" is not supported on this platform");
+    return NGX_CONF_ERROR;
+#endif /* NGX_LINUX */
 }
 
 
-static char *
-ngx_http_fancyindex_merge_loc_conf(ngx_conf_t *cf, void *parent, void *child)
+static char*
+ngx_http_fancyindex_preload(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_fancyindex_loc_conf_t *prev = parent;
-    ngx_http_fancyindex_loc_conf_t *conf = child;
+    ngx_http_fancyindex_main_conf_t *amcf;
+    ngx_http_fancyindex_tree_t      *tree;
 
-    (void) cf; /* unused */
+    (void) cmd; /* unused */
 
-    ngx_conf_merge_value(conf->enable, prev->enable, 0);
-    ngx_conf_merge_uint_value(conf->default_sort, prev->default_sort, NGX_HTTP_FANCYINDEX_SORT_CRITERION_NAME);
-    ngx_conf_merge_value(conf->case_sensitive, prev->case_sensitive, 1);
-    ngx_conf_merge_value(conf->dirs_first, prev->dirs_first, 1);
-    ngx_conf_merge_value(conf->localtime, prev->localtime, 0);
-    ngx_conf_merge_value(conf->exact_size, prev->exact_size, 1);
-    ngx_conf_merge_value(conf->show_path, prev->show_path, 1);
-    ngx_conf_merge_value(conf->show_dot_files, prev->show_dot_files, 0);
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
 
-    ngx_conf_merge_str_value(conf->header.path, prev->header.path, "");
-    ngx_conf_merge_str_value(conf->header.local, prev->header.local, "");
-    ngx_conf_merge_str_value(conf->footer.path, prev->footer.path, "");
-    ngx_conf_merge_str_value(conf->footer.local, prev->footer.local, "");
+    if ((tree = ngx_array_push(&amcf->preloads)) == NULL)
+        return NGX_CONF_ERROR;
 
-    ngx_conf_merge_str_value(conf->css_href, prev->css_href, "");
-    ngx_conf_merge_str_value(conf->time_format, prev->time_format, "%Y-%b-%d %H:%M");
+    return ngx_http_fancyindex_tree(cf, tree, conf);
+}
 
-    ngx_conf_merge_ptr_value(conf->ignore, prev->ignore, NULL);
-    ngx_conf_merge_value(conf->hide_symlinks, prev->hide_symlinks, 0);
-    ngx_conf_merge_value(conf->hide_parent, prev->hide_parent, 0);
 
-    /* Just make sure we haven't disabled the show_path directive without providing a custom header */
-    if (conf->show_path == 0 && conf->header.path.len == 0)
-    {
-        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "FancyIndex : cannot set show_path to off without providing a custom header !");
-        return NGX_CONF_ERROR;
+static char*
+ngx_http_fancyindex_events(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+{
+    ngx_http_fancyindex_loc_conf_t *alcf = conf;
+    char                           *rv;
+
+    if ((rv = ngx_conf_set_flag_slot(cf, cmd, conf)) != NGX_CONF_OK)
+        return rv;
+
+#if !(NGX_LINUX)
+    if (alcf->events) {
+        ngx_conf_log_error(NGX_LOG_WARN, cf, 0,
+                           "\"fancyindex_events\" needs inotify, which is "
+                           "not available on this platform");
+        alcf->events = 0;
     }
+#else /* NGX_LINUX */
+    (void) alcf; /* unused */
+#endif /* NGX_LINUX */
 
     return NGX_CONF_OK;
 }
 
 
+/*
+ * Parses "watches [subscribers=number]".
+ */
 static char*
-ngx_http_fancyindex_ignore(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
+ngx_http_fancyindex_events_limit(ngx_conf_t *cf, ngx_command_t *cmd, void *conf)
 {
-    ngx_http_fancyindex_loc_conf_t *alcf = conf;
-    ngx_str_t *value;
+    ngx_http_fancyindex_main_conf_t *amcf = conf;
+    ngx_str_t                       *value = cf->args->elts;
+    ngx_int_t                        n;
 
     (void) cmd; /* unused */
 
-#if (NGX_PCRE)
-    ngx_uint_t          i;
-    ngx_regex_elt_t    *re;
-    ngx_regex_compile_t rc;
-    u_char              errstr[NGX_MAX_CONF_ERRSTR];
+    if (amcf->events_watches != NGX_CONF_UNSET_UINT)
+        return "is duplicate";
 
-    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
-        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_regex_elt_t));
-        if (alcf->ignore == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    n = ngx_atoi(value[1].data, value[1].len);
+    if (n == NGX_ERROR || n == 0) {
+        ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                           "invalid value \"%V\"", &value[1]);
+        return NGX_CONF_ERROR;
     }
 
-    value = cf->args->elts;
-
-    ngx_memzero(&rc, sizeof(ngx_regex_compile_t));
-
-    rc.err.data = errstr;
-    rc.err.len  = NGX_MAX_CONF_ERRSTR;
-    rc.pool     = cf->pool;
+    amcf->events_watches = n;
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        re = ngx_array_push(alcf->ignore);
-        if (re == NULL) {
+    if (cf->args->nelts == 3) {
+        if (ngx_strncmp(value[2].data, "subscribers=", 12) != 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid parameter \"%V\"", &value[2]);
             return NGX_CONF_ERROR;
         }
 
-        rc.pattern = value[i];
-        rc.options = NGX_REGEX_CASELESS;
-
-        if (ngx_regex_compile(&rc) != NGX_OK) {
-            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0, "%V", &rc.err);
+        n = ngx_atoi(value[2].data + 12, value[2].len - 12);
+        if (n == NGX_ERROR || n == 0) {
+            ngx_conf_log_error(NGX_LOG_EMERG, cf, 0,
+                               "invalid subscribers value \"%V\"", &value[2]);
             return NGX_CONF_ERROR;
         }
 
-        re->name  = value[i].data;
-        re->regex = rc.regex;
+        amcf->events_subscribers = n;
     }
 
     return NGX_CONF_OK;
-#else /* !NGX_PCRE */
-    ngx_uint_t i;
-    ngx_str_t *str;
+}
 
-    if (alcf->ignore == NGX_CONF_UNSET_PTR) {
-        alcf->ignore = ngx_array_create(cf->pool, 2, sizeof(ngx_str_t));
-        if (alcf->ignore == NULL) {
-            return NGX_CONF_ERROR;
-        }
+
+/*
+ * Checks the trees rendered in advance once locations are merged, and maps
+ * their URIs to paths like ngx_http_map_uri_to_path() does. That can be
+ * done only in advance without variables in "root" or "alias".
+ */
+static ngx_int_t
+ngx_http_fancyindex_tree_init(ngx_conf_t *cf, ngx_http_fancyindex_tree_t *tree)
+{
+    ngx_http_core_loc_conf_t *clcf = tree->clcf;
+    size_t                    alias = clcf->alias;
+    u_char                   *last;
+
+    if (tree->alcf->cache_zone == NULL) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"%s\" requires \"fancyindex_cache\" in %s:%ui",
+                      tree->directive, tree->file, tree->line);
+        return NGX_ERROR;
     }
 
-    value = cf->args->elts;
+    if (tree->alcf->default_sort == NGX_HTTP_FANCYINDEX_SORT_CRITERION_NONE) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"%s\" cannot be used with unsorted listings in %s:%ui",
+                      tree->directive, tree->file, tree->line);
+        return NGX_ERROR;
+    }
 
-    for (i = 1; i < cf->args->nelts; i++) {
-        str = ngx_array_push(alcf->ignore);
-        if (str == NULL) {
-            return NGX_CONF_ERROR;
-        }
+    if (clcf->root_lengths || alias == NGX_MAX_SIZE_T_VALUE) {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"%s\" cannot be used with variables in \"root\" "
+                      "or \"alias\" in %s:%ui",
+                      tree->directive, tree->file, tree->line);
+        return NGX_ERROR;
+    }
 
-        str->data = value[i].data;
-        str->len  = value[i].len;
+    if (alias && (tree->uri.len < alias
+                  || ngx_strncmp(tree->uri.data, clcf->name.data, alias) != 0))
+    {
+        ngx_log_error(NGX_LOG_EMERG, cf->log, 0,
+                      "\"%s\" URI \"%V\" is outside of the location in %s:%ui",
+                      tree->directive, &tree->uri, tree->file, tree->line);
+        return NGX_ERROR;
     }
 
-    return NGX_CONF_OK;
-#endif /* NGX_PCRE */
+    tree->path.data = ngx_pnalloc(cf->pool,
+                                  clcf->root.len + tree->uri.len - alias);
+    if (tree->path.data == NULL)
+        return NGX_ERROR;
+
+    last = ngx_cpymem(tree->path.data, clcf->root.data, clcf->root.len);
+    last = ngx_cpymem(last, tree->uri.data + alias, tree->uri.len - alias);
 
+    /* Without the trailing slash, as in make_content_buf(). */
+    tree->path.len = last - tree->path.data;
+    if (tree->path.len > 1)
+        tree->path.len--;
+
+    return NGX_OK;
 }
 
 
 static ngx_int_t
 ngx_http_fancyindex_init(ngx_conf_t *cf)
 {
-    ngx_http_handler_pt        *h;
-    ngx_http_core_main_conf_t  *cmcf;
+    ngx_http_handler_pt              *h;
+    ngx_http_core_main_conf_t        *cmcf;
+    ngx_http_fancyindex_main_conf_t  *amcf;
+    ngx_http_fancyindex_watch_t      *w;
+    ngx_http_fancyindex_tree_t       *tree;
+    ngx_uint_t                        i;
+
+    amcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_fancyindex_module);
+
+    w = amcf->watches.elts;
+    for (i = 0; i < amcf->watches.nelts; i++) {
+        if (ngx_http_fancyindex_tree_init(cf, &w[i].tree) != NGX_OK)
+            return NGX_ERROR;
+    }
+
+    tree = amcf->preloads.elts;
+    for (i = 0; i < amcf->preloads.nelts; i++) {
+        if (ngx_http_fancyindex_tree_init(cf, &tree[i]) != NGX_OK)
+            return NGX_ERROR;
+    }
 
     cmcf = ngx_http_conf_get_module_main_conf(cf, ngx_http_core_module);
 
@@ -1620,5 +11221,63 @@ ngx_http_fancyindex_init(ngx_conf_t *cf)
     return NGX_OK;
 }
 
+
+/*
+ * Sets up the lists of reusable render buffers, and starts preloading, in
+ * a single process as the cache is shared.
+ */
+static ngx_int_t
+ngx_http_fancyindex_init_process(ngx_cycle_t *cycle)
+{
+    ngx_http_fancyindex_main_conf_t *amcf;
+    ngx_http_fancyindex_tree_dir_t  *d;
+    ngx_http_fancyindex_tree_t      *tree;
+    ngx_uint_t                       i;
+
+    amcf = ngx_http_cycle_get_module_main_conf(cycle, ngx_http_fancyindex_module);
+
+    if (amcf == NULL)
+        return NGX_OK;
+
+    if (amcf->buffer_pool) {
+        for (i = 0; i < NGX_HTTP_FANCYINDEX_BUFFER_CLASSES; i++) {
+            ngx_queue_init(&amcf->buffers[i]);
+        }
+
+#if (NGX_THREADS)
+        if (ngx_thread_mutex_create(&amcf->buffer_mutex, cycle->log) != NGX_OK)
+            return NGX_ERROR;
+#endif
+    }
+
+    if (amcf->preloads.nelts == 0)
+        return NGX_OK;
+
+    if (!(ngx_process == NGX_PROCESS_WORKER && ngx_worker == 0)
+        && ngx_process != NGX_PROCESS_SINGLE)
+        return NGX_OK;
+
+    ngx_queue_init(&amcf->preload_queue);
+
+    tree = amcf->preloads.elts;
+    for (i = 0; i < amcf->preloads.nelts; i++) {
+        d = ngx_http_fancyindex_tree_dir(&tree[i], tree[i].path.data,
+                                         tree[i].path.len, tree[i].uri.data,
+                                         tree[i].uri.len, tree[i].depth);
+        if (d == NULL)
+            return NGX_ERROR;
+
+        ngx_queue_insert_tail(&amcf->preload_queue, &d->queue);
+    }
+
+    amcf->preload_event.handler = ngx_http_fancyindex_preload_handler;
+    amcf->preload_event.data = amcf;
+    amcf->preload_event.log = cycle->log;
+    amcf->preload_event.cancelable = 1;
+    ngx_add_timer(&amcf->preload_event, NGX_HTTP_FANCYINDEX_PRELOAD_DELAY);
+
+    return NGX_OK;
+}
+
 /* vim:et:sw=4:ts=4:
  */
@@ -36,11 +36,14 @@ static const u_char t01_head1[] = ""
 "a:hover {"
 "color:#e33;"
 "}"
-".link {"
+".link, .compact td:first-child {"
 "white-space: nowrap;"
 "text-overflow: '>';"
 "overflow: hidden;"
 "}"
+".checksum, .compact td:nth-child(4) {"
+"font-family:monospace;"
+"}"
 "</style>"
 "\n"
 ;
@@ -68,6 +71,16 @@ static const u_char t06_list1[] = ""
 "<th colspan=\"2\"><a href=\"?C=N&amp;O=A\">File Name</a>&nbsp;<a href=\"?C=N&amp;O=D\">&nbsp;&darr;&nbsp;</a></th>"
 "<th><a href=\"?C=S&amp;O=A\">File Size</a>&nbsp;<a href=\"?C=S&amp;O=D\">&nbsp;&darr;&nbsp;</a></th>"
 "<th><a href=\"?C=M&amp;O=A\">Date</a>&nbsp;<a href=\"?C=M&amp;O=D\">&nbsp;&darr;&nbsp;</a></th>"
+;
+static const u_char t06_list1_compact[] = ""
+"<table id=\"list\" class=\"compact\">"
+"<thead>"
+"<tr>"
+"<th><a href=\"?C=N&amp;O=A\">File Name</a>&nbsp;<a href=\"?C=N&amp;O=D\">&nbsp;&darr;&nbsp;</a></th>"
+"<th><a href=\"?C=S&amp;O=A\">File Size</a>&nbsp;<a href=\"?C=S&amp;O=D\">&nbsp;&darr;&nbsp;</a></th>"
+"<th><a href=\"?C=M&amp;O=A\">Date</a>&nbsp;<a href=\"?C=M&amp;O=D\">&nbsp;&darr;&nbsp;</a></th>"
+;
+static const u_char t06_list1_end[] = ""
 "</tr>"
 "</thead>"
 "\n"
@@ -96,6 +109,8 @@ static const u_char t08_foot1[] = ""
 	+ nfi_sizeof_ssz(t04_body1) \
 	+ nfi_sizeof_ssz(t05_body2) \
 	+ nfi_sizeof_ssz(t06_list1) \
+	+ nfi_sizeof_ssz(t06_list1_compact) \
+	+ nfi_sizeof_ssz(t06_list1_end) \
 	+ nfi_sizeof_ssz(t_parentdir_entry) \
 	+ nfi_sizeof_ssz(t07_list2) \
 	+ nfi_sizeof_ssz(t08_foot1) \